@@ -4,6 +4,7 @@
 #include <lib/cmdline.h>
 #include <acpi/acpi.h>
 #include <acpi/madt.h>
+#include <acpi/srat.h>
 #include <mm/mm.h>
 #include <sys/idt.h>
 #include <sys/panic.h>
@@ -54,6 +55,7 @@ rsdp_found:
 
     /* Call table inits */
     init_madt();
+    init_srat();
 }
 
 /* Find SDT by signature */
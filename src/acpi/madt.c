@@ -29,10 +29,10 @@ void init_madt(void) {
         return;
     }
 
-    madt_local_apics = kalloc(ACPI_TABLES_MAX);
-    madt_io_apics = kalloc(ACPI_TABLES_MAX);
-    madt_isos = kalloc(ACPI_TABLES_MAX);
-    madt_nmis = kalloc(ACPI_TABLES_MAX);
+    madt_local_apics = kalloc(ACPI_TABLES_MAX * sizeof(struct madt_local_apic_t *));
+    madt_io_apics = kalloc(ACPI_TABLES_MAX * sizeof(struct madt_io_apic_t *));
+    madt_isos = kalloc(ACPI_TABLES_MAX * sizeof(struct madt_iso_t *));
+    madt_nmis = kalloc(ACPI_TABLES_MAX * sizeof(struct madt_nmi_t *));
 
     /* parse the MADT entries */
     for (uint8_t *madt_ptr = (uint8_t *)(&madt->madt_entries_begin);
@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <acpi/acpi.h>
+#include <acpi/srat.h>
+#include <lib/klib.h>
+#include <mm/mm.h>
+#include <sys/cpu.h>
+
+int srat_available = 0;
+
+/* Proximity domains are numbered however the firmware likes, NUMA nodes are
+ * numbered densely from 0 in the order the SRAT lists their domains */
+static uint32_t node_domains[MAX_NUMA_NODES];
+static int node_count = 0;
+
+struct srat_apic_node_t {
+    uint32_t apic_id;
+    int node;
+};
+
+static struct srat_apic_node_t apic_nodes[MAX_CPUS];
+static size_t apic_node_i = 0;
+
+/* Relative memory latency between nodes, 10 being local as in the SLIT */
+static uint8_t node_distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+/* Returns -1 if the domain was not seen */
+static int srat_find_domain(uint32_t domain) {
+    for (int i = 0; i < node_count; i++)
+        if (node_domains[i] == domain)
+            return i;
+    return -1;
+}
+
+static int srat_domain_node(uint32_t domain) {
+    int node = srat_find_domain(domain);
+    if (node != -1)
+        return node;
+
+    if (node_count == MAX_NUMA_NODES) {
+        kprint(KPRN_WARN, "acpi/srat: Too many domains, domain %u folded into node 0", domain);
+        return 0;
+    }
+
+    node_domains[node_count] = domain;
+    return node_count++;
+}
+
+static void srat_add_apic(uint32_t apic_id, uint32_t domain) {
+    if (apic_node_i == MAX_CPUS)
+        return;
+
+    apic_nodes[apic_node_i].apic_id = apic_id;
+    apic_nodes[apic_node_i].node = srat_domain_node(domain);
+    apic_node_i++;
+}
+
+/* NUMA node of the CPU with the given APIC ID, 0 if the SRAT does not say */
+int srat_apic_node(uint32_t apic_id) {
+    for (size_t i = 0; i < apic_node_i; i++)
+        if (apic_nodes[i].apic_id == apic_id)
+            return apic_nodes[i].node;
+    return 0;
+}
+
+/* Take the distances between nodes from the SLIT, if there is one */
+static void init_slit(void) {
+    struct slit_t *slit = acpi_find_sdt("SLIT", 0);
+    if (!slit)
+        return;
+
+    for (uint64_t i = 0; i < slit->localities; i++) {
+        int from = srat_find_domain(i);
+        if (from == -1)
+            continue;
+        for (uint64_t j = 0; j < slit->localities; j++) {
+            int to = srat_find_domain(j);
+            if (to == -1)
+                continue;
+            node_distances[from][to] = slit->distances[i * slit->localities + j];
+        }
+    }
+}
+
+void init_srat(void) {
+    struct srat_t *srat = acpi_find_sdt("SRAT", 0);
+    if (!srat)
+        return;
+
+    srat_available = 1;
+
+    for (uint8_t *srat_ptr = (uint8_t *)(&srat->srat_entries_begin);
+        (size_t)srat_ptr < (size_t)srat + srat->sdt.length;
+        srat_ptr += *(srat_ptr + 1)) {
+        switch (*(srat_ptr)) {
+            case 0: {
+                /* processor local APIC affinity */
+                struct srat_lapic_t *lapic = (struct srat_lapic_t *)srat_ptr;
+                if (!(lapic->flags & 1))
+                    break;
+                uint32_t domain = lapic->domain_low
+                                | ((uint32_t)lapic->domain_high[0] << 8)
+                                | ((uint32_t)lapic->domain_high[1] << 16)
+                                | ((uint32_t)lapic->domain_high[2] << 24);
+                srat_add_apic(lapic->apic_id, domain);
+                break;
+            }
+            case 1: {
+                /* memory affinity */
+                struct srat_memory_t *memory = (struct srat_memory_t *)srat_ptr;
+                if (!(memory->flags & 1))
+                    break;
+                int node = srat_domain_node(memory->domain);
+                kprint(KPRN_INFO, "acpi/srat: Memory %X-%X on node %u",
+                       memory->base, memory->base + memory->length, node);
+                pmm_set_node(memory->base, memory->length, node);
+                break;
+            }
+            case 2: {
+                /* processor local x2APIC affinity */
+                struct srat_x2apic_t *x2apic = (struct srat_x2apic_t *)srat_ptr;
+                if (!(x2apic->flags & 1))
+                    break;
+                srat_add_apic(x2apic->x2apic_id, x2apic->domain);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    for (int i = 0; i < MAX_NUMA_NODES; i++)
+        for (int j = 0; j < MAX_NUMA_NODES; j++)
+            node_distances[i][j] = i == j ? 10 : 20;
+
+    init_slit();
+
+    kprint(KPRN_INFO, "acpi/srat: %u NUMA node(s)", node_count);
+
+    if (node_count > 1)
+        pmm_init_numa(node_count, node_distances);
+}
@@ -0,0 +1,62 @@
+#ifndef __SRAT_H__
+#define __SRAT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <acpi/acpi.h>
+
+struct srat_t {
+    struct sdt_t sdt;
+    uint32_t reserved0;
+    uint64_t reserved1;
+    uint8_t srat_entries_begin;
+} __attribute__((packed));
+
+struct srat_header_t {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct srat_lapic_t {
+    struct srat_header_t header;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory_t {
+    struct srat_header_t header;
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+struct srat_x2apic_t {
+    struct srat_header_t header;
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+} __attribute__((packed));
+
+struct slit_t {
+    struct sdt_t sdt;
+    uint64_t localities;
+    uint8_t distances[];
+} __attribute__((packed));
+
+extern int srat_available;
+
+int srat_apic_node(uint32_t);
+void init_srat(void);
+
+#endif
@@ -9,6 +9,8 @@ void init_dev_tty(void);
 void init_dev_ide(void);
 void init_dev_sata(void);
 void init_dev_vesafb(void);
+void init_dev_meminfo(void);
+void init_dev_schedinfo(void);
 
 void init_dev(void) {
     init_dev_streams();
@@ -17,6 +19,8 @@ void init_dev(void) {
     init_dev_nvme();
     init_dev_sata();
     init_dev_vesafb();
+    init_dev_meminfo();
+    init_dev_schedinfo();
     init_usb();
 
     /* Launch the device cache sync worker */
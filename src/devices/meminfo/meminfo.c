@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <devices/report/report.h>
+#include <mm/mm.h>
+
+/** /dev/meminfo **/
+
+/* Memory usage as text, one "name value" line per counter with byte counts,
+ * then a line per NUMA node with its free bytes, and a line per MEM_TAG_*
+ * subsystem with the bytes it holds from the PMM, its kalloc() objects and
+ * their bytes. */
+#define MEMINFO_SIZE 4096
+
+static void meminfo_render(struct report_t *report) {
+    struct memstats st;
+    getmemstats(&st);
+
+    report_line(report, "total", st.total);
+    report_line(report, "used", st.used);
+    report_line(report, "magazine_cached", st.magazine_cached);
+    report_line(report, "zero_pool_cached", st.zero_pool_cached);
+    report_line(report, "page_cache_cached", st.page_cache_cached);
+    report_line(report, "zswap_pages", st.zswap_pages);
+    report_line(report, "zswap_stored", st.zswap_stored);
+    report_line(report, "thp_mapped", st.thp_mapped);
+
+    /* What the slabs and metadata pages of kalloc() take on top of the
+     * objects handed out */
+    size_t kalloc_bytes = 0;
+    for (int i = 0; i < MEM_TAGS; i++)
+        kalloc_bytes += st.tag_kalloc_bytes[i];
+    size_t kalloc_pmm_bytes = st.tag_pmm_bytes[MEM_TAG_KALLOC];
+    report_line(report, "kalloc_overhead",
+                 kalloc_pmm_bytes > kalloc_bytes ? kalloc_pmm_bytes - kalloc_bytes : 0);
+
+    report_line(report, "numa_nodes", st.numa_nodes);
+    report_line(report, "numa_local", st.numa_local);
+    report_line(report, "numa_fallbacks", st.numa_fallbacks);
+
+    report_puts(report, "node free_bytes\n");
+    for (size_t i = 0; i < st.numa_nodes; i++) {
+        report_putu(report, i);
+        report_puts(report, " ");
+        report_putu(report, st.numa_free[i]);
+        report_puts(report, "\n");
+    }
+
+    report_puts(report, "tag pmm_bytes kalloc_objects kalloc_bytes\n");
+    for (int i = 0; i < MEM_TAGS; i++) {
+        report_puts(report, mem_tag_names[i]);
+        report_puts(report, " ");
+        report_putu(report, st.tag_pmm_bytes[i]);
+        report_puts(report, " ");
+        report_putu(report, st.tag_kalloc_objects[i]);
+        report_puts(report, " ");
+        report_putu(report, st.tag_kalloc_bytes[i]);
+        report_puts(report, "\n");
+    }
+}
+
+void init_dev_meminfo(void) {
+    report_device_add("meminfo", MEMINFO_SIZE, meminfo_render);
+}
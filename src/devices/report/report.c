@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <devices/report/report.h>
+#include <fs/devfs/devfs.h>
+#include <lib/klib.h>
+#include <lib/alloc.h>
+#include <lib/cstring.h>
+#include <lib/cmem.h>
+#include <sys/panic.h>
+
+/* Read-only devices whose contents are a text report, generated anew by
+ * their render function on every read */
+#define MAX_REPORT_DEVICES 8
+
+struct report_device_t {
+    size_t size;
+    report_render_t render;
+};
+
+static struct report_device_t report_devices[MAX_REPORT_DEVICES];
+static int report_device_count = 0;
+
+void report_puts(struct report_t *report, const char *str) {
+    while (*str && report->len < report->size)
+        report->data[report->len++] = *str++;
+}
+
+void report_putu(struct report_t *report, size_t n) {
+    char digits[21];
+    int i = sizeof(digits) - 1;
+
+    digits[i] = 0;
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+
+    report_puts(report, &digits[i]);
+}
+
+/* A "name value" line */
+void report_line(struct report_t *report, const char *name, size_t n) {
+    report_puts(report, name);
+    report_puts(report, " ");
+    report_putu(report, n);
+    report_puts(report, "\n");
+}
+
+static int report_write(int unused1, const void *unused2, uint64_t unused3, size_t unused4) {
+    (void)unused1;
+    (void)unused2;
+    (void)unused3;
+    (void)unused4;
+
+    errno = EROFS;
+    return -1;
+}
+
+static int report_read(int dev, void *buf, uint64_t loc, size_t count) {
+    struct report_device_t *device = &report_devices[dev];
+
+    struct report_t report = { kalloc(device->size), 0, device->size };
+    if (!report.data) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    device->render(&report);
+
+    if (loc >= report.len)
+        count = 0;
+    else if (count > report.len - loc)
+        count = report.len - loc;
+
+    memcpy(buf, report.data + loc, count);
+    kfree(report.data);
+
+    return (int)count;
+}
+
+/* Add a report device of at most size bytes of text */
+void report_device_add(const char *name, size_t size, report_render_t render) {
+    if (report_device_count == MAX_REPORT_DEVICES)
+        panic(NULL, 0, "Too many report devices");
+
+    int dev = report_device_count++;
+    report_devices[dev].size = size;
+    report_devices[dev].render = render;
+
+    struct device_t device = {0};
+
+    device.calls = default_device_calls;
+
+    strcpy(device.name, name);
+    device.intern_fd = dev;
+    /* Sized so that reads go through the file offset, they end early at
+     * the end of the report */
+    device.size = size;
+    device.calls.read = report_read;
+    device.calls.write = report_write;
+    device_add(&device);
+}
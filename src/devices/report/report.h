@@ -0,0 +1,21 @@
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include <stddef.h>
+
+/* Text being generated for a read of a report device, whatever goes past
+ * size is dropped */
+struct report_t {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+typedef void (*report_render_t)(struct report_t *);
+
+void report_puts(struct report_t *, const char *);
+void report_putu(struct report_t *, size_t);
+void report_line(struct report_t *, const char *, size_t);
+void report_device_add(const char *, size_t, report_render_t);
+
+#endif
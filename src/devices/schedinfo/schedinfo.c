@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <devices/report/report.h>
+#include <lib/alloc.h>
+#include <proc/task.h>
+
+/** /dev/schedinfo **/
+
+/* Scheduler counters as text, one "name value" line per counter, then a
+ * line per CPU with the threads on its run queue and the threads it took
+ * over from other CPUs. */
+#define SCHEDINFO_SIZE 8192
+
+static void schedinfo_render(struct report_t *report) {
+    struct schedstats *st = kalloc(sizeof(struct schedstats));
+    if (!st)
+        return;
+    getschedstats(st);
+
+    report_line(report, "cpus", st->cpus);
+    report_line(report, "steals", st->steals);
+    report_line(report, "migrations", st->migrations);
+
+    report_puts(report, "cpu queued steals migrations\n");
+    for (size_t i = 0; i < st->cpus; i++) {
+        report_putu(report, i);
+        report_puts(report, " ");
+        report_putu(report, st->cpu_queued[i]);
+        report_puts(report, " ");
+        report_putu(report, st->cpu_steals[i]);
+        report_puts(report, " ");
+        report_putu(report, st->cpu_migrations[i]);
+        report_puts(report, "\n");
+    }
+
+    kfree(st);
+}
+
+void init_dev_schedinfo(void) {
+    report_device_add("schedinfo", SCHEDINFO_SIZE, schedinfo_render);
+}
@@ -79,6 +79,8 @@ static int ide_write48(int disk, uint64_t sector, uint16_t count, uint8_t *buffe
 static ide_device ide_devices[DEVICE_COUNT];
 
 static lock_t ide_lock = new_lock;
+/* Blocks cached over all drives, protected by ide_lock */
+static size_t ide_cached_blocks = 0;
 
 static int find_block(int drive, uint64_t block) {
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++)
@@ -115,7 +117,10 @@ static int cache_block(int drive, uint64_t block) {
 
 fnd:
     /* Allocate some cache for this device */
-    ide_devices[drive].cache[targ].cache = kalloc(BYTES_PER_BLOCK);
+    ide_devices[drive].cache[targ].cache = kalloc_tagged(BYTES_PER_BLOCK, MEM_TAG_BLOCK_CACHE);
+    if (!ide_devices[drive].cache[targ].cache)
+        return -1;
+    ide_cached_blocks++;
 
 notfnd:
 
@@ -211,6 +216,50 @@ static int ide_flush(int device) {
     return 0;
 }
 
+static size_t ide_shrinker_count(void) {
+    spinlock_acquire(&ide_lock);
+    size_t bytes = ide_cached_blocks * BYTES_PER_BLOCK;
+    spinlock_release(&ide_lock);
+    return bytes;
+}
+
+static size_t ide_shrinker_scan(size_t bytes, int writeback) {
+    size_t freed = 0;
+
+    if (!spinlock_test_and_acquire(&ide_lock))
+        return 0;
+
+    for (int drive = 0; drive < DEVICE_COUNT && freed < bytes; drive++) {
+        if (!ide_devices[drive].exists || !ide_devices[drive].cache)
+            continue;
+        for (size_t i = 0; i < MAX_CACHED_BLOCKS && freed < bytes; i++) {
+            cached_sector_t *c = &ide_devices[drive].cache[i];
+            if (!c->status)
+                continue;
+            if (c->status == CACHE_DIRTY) {
+                if (!writeback)
+                    continue;
+                if (ide_write48(drive, c->block * SECTORS_PER_BLOCK, SECTORS_PER_BLOCK, c->cache) == -1)
+                    continue;
+            }
+            kfree(c->cache);
+            c->cache = NULL;
+            c->status = CACHE_NOT_READY;
+            ide_cached_blocks--;
+            freed += BYTES_PER_BLOCK;
+        }
+    }
+
+    spinlock_release(&ide_lock);
+    return freed;
+}
+
+static struct shrinker_t ide_shrinker = {
+    .name = "ide",
+    .count = ide_shrinker_count,
+    .scan = ide_shrinker_scan
+};
+
 void init_dev_ide(void) {
     kprint(KPRN_INFO, "ide: Initialising ide device driver...");
 
@@ -222,6 +271,8 @@ void init_dev_ide(void) {
         return;
     }
 
+    register_shrinker(&ide_shrinker);
+
     int j = 0;
     int master = 1;
     for (int i = 0; i < DEVICE_COUNT; i++) {
@@ -335,13 +386,13 @@ success:
     for (int i = 0; i < 256; i++)
         dev->identify[i] = port_in_w(dev->data_port);
 
-    dev->prdt_phys = (uint32_t)(size_t)pmm_allocz(1);
+    dev->prdt_phys = (uint32_t)(size_t)pmm_allocz_tagged(1, MEM_TAG_DEVICES);
     dev->prdt = (struct prdt_t *)((size_t)dev->prdt_phys + MEM_PHYS_OFFSET);
-    dev->prdt->buffer_phys = (uint32_t)(size_t)pmm_allocz(DIV_ROUNDUP(BYTES_PER_BLOCK, PAGE_SIZE));
+    dev->prdt->buffer_phys = (uint32_t)(size_t)pmm_allocz_tagged(DIV_ROUNDUP(BYTES_PER_BLOCK, PAGE_SIZE), MEM_TAG_DEVICES);
     dev->prdt_cache = (uint8_t *)((size_t)dev->prdt->buffer_phys + MEM_PHYS_OFFSET);
     dev->prdt->transfer_size = BYTES_PER_BLOCK;
     dev->prdt->mark_end = 0x8000;
-    dev->cache = kalloc(MAX_CACHED_BLOCKS * sizeof(cached_sector_t));
+    dev->cache = kalloc_tagged(MAX_CACHED_BLOCKS * sizeof(cached_sector_t), MEM_TAG_BLOCK_CACHE);
 
     uint32_t cmd_register = pci_read_device_dword(pci, 0x4);
     if (!(cmd_register & (1 << 2))) {
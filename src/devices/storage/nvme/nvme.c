@@ -54,13 +54,20 @@ typedef struct {
     size_t num_lbas;
     size_t cache_block_size;
     size_t max_transfer_shift;
+    /* Blocks in cache, protected by nvme_lock */
+    size_t cached_blocks;
 } nvme_device_t;
 
 nvme_device_t *nvme_devices;
+static int nvme_device_count = 0;
 
 void nvme_initialize_queue(int device, struct nvme_queue *queue, size_t queue_slots, size_t qid) {
-    queue->submit = kalloc(sizeof(struct nvme_command) * queue_slots);
-    queue->completion = kalloc(sizeof(struct nvme_completion) * queue_slots);
+    /* Queue bases have to be page aligned, which small kalloc() objects
+     * are not */
+    queue->submit = (struct nvme_command *)((size_t)pmm_allocz_tagged(
+        DIV_ROUNDUP(sizeof(struct nvme_command) * queue_slots, PAGE_SIZE), MEM_TAG_DEVICES) + MEM_PHYS_OFFSET);
+    queue->completion = (struct nvme_completion *)((size_t)pmm_allocz_tagged(
+        DIV_ROUNDUP(sizeof(struct nvme_completion) * queue_slots, PAGE_SIZE), MEM_TAG_DEVICES) + MEM_PHYS_OFFSET);
     queue->submit_db = (uint32_t*)((size_t)nvme_devices[device].nvme_base + PAGE_SIZE + (2 * qid * (4 << nvme_devices[device].doorbell_stride)));
     queue->complete_db = (uint32_t*)((size_t)nvme_devices[device].nvme_base + PAGE_SIZE + ((2 * qid + 1) * (4 << nvme_devices[device].doorbell_stride)));
     queue->queue_elements = queue_slots;
@@ -72,7 +79,7 @@ void nvme_initialize_queue(int device, struct nvme_queue *queue, size_t queue_sl
     queue->qid = qid;
     queue->command_id = 0;
 
-    queue->prps = kalloc(nvme_devices[device].max_prps * queue_slots * sizeof(uint64_t));
+    queue->prps = kalloc_tagged(nvme_devices[device].max_prps * queue_slots * sizeof(uint64_t), MEM_TAG_DEVICES);
 }
 
 void nvme_submit_cmd(struct nvme_queue *queue, struct nvme_command command) {
@@ -294,7 +301,10 @@ static int cache_block(int device, uint64_t block) {
     goto notfnd;
 
 fnd:
-    nvme_devices[device].cache[targ].cache = kalloc(nvme_devices[device].cache_block_size);
+    nvme_devices[device].cache[targ].cache = kalloc_tagged(nvme_devices[device].cache_block_size, MEM_TAG_BLOCK_CACHE);
+    if (!nvme_devices[device].cache[targ].cache)
+        return -1;
+    nvme_devices[device].cached_blocks++;
 
 notfnd:
     ret = nvme_rw_lba(device,
@@ -391,6 +401,53 @@ static int nvme_read(int device, void *buf, uint64_t loc, size_t count) {
     return (int)count;
 }
 
+static size_t nvme_shrinker_count(void) {
+    size_t bytes = 0;
+    for (int i = 0; i < nvme_device_count; i++) {
+        spinlock_acquire(&nvme_devices[i].nvme_lock);
+        bytes += nvme_devices[i].cached_blocks * nvme_devices[i].cache_block_size;
+        spinlock_release(&nvme_devices[i].nvme_lock);
+    }
+    return bytes;
+}
+
+static size_t nvme_shrinker_scan(size_t bytes, int writeback) {
+    size_t freed = 0;
+
+    for (int device = 0; device < nvme_device_count && freed < bytes; device++) {
+        nvme_device_t *dev = &nvme_devices[device];
+        if (!spinlock_test_and_acquire(&dev->nvme_lock))
+            continue;
+        for (size_t i = 0; i < MAX_CACHED_BLOCKS && freed < bytes; i++) {
+            cached_block_t *c = &dev->cache[i];
+            if (!c->status)
+                continue;
+            if (c->status == CACHE_DIRTY) {
+                if (!writeback)
+                    continue;
+                if (nvme_rw_lba(device, c->cache,
+                        (dev->cache_block_size / dev->lba_size) * c->block,
+                            (dev->cache_block_size / dev->lba_size), 1) == -1)
+                    continue;
+            }
+            kfree(c->cache);
+            c->cache = NULL;
+            c->status = CACHE_NOT_READY;
+            dev->cached_blocks--;
+            freed += dev->cache_block_size;
+        }
+        spinlock_release(&dev->nvme_lock);
+    }
+
+    return freed;
+}
+
+static struct shrinker_t nvme_shrinker = {
+    .name = "nvme",
+    .count = nvme_shrinker_count,
+    .scan = nvme_shrinker_scan
+};
+
 int nvme_init_device(struct pci_device_t *ndevice, int num) {
     nvme_device_t device = {0};
     device.nvme_lock = new_lock;
@@ -447,14 +504,14 @@ int nvme_init_device(struct pci_device_t *ndevice, int num) {
     }
     kprint(KPRN_INFO, "nvme: controller restarted");
 
-    struct nvme_id_ctrl *id = (struct nvme_id_ctrl *)kalloc(sizeof(struct nvme_id_ctrl));
+    struct nvme_id_ctrl *id = (struct nvme_id_ctrl *)kalloc_tagged(sizeof(struct nvme_id_ctrl), MEM_TAG_DEVICES);
     int status = nvme_identify(num, id);
     if (status != 0) {
         kprint(KPRN_ERR, "nvme: Failed to identify NVME device");
         return -1;
     }
 
-	struct nvme_id_ns *id_ns = kalloc(sizeof(struct nvme_id_ns));
+	struct nvme_id_ns *id_ns = kalloc_tagged(sizeof(struct nvme_id_ns), MEM_TAG_DEVICES);
     nvme_get_ns_info(num, 1, id_ns);
     if (status != 0) {
         kprint(KPRN_ERR, "nvme: Failed to get namespace info for namespace 1");
@@ -477,7 +534,10 @@ int nvme_init_device(struct pci_device_t *ndevice, int num) {
     nvme_devices[num].lba_size = 1 << id_ns->lbaf[formatted_lba].ds;
     kprint(KPRN_INFO, "nvme: namespace 1 size %X lbas, lba size: %X bytes", id_ns->nsze, nvme_devices[num].lba_size);
     nvme_devices[num].num_lbas = id_ns->nsze;
-    nvme_devices[num].cache = kalloc(sizeof(cached_block_t) * MAX_CACHED_BLOCKS);
+    nvme_devices[num].cache = kalloc_tagged(sizeof(cached_block_t) * MAX_CACHED_BLOCKS, MEM_TAG_BLOCK_CACHE);
+    nvme_device_count = num + 1;
+    if (!num)
+        register_shrinker(&nvme_shrinker);
 
     static const char *nvme_basename = "nvme";
     struct device_t vfs_device = {0};
@@ -503,6 +563,6 @@ void init_dev_nvme(void) {
         return;
     }
     kprint(KPRN_INFO, "nvme: Found NVME controller");
-    nvme_devices = kalloc(sizeof(nvme_device_t));
+    nvme_devices = kalloc_tagged(sizeof(nvme_device_t), MEM_TAG_DEVICES);
     nvme_init_device(ndevice, 0);
 }
@@ -9,10 +9,12 @@
 #include <lib/cstring.h>
 #include <lib/cmem.h>
 #include <sys/panic.h>
+#include <mm/mm.h>
 
 static int ahci_read(int drive, void *buf, uint64_t loc, size_t count);
 static int ahci_write(int drive, const void *buf, uint64_t loc, size_t count);
 static int ahci_flush(int device);
+static struct shrinker_t ahci_shrinker;
 
 static const char *sata_basename = "sata";
 
@@ -107,7 +109,7 @@ static void stop_cmd(volatile struct hba_port_t *port) {
 
 void init_dev_sata(void) {
     struct pci_device_t *device;
-    ahci_devices = kalloc(MAX_AHCI_DEVICES * sizeof(struct ahci_device_t));
+    ahci_devices = kalloc_tagged(MAX_AHCI_DEVICES * sizeof(struct ahci_device_t), MEM_TAG_DEVICES);
 
     device = pci_get_device(AHCI_CLASS, AHCI_SUBCLASS, AHCI_PROG_IF, 0);
     if (!device) {
@@ -119,6 +121,8 @@ void init_dev_sata(void) {
 
     kprint(KPRN_INFO, "ahci: Found AHCI controller");
 
+    register_shrinker(&ahci_shrinker);
+
     struct pci_bar_t bar = {0};
     panic_if(pci_read_bar(device, 5, &bar));
     panic_unless(bar.is_mmio);
@@ -164,11 +168,11 @@ void init_dev_sata(void) {
 /* Allocate space for command lists, tables etc for a given port */
 static void port_rebase(volatile struct hba_port_t *port) {
     /* allocate an area for the command list */
-    port->clb = (uint32_t)(size_t)pmm_allocz(1);
+    port->clb = (uint32_t)(size_t)pmm_allocz_tagged(1, MEM_TAG_DEVICES);
     port->clbu = 0;
 
     /* Reserve some memory for the hba fis receive area and setup values */
-    struct hba_fis_t *hba_fis = kalloc(sizeof(struct hba_fis_t));
+    struct hba_fis_t *hba_fis = kalloc_tagged(sizeof(struct hba_fis_t), MEM_TAG_DEVICES);
 
     /* set fis types in fis receive area */
     hba_fis->dsfis.fis_type = FIS_TYPE_DMA_SETUP;
@@ -187,7 +191,7 @@ static void port_rebase(volatile struct hba_port_t *port) {
         cmd_hdr[i].prdtl = 8;
 
         /* command table base addr = 40K + 8K * portno + header index * 256 */
-        cmd_hdr[i].ctba = (uint32_t)(size_t)pmm_allocz(1);
+        cmd_hdr[i].ctba = (uint32_t)(size_t)pmm_allocz_tagged(1, MEM_TAG_DEVICES);
         cmd_hdr[i].ctbau = 0;
     }
 
@@ -196,7 +200,7 @@ static void port_rebase(volatile struct hba_port_t *port) {
 
 static int init_ahci_device(struct ahci_device_t *device,
         volatile struct hba_port_t *port, uint8_t cmd) {
-    uint16_t *identify = pmm_allocz(1);
+    uint16_t *identify = pmm_allocz_tagged(1, MEM_TAG_DEVICES);
     int spin = 0;
 
     int slot = find_cmdslot(port);
@@ -266,7 +270,7 @@ static int init_ahci_device(struct ahci_device_t *device,
     device->exists = 1;
     device->port = port;
     device->sector_count = *((uint64_t *)((size_t)&identify[100] + MEM_PHYS_OFFSET));
-    device->cache = kalloc(MAX_CACHED_BLOCKS * sizeof(struct cached_block_t));
+    device->cache = kalloc_tagged(MAX_CACHED_BLOCKS * sizeof(struct cached_block_t), MEM_TAG_BLOCK_CACHE);
 
     kprint(KPRN_INFO, "ahci: Sector count = %U", device->sector_count);
     kprint(KPRN_INFO, "ahci: Identify successful");
@@ -379,6 +383,8 @@ static int ahci_rw(volatile struct hba_port_t *port,
 }
 
 static lock_t ahci_lock = new_lock;
+/* Blocks cached over all drives, protected by ahci_lock */
+static size_t ahci_cached_blocks = 0;
 
 static int find_block(int drive, uint64_t block) {
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++)
@@ -417,7 +423,10 @@ static int cache_block(int drive, uint64_t block) {
 
 fnd:
     /* Allocate some cache for this device */
-    ahci_devices[drive].cache[targ].cache = kalloc(BYTES_PER_BLOCK);
+    ahci_devices[drive].cache[targ].cache = kalloc_tagged(BYTES_PER_BLOCK, MEM_TAG_BLOCK_CACHE);
+    if (!ahci_devices[drive].cache[targ].cache)
+        return -1;
+    ahci_cached_blocks++;
 
 notfnd:
 
@@ -516,3 +525,48 @@ static int ahci_flush(int device) {
     spinlock_release(&ahci_lock);
     return 0;
 }
+
+static size_t ahci_shrinker_count(void) {
+    spinlock_acquire(&ahci_lock);
+    size_t bytes = ahci_cached_blocks * BYTES_PER_BLOCK;
+    spinlock_release(&ahci_lock);
+    return bytes;
+}
+
+static size_t ahci_shrinker_scan(size_t bytes, int writeback) {
+    size_t freed = 0;
+
+    if (!spinlock_test_and_acquire(&ahci_lock))
+        return 0;
+
+    for (int drive = 0; drive < MAX_AHCI_DEVICES && freed < bytes; drive++) {
+        if (!ahci_devices[drive].exists)
+            continue;
+        for (size_t i = 0; i < MAX_CACHED_BLOCKS && freed < bytes; i++) {
+            struct cached_block_t *c = &ahci_devices[drive].cache[i];
+            if (!c->status)
+                continue;
+            if (c->status == CACHE_DIRTY) {
+                if (!writeback)
+                    continue;
+                if (ahci_rw(ahci_devices[drive].port, c->block * SECTORS_PER_BLOCK,
+                            SECTORS_PER_BLOCK, (void *)c->cache, 1) == -1)
+                    continue;
+            }
+            kfree(c->cache);
+            c->cache = NULL;
+            c->status = CACHE_NOT_READY;
+            ahci_cached_blocks--;
+            freed += BYTES_PER_BLOCK;
+        }
+    }
+
+    spinlock_release(&ahci_lock);
+    return freed;
+}
+
+static struct shrinker_t ahci_shrinker = {
+    .name = "ahci",
+    .count = ahci_shrinker_count,
+    .scan = ahci_shrinker_scan
+};
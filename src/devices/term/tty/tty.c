@@ -193,9 +193,9 @@ void init_tty_extended(uint32_t *__fb,
         ttys[i].tcioff = 0;
         ttys[i].dec_private_mode = 0;
         ttys[i].decckm = 0;
-        ttys[i].grid = kalloc(rows * cols);
-        ttys[i].gridbg = kalloc(rows * cols * sizeof(uint32_t));
-        ttys[i].gridfg = kalloc(rows * cols * sizeof(uint32_t));
+        ttys[i].grid = kalloc_tagged(rows * cols, MEM_TAG_DEVICES);
+        ttys[i].gridbg = kalloc_tagged(rows * cols * sizeof(uint32_t), MEM_TAG_DEVICES);
+        ttys[i].gridfg = kalloc_tagged(rows * cols * sizeof(uint32_t), MEM_TAG_DEVICES);
         if (!ttys[i].grid || !ttys[i].gridbg || !ttys[i].gridfg)
             panic(NULL, 0, "Out of memory");
         for (size_t j = 0; j < (size_t)(rows * cols); j++) {
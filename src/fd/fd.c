@@ -23,6 +23,7 @@ int poll(struct pollfd *fds, size_t nfds, int timeout) {
     if (timeout < 0) {
         timeout_target = 0xffffffffffffffff; // effectively disable a timeout
     } else {
+        time_update();
         timeout_target = (uptime_raw + (timeout * (PIT_FREQUENCY_HZ / 1000))) + 1;
     }
 
@@ -92,6 +93,14 @@ int getpath(int fd, char *buf) {
     return ret;
 }
 
+int reopen(int fd, int mode) {
+    struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
+    int intern_fd = fd_ptr->intern_fd;
+    int ret = fd_ptr->fd_handler.reopen(intern_fd, mode);
+    dynarray_unref(file_descriptors, fd);
+    return ret;
+}
+
 int getfdflags(int fd) {
     struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
     int ret = fd_ptr->fdflags;
@@ -104,6 +104,7 @@ struct fd_handler_t {
     int (*unlink)(int);
     int (*getpath)(int, char *);
     ssize_t (*recv)(int fd, void *buf, size_t len, int flags);
+    int (*reopen)(int, int);
 };
 
 struct file_descriptor_t {
@@ -152,6 +153,7 @@ int setfdflags(int, int);
 
 int getpath(int, char *);
 ssize_t recv(int fd, void *buf, size_t len, int flags);
+int reopen(int, int);
 
 __attribute__((unused)) static int bogus_fstat() {
     errno = EINVAL;
@@ -241,6 +243,11 @@ __attribute__((unused)) static int bogus_recv() {
     return -1;
 }
 
+__attribute__((unused)) static int bogus_reopen() {
+    errno = EINVAL;
+    return -1;
+}
+
 __attribute__((unused)) static struct fd_handler_t default_fd_handler = {
     (void *)bogus_close,
     (void *)bogus_fstat,
@@ -258,7 +265,8 @@ __attribute__((unused)) static struct fd_handler_t default_fd_handler = {
     (void *)bogus_perfmon_attach,
     (void *)bogus_unlink,
     (void *)bogus_getpath,
-    (void *)bogus_recv
+    (void *)bogus_recv,
+    (void *)bogus_reopen
 };
 
 #endif
@@ -11,6 +11,7 @@
 struct vfs_handle_t {
     struct fs_t *fs;
     int intern_fd;
+    int magic;
 };
 
 struct mnt_t {
@@ -189,7 +190,7 @@ int vfs_install_fs(struct fs_t *filesystem) {
         if (!p[i])
             p[i] = (size_t)vfs_call_invalid;
 
-    struct fs_t *fs_glob = kalloc(sizeof(struct fs_t));
+    struct fs_t *fs_glob = kalloc_tagged(sizeof(struct fs_t), MEM_TAG_FS);
     *fs_glob = *filesystem;
     return ht_add(struct fs_t, filesystems, fs_glob);
 }
@@ -320,24 +321,15 @@ int mkdir(const char *path) {
     return fs->mkdir(loc_path, magic);
 }
 
-int open(const char *path, int mode) {
-    struct vfs_handle_t vfs_handle = {0};
-
-    char *loc_path;
-
-    struct mnt_t *mountpoint = vfs_get_mountpoint(path, &loc_path);
-    if (!mountpoint)
-        return -1;
-
-    int magic = mountpoint->magic;
-    struct fs_t *fs = mountpoint->fs;
+static int vfs_reopen(int, int);
 
-    int intern_fd = fs->open(loc_path, mode, magic);
-    if (intern_fd == -1)
-        return -1;
+/* Wrap a filesystem handle into a new file descriptor */
+static int vfs_create_fd(struct fs_t *fs, int intern_fd, int magic) {
+    struct vfs_handle_t vfs_handle = {0};
 
     vfs_handle.fs = fs;
     vfs_handle.intern_fd = intern_fd;
+    vfs_handle.magic = magic;
 
     int vfs_fd = dynarray_add(struct vfs_handle_t, vfs_handles, &vfs_handle);
 
@@ -358,6 +350,7 @@ int open(const char *path, int mode) {
     vfs_functions.tcflow = vfs_tcflow;
     vfs_functions.isatty = vfs_isatty;
     vfs_functions.unlink = vfs_unlink;
+    vfs_functions.reopen = vfs_reopen;
 
     fd.fd_handler = vfs_functions;
 
@@ -367,6 +360,48 @@ int open(const char *path, int mode) {
     return fd_create(&fd);
 }
 
+int open(const char *path, int mode) {
+    char *loc_path;
+
+    struct mnt_t *mountpoint = vfs_get_mountpoint(path, &loc_path);
+    if (!mountpoint)
+        return -1;
+
+    int magic = mountpoint->magic;
+    struct fs_t *fs = mountpoint->fs;
+
+    int intern_fd = fs->open(loc_path, mode, magic);
+    if (intern_fd == -1)
+        return -1;
+
+    return vfs_create_fd(fs, intern_fd, magic);
+}
+
+/* Open the file behind fd again, with a file position of its own */
+static int vfs_reopen(int fd, int mode) {
+    struct vfs_handle_t *fd_ptr = dynarray_getelem(struct vfs_handle_t, vfs_handles, fd);
+    struct fs_t *fs = fd_ptr->fs;
+    int intern_fd = fd_ptr->intern_fd;
+    int magic = fd_ptr->magic;
+    dynarray_unref(vfs_handles, fd);
+
+    char *loc_path = kalloc_tagged(2048, MEM_TAG_FS);
+    if (!loc_path) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int new_intern_fd = -1;
+    if (fs->getpath(intern_fd, loc_path) != -1)
+        new_intern_fd = fs->open(loc_path, mode, magic);
+    kfree(loc_path);
+
+    if (new_intern_fd == -1)
+        return -1;
+
+    return vfs_create_fd(fs, new_intern_fd, magic);
+}
+
 void init_fd_vfs(void) {
     ht_init(filesystems);
     ht_init(mountpoints);
@@ -383,7 +418,7 @@ int mount(const char *source, const char *target,
     if (res == -1)
         return -1;
 
-    struct mnt_t *mount = kalloc(sizeof(struct mnt_t));
+    struct mnt_t *mount = kalloc_tagged(sizeof(struct mnt_t), MEM_TAG_FS);
 
     strcpy(mount->name, target);
     mount->fs = fs;
@@ -154,7 +154,7 @@ static int devfs_read(int fd, void *ptr, size_t len) {
 
     if (devfs_handle->size)
         if (devfs_handle->ptr + len >= devfs_handle->size)
-            len -= devfs_handle->size - devfs_handle->ptr;
+            len = devfs_handle->size - devfs_handle->ptr;
 
     int ret = devfs_handle->device->calls.read(
                 devfs_handle->dev_fd,
@@ -8,6 +8,7 @@
 #include <sys/panic.h>
 #include <lib/cstring.h>
 #include <lib/cmem.h>
+#include <mm/mm.h>
 
 #define SEARCH_FAILURE          0xffffffffffffffff
 #define ROOT_ID                 0xffffffffffffffff
@@ -21,11 +22,6 @@
 #define RESERVED_BLOCK          0xfffffffffffffff0
 #define END_OF_CHAIN            0xffffffffffffffff
 
-#define CACHE_NOTREADY 0
-#define CACHE_READY 1
-
-#define MAX_CACHED_BLOCKS 8192
-
 struct entry_t {
     uint64_t parent_id;
     uint8_t type;
@@ -50,20 +46,12 @@ struct path_result_t {
     uint8_t type;
 };
 
-struct cached_block_t {
-    uint8_t *cache;
-    uint64_t block;
-    int status;
-};
-
 struct cached_file_t {
     char name[2048];
     size_t refcount;
     int unlinked;
     struct mount_t *mnt;
     struct path_result_t path_res;
-    struct cached_block_t *cached_blocks;
-    int overwritten_slot;
     uint64_t *alloc_map;
     uint64_t total_blocks;
 };
@@ -202,93 +190,135 @@ static int erase_file(struct cached_file_t *cached_file, int update_entry) {
                 break;
         }
     }
-    // clean up cache
-    struct cached_block_t *cached_blocks = cached_file->cached_blocks;
-    for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++) {
-        if (cached_blocks[i].status) {
-            cached_blocks[i].status = CACHE_NOTREADY;
-            kfree(cached_blocks[i].cache);
-        }
-    }
+    // clean up cache, an unlinked file already gave up its key
+    if (!cached_file->unlinked)
+        page_cache_invalidate(mnt->device, cached_file->path_res.target_entry + 1);
     // clean up metadata
     cached_file->path_res.target.payload = END_OF_CHAIN;
     cached_file->path_res.target.size = 0;
     cached_file->total_blocks = 0;
     kfree(cached_file->alloc_map);
-    cached_file->alloc_map = kalloc(sizeof(uint64_t));
+    cached_file->alloc_map = kalloc_tagged(sizeof(uint64_t), MEM_TAG_FS);
     if (update_entry)
         wr_entry(mnt, cached_file->path_res.target_entry, &cached_file->path_res.target);
 
     return 0;
 }
 
-static int find_block(struct cached_file_t *cached_file, uint64_t block) {
-    struct cached_block_t *cached_blocks = cached_file->cached_blocks;
+/* Make sure the file has at least block_count blocks allocated */
+static int ensure_blocks(struct cached_file_t *cached_file, uint64_t block_count) {
+    struct mount_t *mnt = cached_file->mnt;
 
-    for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++)
-        if ((cached_blocks[i].block == block)
-            && (cached_blocks[i].status))
-            return i;
+    if (block_count <= cached_file->total_blocks)
+        return 0;
 
-    return -1;
+    uint64_t *alloc_map = krealloc(cached_file->alloc_map,
+                                   block_count * sizeof(uint64_t));
+    if (!alloc_map)
+        return -1;
+    cached_file->alloc_map = alloc_map;
+
+    for (uint64_t i = cached_file->total_blocks; i < block_count; i++) {
+        uint64_t new_block;
+        if (!i) {
+            new_block = allocate_empty_block(mnt, 0);
+            cached_file->path_res.target.payload = new_block;
+            wr_entry(mnt, cached_file->path_res.target_entry, &cached_file->path_res.target);
+        } else {
+            new_block = allocate_empty_block(mnt, alloc_map[i - 1]);
+        }
+        alloc_map[i] = new_block;
+    }
+    cached_file->total_blocks = block_count;
+
+    return 0;
 }
 
-static int cache_block(struct cached_file_t *cached_file, uint64_t block) {
-    struct cached_block_t *cached_blocks = cached_file->cached_blocks;
+/* Read page index of a file from disk, the part of it past the end of the
+ * file is left zeroed */
+static int fill_page(void *arg, void *buf, uint64_t index) {
+    struct cached_file_t *cached_file = arg;
     struct mount_t *mnt = cached_file->mnt;
-    int targ;
+    uint64_t size = cached_file->path_res.target.size;
+    uint64_t loc = index * PAGE_SIZE;
 
-    /* Find empty block */
-    for (targ = 0; targ < MAX_CACHED_BLOCKS; targ++)
-        if (!cached_blocks[targ].status) goto fnd;
+    if (loc >= size)
+        return 0;
 
-    /* Slot not find, overwrite another */
-    if (cached_file->overwritten_slot == MAX_CACHED_BLOCKS)
-        cached_file->overwritten_slot = 0;
+    uint64_t count = PAGE_SIZE;
+    if (count > size - loc)
+        count = size - loc;
 
-    targ = cached_file->overwritten_slot++;
+    uint64_t progress = 0;
+    while (progress < count) {
+        uint64_t block = (loc + progress) / mnt->bytesperblock;
+        uint64_t offset = (loc + progress) % mnt->bytesperblock;
+        if (block >= cached_file->total_blocks)
+            break;
 
-    goto notfnd;
+        uint64_t chunk = count - progress;
+        if (chunk > mnt->bytesperblock - offset)
+            chunk = mnt->bytesperblock - offset;
 
-fnd:
-    /* Allocate some cache for this device */
-    cached_blocks[targ].cache = kalloc(mnt->bytesperblock);
-    if (!cached_blocks[targ].cache)
-        return -1;
+        lseek(mnt->device,
+              cached_file->alloc_map[block] * mnt->bytesperblock + offset,
+              SEEK_SET);
+        if (read(mnt->device, buf + progress, chunk) == -1)
+            return -1;
 
-notfnd:
-
-    /* Check if said block exists */
-    if (block >= cached_file->total_blocks) {
-        uint64_t new_block_count = block + 1;
-        cached_file->alloc_map = krealloc(cached_file->alloc_map,
-                    new_block_count * sizeof(uint64_t));
-        for (uint64_t i = cached_file->total_blocks; i < new_block_count; i++) {
-            uint64_t new_block;
-            if (!i) {
-                new_block = allocate_empty_block(mnt, 0);
-                cached_file->path_res.target.payload = new_block;
-                wr_entry(mnt, cached_file->path_res.target_entry, &cached_file->path_res.target);
-            } else {
-                new_block = allocate_empty_block(mnt, cached_file->alloc_map[i - 1]);
-            }
-            cached_file->alloc_map[i] = new_block;
-        }
-        cached_file->total_blocks = new_block_count;
+        progress += chunk;
     }
 
-    /* Load sector into cache */
-    lseek(mnt->device,
-          cached_file->alloc_map[block] * mnt->bytesperblock,
-          SEEK_SET);
-    read(mnt->device,
-         cached_blocks[targ].cache,
-         mnt->bytesperblock);
+    return 0;
+}
 
-    cached_blocks[targ].block = block;
-    cached_blocks[targ].status = CACHE_READY;
+/* Get a referenced frame holding page index of the file. The pages of
+ * unlinked files are not cached anymore, as their entry may be reused. */
+static void *get_page(struct cached_file_t *cached_file, uint64_t index) {
+    struct mount_t *mnt = cached_file->mnt;
 
-    return targ;
+    if (!cached_file->unlinked)
+        return page_cache_get(mnt->device, cached_file->path_res.target_entry + 1,
+                              index, fill_page, cached_file);
+
+    void *page = pmm_allocz_tagged(1, MEM_TAG_USER);
+    if (page && fill_page(cached_file, (void *)((size_t)page + MEM_PHYS_OFFSET), index)) {
+        pmm_free(page, 1);
+        page = NULL;
+    }
+    return page;
+}
+
+/* Write the blocks covering [offset, offset + len) of page index of the file
+ * back to disk, limited to the part of them inside the page */
+static int write_page(struct cached_file_t *cached_file, const uint8_t *data,
+                      uint64_t index, uint64_t offset, uint64_t len) {
+    struct mount_t *mnt = cached_file->mnt;
+    uint64_t page_loc = index * PAGE_SIZE;
+    uint64_t loc = page_loc + offset;
+    uint64_t top = loc + len;
+
+    loc -= loc % mnt->bytesperblock;
+    if (loc < page_loc)
+        loc = page_loc;
+
+    while (loc < top) {
+        uint64_t block = loc / mnt->bytesperblock;
+        uint64_t block_top = (block + 1) * mnt->bytesperblock;
+        if (block_top > page_loc + PAGE_SIZE)
+            block_top = page_loc + PAGE_SIZE;
+
+        lseek(mnt->device,
+              cached_file->alloc_map[block] * mnt->bytesperblock
+                + loc % mnt->bytesperblock,
+              SEEK_SET);
+        if (write(mnt->device, data + (loc - page_loc), block_top - loc) == -1)
+            return -1;
+
+        loc = block_top;
+    }
+
+    return 0;
 }
 
 static int echfs_read(int handle, void *buf, size_t count) {
@@ -316,25 +346,22 @@ static int echfs_read(int handle, void *buf, size_t count) {
     struct cached_file_t *cached_file = echfs_handle->cached_file;
     uint64_t progress = 0;
     while (progress < count) {
-        /* cache the block */
-        uint64_t block = (echfs_handle->ptr + progress) / mnt->bytesperblock;
-        int slot = find_block(cached_file, block);
-        if (slot == -1) {
-            slot = cache_block(cached_file, block);
-            if (slot == -1) {
-                spinlock_release(&mnt->lock);
-                dynarray_unref(handles, handle);
-                errno = EIO;
-                return -1;
-            }
+        uint64_t index = (echfs_handle->ptr + progress) / PAGE_SIZE;
+        void *page = get_page(cached_file, index);
+        if (!page) {
+            spinlock_release(&mnt->lock);
+            dynarray_unref(handles, handle);
+            errno = EIO;
+            return -1;
         }
 
         uint64_t chunk = count - progress;
-        uint64_t offset = (echfs_handle->ptr + progress) % mnt->bytesperblock;
-        if (chunk > mnt->bytesperblock - offset)
-            chunk = mnt->bytesperblock - offset;
+        uint64_t offset = (echfs_handle->ptr + progress) % PAGE_SIZE;
+        if (chunk > PAGE_SIZE - offset)
+            chunk = PAGE_SIZE - offset;
 
-        memcpy(buf + progress, &cached_file->cached_blocks[slot].cache[offset], chunk);
+        memcpy(buf + progress, (void *)((size_t)page + MEM_PHYS_OFFSET + offset), chunk);
+        pmm_page_unref(page);
         progress += chunk;
     }
 
@@ -368,35 +395,43 @@ static int echfs_write(int handle, const void *buf, size_t count) {
         echfs_handle->ptr = echfs_handle->end;
 
     struct cached_file_t *cached_file = echfs_handle->cached_file;
+
+    uint64_t block_count = (echfs_handle->ptr + count + mnt->bytesperblock - 1)
+                         / mnt->bytesperblock;
+    if (ensure_blocks(cached_file, block_count)) {
+        spinlock_release(&mnt->lock);
+        dynarray_unref(handles, handle);
+        errno = EIO;
+        return -1;
+    }
+
     uint64_t progress = 0;
     while (progress < count) {
-        /* cache the block */
-        uint64_t block = (echfs_handle->ptr + progress) / mnt->bytesperblock;
-        int slot = find_block(cached_file, block);
-        if (slot == -1) {
-            slot = cache_block(cached_file, block);
-            if (slot == -1) {
-                spinlock_release(&mnt->lock);
-                dynarray_unref(handles, handle);
-                errno = EIO;
-                return -1;
-            }
+        /* Update the cached page and write it through */
+        uint64_t index = (echfs_handle->ptr + progress) / PAGE_SIZE;
+        void *page = get_page(cached_file, index);
+        if (!page) {
+            spinlock_release(&mnt->lock);
+            dynarray_unref(handles, handle);
+            errno = EIO;
+            return -1;
         }
 
         uint64_t chunk = count - progress;
-        uint64_t offset = (echfs_handle->ptr + progress) % mnt->bytesperblock;
-        if (chunk > mnt->bytesperblock - offset)
-            chunk = mnt->bytesperblock - offset;
-
-        memcpy(&cached_file->cached_blocks[slot].cache[offset], buf + progress, chunk);
-
-        struct cached_block_t *cached_blocks = cached_file->cached_blocks;
-        lseek(mnt->device,
-              cached_file->alloc_map[cached_blocks[slot].block] * mnt->bytesperblock,
-              SEEK_SET);
-        write(mnt->device,
-              cached_blocks[slot].cache,
-              mnt->bytesperblock);
+        uint64_t offset = (echfs_handle->ptr + progress) % PAGE_SIZE;
+        if (chunk > PAGE_SIZE - offset)
+            chunk = PAGE_SIZE - offset;
+
+        uint8_t *data = (uint8_t *)((size_t)page + MEM_PHYS_OFFSET);
+        memcpy(data + offset, buf + progress, chunk);
+        int ret = write_page(cached_file, data, index, offset, chunk);
+        pmm_page_unref(page);
+        if (ret) {
+            spinlock_release(&mnt->lock);
+            dynarray_unref(handles, handle);
+            errno = EIO;
+            return -1;
+        }
 
         progress += chunk;
     }
@@ -418,7 +453,6 @@ static int actually_delete_file(struct cached_file_t *cached_file) {
     erase_file(cached_file, 0);
 
     kfree(cached_file->alloc_map);
-    kfree(cached_file->cached_blocks);
     kfree(cached_file);
 
     return 0;
@@ -444,6 +478,7 @@ static int echfs_unlink(int handle) {
 
     struct cached_file_t *cached_file = echfs_handle->cached_file;
 
+    page_cache_invalidate(mnt->device, cached_file->path_res.target_entry + 1);
     cached_file->unlinked = 1;
 
     struct entry_t deleted_entry = {0};
@@ -624,7 +659,7 @@ static struct cached_file_t *cache_file(struct mount_t *mnt, const char *path) {
     if (path_result.failure)
         return NULL;
 
-    struct cached_file_t *cached_file = kalloc(sizeof(struct cached_file_t));
+    struct cached_file_t *cached_file = kalloc_tagged(sizeof(struct cached_file_t), MEM_TAG_FS);
     if (!cached_file)
         return NULL;
 
@@ -634,11 +669,8 @@ static struct cached_file_t *cache_file(struct mount_t *mnt, const char *path) {
     cached_file->mnt = mnt;
 
     if (path_result.not_found || path_result.type == FILE_TYPE) {
-        cached_file->cached_blocks =
-            kalloc(MAX_CACHED_BLOCKS * sizeof(struct cached_block_t));
-
         cached_file->total_blocks = 0;
-        cached_file->alloc_map = kalloc(sizeof(uint64_t));
+        cached_file->alloc_map = kalloc_tagged(sizeof(uint64_t), MEM_TAG_FS);
     }
 
     if (!path_result.not_found && path_result.type == FILE_TYPE) {
@@ -7,6 +7,7 @@
 #include <lib/errno.h>
 #include <lib/cstring.h>
 #include <lib/cmem.h>
+#include <mm/mm.h>
 
 #define SECTORSHIFT 9
 
@@ -129,7 +130,7 @@ static struct fs_entry_t parse_path(struct mount_t *mnt, const char *path) {
     path++;
 
     size_t fat_len = mnt->volumeid.sectors_per_fat * SECTORSIZE;
-    uint32_t *fat = kalloc(fat_len);
+    uint32_t *fat = kalloc_tagged(fat_len, MEM_TAG_FS);
     read_offset(mnt->device, SECTOR_TO_OFFSET(mnt->info.fat_offset), fat, fat_len);
 
     struct fs_entry_t ent = {0};
@@ -262,6 +263,62 @@ static int fat32_close(int handle) {
     return 0;
 }
 
+struct fill_ctx_t {
+    struct mount_t *mnt;
+    struct fs_entry_t *ent;
+    uint32_t *fat;
+};
+
+/* Read page index of a file from the device by walking its cluster chain, the
+ * part past the end of the file is left zeroed */
+static int fill_page(void *arg, void *buf, uint64_t index) {
+    struct fill_ctx_t *ctx = arg;
+    struct mount_t *mnt = ctx->mnt;
+    size_t fat_len = mnt->volumeid.sectors_per_fat * SECTORSIZE;
+    size_t bytes_per_cluster = mnt->volumeid.sectors_per_cluster * SECTORSIZE;
+    size_t loc = index * PAGE_SIZE;
+
+    if (loc >= ctx->ent->file_size)
+        return 0;
+
+    size_t count = min(PAGE_SIZE, ctx->ent->file_size - loc);
+
+    /* The FAT is only read in once per read() call, and only on a miss */
+    if (!ctx->fat) {
+        ctx->fat = kalloc_tagged(fat_len, MEM_TAG_FS);
+        if (!ctx->fat)
+            return -1;
+        read_offset(mnt->device, SECTOR_TO_OFFSET(mnt->info.fat_offset), ctx->fat, fat_len);
+    }
+
+    size_t cluster = ctx->ent->begin_cluster;
+    for (size_t i = loc / bytes_per_cluster; i; i--) {
+        cluster = next_cluster(cluster, ctx->fat, fat_len);
+        if (!cluster)
+            return -1;
+    }
+
+    size_t progress = 0;
+    while (progress < count) {
+        size_t offset = (loc + progress) % bytes_per_cluster;
+        size_t chunk = min(count - progress, bytes_per_cluster - offset);
+
+        read_offset(mnt->device,
+                    CLUSTER_TO_OFFSET(cluster, mnt->info.cluster_begin_offset,
+                                      mnt->volumeid.sectors_per_cluster) + offset,
+                    buf + progress, chunk);
+        progress += chunk;
+
+        if (progress < count) {
+            cluster = next_cluster(cluster, ctx->fat, fat_len);
+            if (!cluster)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int fat32_read(int handle, void *buf, size_t count) {
     // Get the handle.
     struct handle_t *hdl = dynarray_getelem(struct handle_t, handles, handle);
@@ -282,38 +339,32 @@ static int fat32_read(int handle, void *buf, size_t count) {
         return 0;
     }
 
-    size_t fat_len = mnt->volumeid.sectors_per_fat * SECTORSIZE;
-    uint32_t *fat = kalloc(fat_len);
-    read_offset(mnt->device, SECTOR_TO_OFFSET(mnt->info.fat_offset), fat, fat_len);
-
-    size_t read_size = min(count, ent.file_size);
-
-    size_t bytes_per_cluster = mnt->volumeid.sectors_per_cluster * SECTORSIZE;
-    size_t cluster_bytes = ((read_size + bytes_per_cluster - 1) / bytes_per_cluster) * bytes_per_cluster;
-
-    size_t cluster_offset = (hdl->offset + bytes_per_cluster - 1) / bytes_per_cluster;
-    size_t cluster = ent.begin_cluster;
-    while (cluster_offset--) cluster = next_cluster(cluster, fat, fat_len);
-    size_t index = 0;
-
-    while (index + hdl->offset < read_size) {
-        size_t off = CLUSTER_TO_OFFSET(cluster, mnt->info.cluster_begin_offset,
-                                    mnt->volumeid.sectors_per_cluster) + (hdl->offset % bytes_per_cluster);
-
-        size_t read_amount = min(cluster_bytes - index, bytes_per_cluster);
-
-        if (read_amount > read_size - index) read_amount = read_size - index;
-
-        read_offset(mnt->device, off, (buf + index), read_amount);
+    size_t read_size = min(count, ent.file_size - hdl->offset);
+
+    // File data goes through the page cache, keyed by the first cluster.
+    struct fill_ctx_t ctx = { mnt, &ent, NULL };
+    size_t progress = 0;
+    while (progress < read_size) {
+        size_t index = (hdl->offset + progress) / PAGE_SIZE;
+        void *page = page_cache_get(mnt->device, ent.begin_cluster, index,
+                                    fill_page, &ctx);
+        if (!page) {
+            kfree(ctx.fat);
+            dynarray_unref(handles, handle);
+            spinlock_release(&mnt->lock);
+            errno = EIO;
+            return -1;
+        }
 
-        index += bytes_per_cluster;
+        size_t offset = (hdl->offset + progress) % PAGE_SIZE;
+        size_t chunk = min(read_size - progress, PAGE_SIZE - offset);
 
-        if (index + hdl->offset < read_size) {
-            cluster = next_cluster(cluster, fat, fat_len);
-        }
+        memcpy(buf + progress, (void *)((size_t)page + MEM_PHYS_OFFSET + offset), chunk);
+        pmm_page_unref(page);
+        progress += chunk;
     }
 
-    kfree(fat);
+    kfree(ctx.fat);
     hdl->offset += read_size;
 
     dynarray_unref(handles, handle);
@@ -356,12 +407,10 @@ static int fat32_fstat(int handle, struct stat *st) {
     struct mount_t *mnt = hdl->mount;
     spinlock_acquire(&mnt->lock);
 
-    hdl->refcount++;
-
     int is_dir = hdl->entry.attrib & ATTRIB_DIR;
 
     st->st_dev = mnt->device;
-    st->st_ino = 1;
+    st->st_ino = hdl->entry.begin_cluster;
     st->st_nlink = 1;
     st->st_uid = 1;
     st->st_gid = 1;
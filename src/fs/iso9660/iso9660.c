@@ -6,6 +6,7 @@
 #include <lib/errno.h>
 #include <lib/cstring.h>
 #include <lib/cmem.h>
+#include <mm/mm.h>
 
 #define SECTOR_SIZE 2048
 #define FILE_TYPE 0
@@ -273,13 +274,38 @@ static int cache_block(struct mount_t *mount, uint32_t block) {
 
     int loc = cache->block * mount->block_size;
     if (!cache->cache)
-        cache->cache = kalloc(mount->block_size);
+        cache->cache = kalloc_tagged(mount->block_size, MEM_TAG_BLOCK_CACHE);
     lseek(mount->device, loc, SEEK_SET);
     read(mount->device, cache->cache, mount->block_size);
     cache->ready = 1;
     return cache_index;
 }
 
+/* Read page index of the file open at handle_s from the device, the part
+ * past the end of the file is left zeroed */
+static int fill_page(void *arg, void *buf, uint64_t index) {
+    struct handle_t *handle_s = arg;
+    struct mount_t *mount = &mounts[handle_s->mount];
+    size_t size = handle_s->path_res.target.extent_length.little;
+    size_t loc = index * PAGE_SIZE;
+
+    if (loc >= size)
+        return 0;
+
+    size_t count = PAGE_SIZE;
+    if (count > size - loc)
+        count = size - loc;
+
+    lseek(mount->device,
+          (size_t)handle_s->path_res.target.extent_location.little
+            * mount->block_size + loc,
+          SEEK_SET);
+    if (read(mount->device, buf, count) == -1)
+        return -1;
+
+    return 0;
+}
+
 static struct rr_px load_rr_px(const char *sysarea, int length) {
     struct rr_px res = {0};
     int pos = 0;
@@ -323,7 +349,7 @@ static char *load_rr_tf(const char *sysarea, int length) {
     if (pos - 1 == length)
         return NULL;
 
-    char *res = kalloc(sysarea[pos + 2]);
+    char *res = kalloc_tagged(sysarea[pos + 2], MEM_TAG_FS);
     memcpy(res, sysarea + pos, sysarea[pos + 2]);
     return res;
 }
@@ -336,7 +362,7 @@ static struct directory_result_t load_dir(struct mount_t *mount,
       return result;
     }
     int loc = dir->extent_location.little;
-    result.entries = kalloc(dir->extent_length.little);
+    result.entries = kalloc_tagged(dir->extent_length.little, MEM_TAG_FS);
 
     int num_blocks = dir->extent_length.little / mount->block_size;
     if (dir->extent_length.little % mount->block_size)
@@ -420,12 +446,12 @@ static char *load_name(struct directory_entry_t *entry, size_t *name_length) {
     if (rrnamelen) {
         /* rock ridge naming scheme */
         name_len = rrnamelen;
-        buf = kalloc(name_len);
+        buf = kalloc_tagged(name_len, MEM_TAG_FS);
         memcpy(buf, sysarea + 5, name_len);
         buf[name_len] = '\0';
     } else {
         name_len = entry->name_length;
-        buf = kalloc(name_len);
+        buf = kalloc_tagged(name_len, MEM_TAG_FS);
         for(size_t j = 0; j < name_len; j++)
             buf[j] = tolower(entry->name[j]);
     }
@@ -472,7 +498,7 @@ static struct path_result_t resolve_path(struct mount_t *mount,
 
             result.rr_length = entry->length - sizeof(struct directory_entry_t) - entry->name_length;
             if (result.rr_length) {
-                result.rr_area = kalloc(result.rr_length);
+                result.rr_area = kalloc_tagged(result.rr_length, MEM_TAG_FS);
                 unsigned char* sysarea = ((unsigned char*)entry) + sizeof(
                         struct directory_entry_t) + entry->name_length;
                 memcpy(result.rr_area, sysarea, result.rr_length);
@@ -565,22 +591,26 @@ static int iso9660_read(int handle, void *buf, size_t count) {
         return 0;
     }
 
+    /* File data goes through the page cache, keyed by the extent of the
+     * file, the block cache is left to directories */
     uint64_t progress = 0;
     while (progress < count) {
-        size_t block = handle_s->begin + ((handle_s->offset + progress)
-                / mount->block_size);
-        int cache = cache_block(mount, block);
-        if (cache == -1) {
+        uint64_t index = (handle_s->offset + progress) / PAGE_SIZE;
+        void *page = page_cache_get(mount->device,
+                                    handle_s->path_res.target.extent_location.little,
+                                    index, fill_page, handle_s);
+        if (!page) {
             spinlock_release(&iso9660_lock);
             return -1;
         }
 
         uint64_t chunk = count - progress;
-        uint64_t offset = (handle_s->offset + progress) % mount->block_size;
-        if (chunk > mount->block_size - offset)
-            chunk = mount->block_size - offset;
+        uint64_t offset = (handle_s->offset + progress) % PAGE_SIZE;
+        if (chunk > PAGE_SIZE - offset)
+            chunk = PAGE_SIZE - offset;
 
-        memcpy(buf + progress, mount->cache[cache].cache + offset, chunk);
+        memcpy(buf + progress, (void *)((size_t)page + MEM_PHYS_OFFSET + offset), chunk);
+        pmm_page_unref(page);
         progress += chunk;
     }
     handle_s->offset += count;
@@ -649,6 +679,8 @@ static int iso9660_fstat(int handle, struct stat *st) {
         st->st_mode = 0660;
         if (handle_s->path_res.target.flags & FILE_FLAG_DIR)
             st->st_mode |= S_IFDIR;
+        else
+            st->st_mode |= S_IFREG;
         st->st_ino = handle_s->path_res.target.extent_location.little;
         st->st_nlink = 1;
 
@@ -673,7 +705,9 @@ static int iso9660_fstat(int handle, struct stat *st) {
         spinlock_release(&iso9660_lock);
         return -1;
     }
-    st->st_ino = px.ino.little;
+    /* The extent, not the Rock Ridge serial number, which is not even
+     * guaranteed to be unique: it is what file data is cached under */
+    st->st_ino = handle_s->path_res.target.extent_location.little;
     st->st_nlink = px.links.little;
     st->st_uid = px.uid.little;
     st->st_gid = px.gid.little;
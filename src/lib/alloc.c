@@ -1,20 +1,208 @@
 #include <stddef.h>
 #include <lib/alloc.h>
 #include <lib/klib.h>
+#include <lib/lock.h>
 #include <mm/mm.h>
 #include <lib/cmem.h>
 
+/* Objects up to SLAB_MAX_SIZE bytes are served from single page slabs,
+ * anything bigger goes straight to the PMM with a metadata page in front.
+ * Every MEM_TAG_* subsystem has its own set of slab caches, so that objects
+ * are accounted to the tag they were allocated with without a header. */
+#define SLAB_MIN_SHIFT 3
+#define SLAB_MAX_SHIFT 11
+#define SLAB_MAX_SIZE ((size_t)1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
 typedef struct {
     size_t pages;
     size_t size;
+    int tag;
 } alloc_metadata_t;
 
-void *kalloc(size_t size) {
+struct slab_cache_t;
+
+/* Lives at the very start of every slab page. Objects are laid out after it,
+ * naturally aligned to their size class, so a slab object is never page
+ * aligned and its header is found by masking off the page offset. */
+struct slab_t {
+    struct slab_cache_t *cache;
+    struct slab_t *next;
+    struct slab_t *prev;
+    void *free_list;
+    size_t in_use;
+};
+
+struct slab_cache_t {
+    size_t obj_size;
+    size_t first_obj;
+    /* Slabs with at least one free object, empty ones included */
+    struct slab_t *partial;
+    size_t empty_slabs;
+    /* Objects handed out */
+    size_t objects;
+    lock_t lock;
+};
+
+#define SLAB_FIRST_OBJ(size) \
+    (((sizeof(struct slab_t) + (size) - 1) / (size)) * (size))
+
+#define SLAB_CACHE(shift) \
+    { (size_t)1 << (shift), SLAB_FIRST_OBJ((size_t)1 << (shift)), NULL, 0, 0, new_lock }
+
+static struct slab_cache_t slab_caches[MEM_TAGS][SLAB_CLASSES] = {
+    [0 ... MEM_TAGS - 1] = {
+        SLAB_CACHE(3),
+        SLAB_CACHE(4),
+        SLAB_CACHE(5),
+        SLAB_CACHE(6),
+        SLAB_CACHE(7),
+        SLAB_CACHE(8),
+        SLAB_CACHE(9),
+        SLAB_CACHE(10),
+        SLAB_CACHE(11)
+    }
+};
+
+/* Objects bigger than SLAB_MAX_SIZE handed out per tag, and their sizes */
+static size_t large_objects[MEM_TAGS];
+static size_t large_bytes[MEM_TAGS];
+
+static inline struct slab_cache_t *slab_cache_for(size_t size, int tag) {
+    size_t i = 0;
+    while (((size_t)1 << (i + SLAB_MIN_SHIFT)) < size)
+        i++;
+    return &slab_caches[tag][i];
+}
+
+static inline int slab_cache_tag(struct slab_cache_t *cache) {
+    return (cache - &slab_caches[0][0]) / SLAB_CLASSES;
+}
+
+static inline void slab_link(struct slab_cache_t *cache, struct slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial)
+        cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+static inline void slab_unlink(struct slab_cache_t *cache, struct slab_t *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cache->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/* Grab a fresh page from the PMM and thread all its objects on a free list */
+static struct slab_t *slab_create(struct slab_cache_t *cache) {
+    char *page = pmm_alloc_tagged(1, MEM_TAG_KALLOC);
+    if (!page)
+        return NULL;
+    page += MEM_PHYS_OFFSET;
+
+    struct slab_t *slab = (struct slab_t *)page;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    for (size_t off = PAGE_SIZE - cache->obj_size;
+         off >= cache->first_obj; off -= cache->obj_size) {
+        void **obj = (void **)(page + off);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    return slab;
+}
+
+static void *slab_alloc(struct slab_cache_t *cache) {
+    struct slab_t *fresh = NULL;
+
+    spinlock_acquire(&cache->lock);
+
+    struct slab_t *slab = cache->partial;
+    if (!slab) {
+        /* Getting a page may reclaim memory, which can allocate from this
+         * very cache, so the lock is dropped meanwhile */
+        spinlock_release(&cache->lock);
+        if (!(fresh = slab_create(cache)))
+            return NULL;
+        spinlock_acquire(&cache->lock);
+
+        /* Somebody else may have filled the cache in the meantime */
+        if (!(slab = cache->partial)) {
+            slab = fresh;
+            fresh = NULL;
+            slab_link(cache, slab);
+            cache->empty_slabs++;
+        }
+    }
+
+    void **obj = slab->free_list;
+    slab->free_list = *obj;
+
+    if (!slab->in_use++)
+        cache->empty_slabs--;
+    cache->objects++;
+
+    /* Slab is now full, stop considering it for allocations */
+    if (!slab->free_list)
+        slab_unlink(cache, slab);
+
+    spinlock_release(&cache->lock);
+
+    if (fresh)
+        pmm_free((void *)((size_t)fresh - MEM_PHYS_OFFSET), 1);
+
+    memset(obj, 0, cache->obj_size);
+    return obj;
+}
+
+static void slab_free(void *ptr) {
+    struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+    struct slab_cache_t *cache = slab->cache;
+
+    spinlock_acquire(&cache->lock);
+
+    /* Slab was full, make it available again */
+    if (!slab->free_list)
+        slab_link(cache, slab);
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    cache->objects--;
+
+    if (!--slab->in_use) {
+        /* Keep a single empty slab around per cache to avoid bouncing
+         * pages back and forth with the PMM, release the rest */
+        if (cache->empty_slabs) {
+            slab_unlink(cache, slab);
+            pmm_free((void *)((size_t)slab - MEM_PHYS_OFFSET), 1);
+        } else {
+            cache->empty_slabs++;
+        }
+    }
+
+    spinlock_release(&cache->lock);
+}
+
+static inline int is_slab_object(void *ptr) {
+    return (size_t)ptr & (PAGE_SIZE - 1);
+}
+
+/* Allocate zeroed memory accounted to tag */
+void *kalloc_tagged(size_t size, int tag) {
+    if (size <= SLAB_MAX_SIZE)
+        return slab_alloc(slab_cache_for(size, tag));
+
     size_t page_count = size / PAGE_SIZE;
 
     if (size % PAGE_SIZE) page_count++;
 
-    char *ptr = pmm_allocz(page_count + 1);
+    char *ptr = pmm_allocz_tagged(page_count + 1, MEM_TAG_KALLOC);
 
     if (!ptr) {
         return (void *)0;
@@ -27,13 +215,32 @@ void *kalloc(size_t size) {
 
     metadata->pages = page_count;
     metadata->size = size;
+    metadata->tag = tag;
+
+    atomic_add_uint64_relaxed(&large_objects[tag], 1);
+    atomic_add_uint64_relaxed(&large_bytes[tag], size);
 
     return (void *)ptr;
 }
 
+void *kalloc(size_t size) {
+    return kalloc_tagged(size, MEM_TAG_OTHER);
+}
+
 void kfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    if (is_slab_object(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+
     alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
 
+    atomic_add_uint64_relaxed(&large_objects[metadata->tag], -1);
+    atomic_add_uint64_relaxed(&large_bytes[metadata->tag], -metadata->size);
+
     pmm_free((void *)((size_t)metadata - MEM_PHYS_OFFSET), metadata->pages + 1);
 }
 
@@ -45,28 +252,65 @@ void *krealloc(void *ptr, size_t new) {
         return (void *)0;
     }
 
-    /* Reference metadata page */
-    alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+    size_t old_size;
+    int tag;
+
+    if (is_slab_object(ptr)) {
+        struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+        tag = slab_cache_tag(slab->cache);
 
-    if ((metadata->size + PAGE_SIZE - 1) / PAGE_SIZE
-         == (new + PAGE_SIZE - 1) / PAGE_SIZE) {
-        metadata->size = new;
-        return ptr;
+        /* Still fits the same size class */
+        if (new <= SLAB_MAX_SIZE && slab_cache_for(new, tag) == slab->cache)
+            return ptr;
+
+        old_size = slab->cache->obj_size;
+    } else {
+        /* Reference metadata page */
+        alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+        tag = metadata->tag;
+
+        if (new > SLAB_MAX_SIZE
+         && (metadata->size + PAGE_SIZE - 1) / PAGE_SIZE
+             == (new + PAGE_SIZE - 1) / PAGE_SIZE) {
+            atomic_add_uint64_relaxed(&large_bytes[tag], new - metadata->size);
+            metadata->size = new;
+            return ptr;
+        }
+
+        old_size = metadata->size;
     }
 
     char *new_ptr;
-    if ((new_ptr = kalloc(new)) == 0) {
+    if ((new_ptr = kalloc_tagged(new, tag)) == 0) {
         return (void *)0;
     }
 
-    if (metadata->size > new)
+    if (old_size > new)
         /* Copy all the data from the old pointer to the new pointer,
          * within the range specified by `size`. */
         memcpy(new_ptr, (char *)ptr, new);
     else
-        memcpy(new_ptr, (char *)ptr, metadata->size);
+        memcpy(new_ptr, (char *)ptr, old_size);
 
     kfree(ptr);
 
     return new_ptr;
 }
+
+/* Fill in the kalloc() objects and bytes handed out per tag */
+void kalloc_stats(struct memstats *memstats) {
+    for (int i = 0; i < MEM_TAGS; i++) {
+        size_t objects = 0, bytes = 0;
+
+        /* Read unlocked, the caller may be allocating with a cache locked */
+        for (int j = 0; j < SLAB_CLASSES; j++) {
+            struct slab_cache_t *cache = &slab_caches[i][j];
+            size_t n = locked_read(size_t, &cache->objects);
+            objects += n;
+            bytes += n * cache->obj_size;
+        }
+
+        memstats->tag_kalloc_objects[i] = objects + locked_read(size_t, &large_objects[i]);
+        memstats->tag_kalloc_bytes[i] = bytes + locked_read(size_t, &large_bytes[i]);
+    }
+}
@@ -3,9 +3,13 @@
 
 #include <stddef.h>
 
+struct memstats;
+
 void init_alloc(void);
 void *kalloc(size_t);
+void *kalloc_tagged(size_t, int);
 void kfree(void *);
 void *krealloc(void *, size_t);
+void kalloc_stats(struct memstats *);
 
 #endif
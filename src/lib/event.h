@@ -11,9 +11,8 @@ static inline int events_await(event_t **event, int *out_events, int n) {
     int wake = 0;
 
     for(int i = 0; i < n; i++) {
-        if(locked_read(event_t, event[i])) {
+        if(locked_dec_if_positive(event[i])) {
             wake = 1;
-            locked_dec(event[i]);
             out_events[i] = 1;
         }
     }
@@ -21,17 +20,30 @@ static inline int events_await(event_t **event, int *out_events, int n) {
         return 0;
     }
 
+    /* Linked to the events by the scheduler while the thread is blocked */
+    struct event_waiter_t waiters[n];
+
     struct thread_t *current_thread = task_table[cpu_locals[current_cpu].current_task];
     current_thread->event_num = n;
     current_thread->out_event_ptr = out_events;
+    current_thread->event_waiters = waiters;
     locked_write(event_t **, &current_thread->event_ptr, event);
-    yield();
-    if (locked_read(int, &current_thread->event_abrt))
-        return -1;
+
+    /* Whoever wakes the thread up clears event_ptr, it is still set if the
+     * thread only got resumed after a pause */
+    do {
+        yield();
+        if (locked_read(int, &current_thread->event_abrt)) {
+            locked_write(event_t **, &current_thread->event_ptr, NULL);
+            return -1;
+        }
+    } while (locked_read(event_t **, &current_thread->event_ptr));
+
     return 0;
 }
 
 static inline int events_await_timeout(event_t **event, int *out_events, int n, size_t timeout) {
+    time_update();
     uint64_t yield_target = (uptime_raw + (timeout * (PIT_FREQUENCY_HZ / 1000))) + 1;
     struct thread_t *current_thread = task_table[cpu_locals[current_cpu].current_task];
     current_thread->event_timeout = yield_target;
@@ -58,6 +70,7 @@ static inline int event_await(event_t *event) {
 
 static inline void event_trigger(event_t *event) {
     locked_inc(event);
+    event_wake(event);
 }
 
 #endif
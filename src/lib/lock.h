@@ -78,6 +78,26 @@ typedef struct {
     ret; \
 })
 
+/* Decrement an int unless it is zero or below, non-zero if it did */
+#define locked_dec_if_positive(var) ({ \
+    int ret = 0; \
+    int old = *(volatile int *)(var); \
+    while (old > 0) { \
+        int expected = old; \
+        asm volatile ( \
+            "lock cmpxchg %1, %2;" \
+            : "+a" (old), "+m" (*(var)) \
+            : "r" (expected - 1) \
+            : "memory", "cc" \
+        ); \
+        if (old == expected) { \
+            ret = 1; \
+            break; \
+        } \
+    } \
+    ret; \
+})
+
 // TODO: Move this somewhere else
 #define __puts_uint(val) ({ \
     char buf[21] = {0}; \
@@ -77,7 +77,7 @@ static inline struct rb_node *rb_get_unc(struct rb_node *node) {
     return rb_get_sib(rb_get_par(node));
 }
 
-static inline void *rb_rotate(struct rb_node *root, int direction,
+static inline void rb_rotate(struct rb_node *root, int direction,
                               struct rb_root *tree) {
     int root_pos = rb_get_pos(root);
     struct rb_node *root_parent = rb_get_par(root);
@@ -135,6 +135,7 @@ static inline int rb_insert(struct rb_root *root, rb_comp comp,
     rb_set_desc(node, 0, NULL);
     rb_set_desc(node, 1, NULL);
     if (root->root == NULL) {
+        rb_set_par(node, NULL);
         root->root = node;
         rb_set_color(root->root, RB_COLOR_BLACK);
         return 1;
@@ -175,15 +176,15 @@ static inline void rb_memswap(char *p1, char *p2, size_t size) {
         uint64_t *pl2 = (uint64_t *)p2;
         size_t count = size / 8;
         for (size_t i = 0; i < count; ++i) {
-            uint64_t tmp = *pl1;
-            *pl1 = *pl2;
-            *pl2 = tmp;
+            uint64_t tmp = pl1[i];
+            pl1[i] = pl2[i];
+            pl2[i] = tmp;
         }
     } else {
         for (size_t i = 0; i < size; ++i) {
-            char tmp = *p1;
-            *p1 = *p2;
-            *p2 = tmp;
+            char tmp = p1[i];
+            p1[i] = p2[i];
+            p2[i] = tmp;
         }
     }
 }
@@ -240,14 +241,19 @@ static void rb_fix_double_black(struct rb_root *root, struct rb_node *node) {
     if (rb_get_color(red_nephew) == RB_COLOR_BLACK) {
         red_nephew = rb_get_desc(sib, 0);
     }
+    enum rb_color par_color = rb_get_color(par);
     if (rb_get_pos(node) == rb_get_pos(red_nephew)) {
+        // near nephew, it ends up on top in place of par
         rb_rotate(sib, 1 - rb_get_pos(node), root);
         rb_rotate(par, rb_get_pos(node), root);
-        rb_set_color(red_nephew, RB_COLOR_BLACK);
+        rb_set_color(red_nephew, par_color);
     } else {
+        // far nephew, sib ends up on top in place of par
         rb_rotate(par, rb_get_pos(node), root);
+        rb_set_color(sib, par_color);
         rb_set_color(red_nephew, RB_COLOR_BLACK);
     }
+    rb_set_color(par, RB_COLOR_BLACK);
 }
 
 // 0 - there is no such node, 1 - node deleted
@@ -261,7 +267,12 @@ static inline void rb_delete(struct rb_root *root, struct rb_node *node) {
     }
     // if it is a single-child parent, it must be black
     if (chld != NULL) {
-        rb_set_desc(rb_get_par(node), rb_get_pos(node), chld);
+        if (rb_get_par(node) == NULL) {
+            root->root = chld;
+            rb_set_par(chld, NULL);
+        } else {
+            rb_set_desc(rb_get_par(node), rb_get_pos(node), chld);
+        }
         rb_set_color(chld, RB_COLOR_BLACK);
         kfree(node);
         return;
@@ -273,6 +284,11 @@ static inline void rb_delete(struct rb_root *root, struct rb_node *node) {
         return;
     }
     // now node is nothing but black leaf
+    if (rb_get_par(node) == NULL) {
+        root->root = NULL;
+        kfree(node);
+        return;
+    }
     rb_fix_double_black(root, node);
     rb_set_desc(rb_get_par(node), rb_get_pos(node), NULL);
     kfree(node);
@@ -294,4 +310,28 @@ static inline struct rb_node *rb_query(struct rb_root *root,
     return NULL;
 }
 
+// leftmost node, NULL if the tree is empty
+static inline struct rb_node *rb_first(struct rb_root *root) {
+    struct rb_node *node = root->root;
+    while (rb_get_desc(node, 0) != NULL) {
+        node = rb_get_desc(node, 0);
+    }
+    return node;
+}
+
+// in-order successor, NULL if node is the last one
+static inline struct rb_node *rb_next(struct rb_node *node) {
+    if (rb_get_desc(node, 1) != NULL) {
+        node = rb_get_desc(node, 1);
+        while (rb_get_desc(node, 0) != NULL) {
+            node = rb_get_desc(node, 0);
+        }
+        return node;
+    }
+    while (rb_get_par(node) != NULL && rb_get_pos(node) == 1) {
+        node = rb_get_par(node);
+    }
+    return rb_get_par(node);
+}
+
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <lib/klib.h>
 #include <lib/part.h>
 #include <lib/scsi.h>
+#include <mm/mm.h>
 
 #define MAX_CACHED_BLOCKS 8192
 #define CACHE_BLOCK_SIZE 65536
@@ -32,6 +33,9 @@ struct scsi_dev_t {
 
 dynarray_new(struct scsi_dev_t, devices);
 
+/* Blocks cached over all devices, protected by scsi_lock */
+static size_t scsi_cached_blocks = 0;
+
 static int scsi_internal_read(struct scsi_dev_t *device, void *buf,
                               uint32_t lba, size_t size) {
     struct scsi_read_10_t read_cmd = {0};
@@ -101,7 +105,10 @@ static int cache_block(struct scsi_dev_t *device, uint64_t block) {
     goto notfnd;
 
 fnd:
-    device->cache[targ].cache = kalloc(CACHE_BLOCK_SIZE);
+    device->cache[targ].cache = kalloc_tagged(CACHE_BLOCK_SIZE, MEM_TAG_BLOCK_CACHE);
+    if (!device->cache[targ].cache)
+        return -1;
+    scsi_cached_blocks++;
 
 notfnd:
     ret = scsi_internal_read(device, device->cache[targ].cache, block,
@@ -202,6 +209,57 @@ static int scsi_flush_cache(int drive) {
     return 0;
 }
 
+static size_t scsi_shrinker_count(void) {
+    spinlock_acquire(&scsi_lock);
+    size_t bytes = scsi_cached_blocks * CACHE_BLOCK_SIZE;
+    spinlock_release(&scsi_lock);
+    return bytes;
+}
+
+static size_t scsi_shrinker_scan(size_t bytes, int writeback) {
+    size_t freed = 0;
+
+    if (!spinlock_test_and_acquire(&scsi_lock))
+        return 0;
+    if (!spinlock_test_and_acquire(&devices_lock)) {
+        spinlock_release(&scsi_lock);
+        return 0;
+    }
+
+    for (size_t d = 0; d < devices_i && freed < bytes; d++) {
+        if (!devices[d] || !devices[d]->present)
+            continue;
+        struct scsi_dev_t *device = &devices[d]->data;
+        for (size_t i = 0; i < MAX_CACHED_BLOCKS && freed < bytes; i++) {
+            struct cached_block_t *c = &device->cache[i];
+            if (!c->status)
+                continue;
+            if (c->status == CACHE_DIRTY) {
+                if (!writeback)
+                    continue;
+                if (scsi_internal_write(device, c->cache, c->block,
+                                        CACHE_BLOCK_SIZE) == -1)
+                    continue;
+            }
+            kfree(c->cache);
+            c->cache = NULL;
+            c->status = 0;
+            scsi_cached_blocks--;
+            freed += CACHE_BLOCK_SIZE;
+        }
+    }
+
+    spinlock_release(&devices_lock);
+    spinlock_release(&scsi_lock);
+    return freed;
+}
+
+static struct shrinker_t scsi_shrinker = {
+    .name = "scsi",
+    .count = scsi_shrinker_count,
+    .scan = scsi_shrinker_scan
+};
+
 int scsi_register(int intern_fd, char *name,
                   int (*send_cmd)(int, char *, size_t, char *, size_t, int)) {
     struct scsi_dev_t device = {0};
@@ -224,13 +282,16 @@ int scsi_register(int intern_fd, char *name,
     kprint(KPRN_INFO, "lba num and block size: %x %x", lba_num, block_size);
     device.block_size = block_size;
 
-    device.cache = kalloc(sizeof(struct cached_block_t) * MAX_CACHED_BLOCKS);
+    device.cache = kalloc_tagged(sizeof(struct cached_block_t) * MAX_CACHED_BLOCKS, MEM_TAG_BLOCK_CACHE);
     ret = dynarray_add(struct scsi_dev_t, devices, &device);
     if (ret < 0) {
         kfree(device.cache);
         return -1;
     }
 
+    if (!ret)
+        register_shrinker(&scsi_shrinker);
+
     struct device_t dev = {0};
     dev.calls = default_device_calls;
     strcpy(dev.name, name);
@@ -1,17 +1,95 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <lib/time.h>
+#include <lib/lock.h>
+#include <lib/klib.h>
+#include <lib/rand.h>
+#include <sys/cpu.h>
 #include <sys/pit.h>
 
+#define TSC_CALIBRATE_MS 20
+#define CPUID_INVARIANT_TSC (1 << 8)
+
 volatile uint64_t uptime_raw = 0;
 volatile uint64_t uptime_sec = 0;
 volatile uint64_t unix_epoch = 0;
 
-void tick_handler(void) {
-    if (!(++uptime_raw % PIT_FREQUENCY_HZ)) {
-        uptime_sec++;
-        unix_epoch++;
+/* Once the TSC is calibrated, uptime_raw follows it rather than counting
+ * PIT ticks, so that time keeps going while the PIT is stopped. The PIT
+ * tick, timer interrupts and reschedules bring it up to date. */
+static lock_t time_lock = new_lock;
+/* TSC cycles per tick of uptime_raw, 0 if the TSC cannot keep time */
+static uint64_t tsc_per_tick = 0;
+/* TSC at the last tick accounted in uptime_raw */
+static uint64_t tsc_last_tick = 0;
+
+static void time_advance(uint64_t ticks) {
+    uint64_t old = uptime_raw;
+    uint64_t secs = (old + ticks) / PIT_FREQUENCY_HZ - old / PIT_FREQUENCY_HZ;
+
+    uptime_raw = old + ticks;
+    uptime_sec += secs;
+    unix_epoch += secs;
+}
+
+/* Measure the TSC against the PIT, which must be ticking. Only an invariant
+ * TSC, which runs at the same rate in every CPU and power state, is used. */
+void time_calibrate_tsc(void) {
+    uint32_t a, b, c, d;
+    if (!cpuid(0x80000007, 0, &a, &b, &c, &d) || !(d & CPUID_INVARIANT_TSC)) {
+        kprint(KPRN_INFO, "time: No invariant TSC, the PIT keeps ticking");
+        return;
     }
+
+    /* Start right on a tick */
+    uint64_t start = uptime_raw;
+    while (uptime_raw == start);
+
+    start = uptime_raw;
+    uint64_t tsc_start = rdtsc(uint64_t);
+    while (uptime_raw - start < TSC_CALIBRATE_MS * (PIT_FREQUENCY_HZ / 1000));
+    uint64_t tsc_end = rdtsc(uint64_t);
+
+    size_t rflags = save_and_cli();
+    tsc_last_tick = tsc_end;
+    tsc_per_tick = (tsc_end - tsc_start) / (uptime_raw - start);
+    restore_if(rflags);
+
+    kprint(KPRN_INFO, "time: TSC at %U cycles per tick", tsc_per_tick);
+}
+
+/* Whether time goes on without the PIT */
+int time_tickless(void) {
+    return tsc_per_tick != 0;
+}
+
+/* Account the ticks the TSC says have gone by */
+void time_update(void) {
+    if (!tsc_per_tick)
+        return;
+
+    size_t rflags = save_and_cli();
+    spinlock_acquire(&time_lock);
+
+    /* TSCs of different CPUs can be a little apart */
+    uint64_t now = rdtsc(uint64_t);
+    if ((int64_t)(now - tsc_last_tick) > 0) {
+        uint64_t ticks = (now - tsc_last_tick) / tsc_per_tick;
+        if (ticks) {
+            tsc_last_tick += ticks * tsc_per_tick;
+            time_advance(ticks);
+        }
+    }
+
+    spinlock_release(&time_lock);
+    restore_if(rflags);
+}
+
+void tick_handler(void) {
+    if (tsc_per_tick)
+        time_update();
+    else
+        time_advance(1);
 }
 
 void ksleep(uint64_t time) {
@@ -21,7 +99,10 @@ void ksleep(uint64_t time) {
 
     final_time++;
 
-    while (uptime_raw < final_time);
+    /* The PIT might be stopped, nothing else may be updating uptime_raw */
+    do {
+        time_update();
+    } while (uptime_raw < final_time);
 }
 
 uint64_t get_jdn(int days, int months, int years) {
@@ -38,6 +38,9 @@ extern volatile uint64_t uptime_raw;
 extern volatile uint64_t uptime_sec;
 extern volatile uint64_t unix_epoch;
 
+void time_calibrate_tsc(void);
+int time_tickless(void);
+void time_update(void);
 void ksleep(uint64_t);
 uint64_t get_jdn(int, int, int);
 uint64_t get_unix_epoch(int, int, int, int, int, int);
@@ -31,6 +31,15 @@
 void kmain_thread(void *arg) {
     (void)arg;
 
+    /* Context switch microbenchmark, if requested on the command line */
+    tlb_benchmark();
+
+    /* Compressed swap microbenchmark, if requested on the command line */
+    zswap_benchmark();
+
+    /* Launch the memory reclaim worker */
+    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, reclaim_worker, 0));
+
     /* Launch the urm */
     task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, userspace_request_monitor, 0));
 
@@ -46,6 +55,9 @@ void kmain_thread(void *arg) {
     /* Initialise device drivers */
     init_dev();
 
+    /* Compressed swap, after the device caches so that those are shrunk first */
+    init_zswap();
+
     int tty = open("/dev/tty0", O_RDWR);
 
     char root[64];
@@ -125,6 +137,7 @@ void kmain(struct stivale_struct_t *stivale) {
     init_pmm(&(stivale->memmap));
     init_rand();
     init_vmm(&(stivale->memmap));
+    init_page_cache();
 
     init_vbe(&(stivale->fb));
     init_tty();
@@ -4,9 +4,15 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <lib/ht.h>
+#include <lib/lock.h>
+#include <lib/types.h>
+#include <lib/rbtree.h>
+#include <sys/cpu.h>
 #include <startup/stivale.h>
 
 #define PAGE_SIZE ((size_t)4096)
+#define LARGE_PAGE_SIZE ((size_t)0x200000)
+#define HUGE_PAGE_SIZE ((size_t)0x40000000)
 
 #define PAGE_TABLE_ENTRIES 512
 #define KERNEL_PHYS_OFFSET ((size_t)0xffffffff80000000)
@@ -23,35 +29,255 @@ struct page_attributes_t {
     size_t flags;
 };
 
+#define PROT_NONE 0x00
+#define PROT_READ 0x01
+#define PROT_WRITE 0x02
+#define PROT_EXEC 0x04
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void *)-1)
+
+/* A file backing one or more mappings. It holds its own VFS handle so that
+ * it outlives the descriptor it was mapped from, and is shared on fork. */
+struct vm_file_t {
+    int fd;
+    /* Whether fd shares its file position with the mapped descriptor */
+    int shared_pos;
+    int refcount;
+    lock_t lock;
+    /* Key of the file in the page cache, ino is 0 if it cannot be cached */
+    dev_t dev;
+    ino_t ino;
+};
+
+/* A contiguous range of user virtual memory with uniform protection and
+ * backing, pages in it are populated on first access */
+struct vma_t {
+    struct rb_node node;
+    size_t base;
+    size_t top;
+    int prot;
+    int flags;
+    struct vm_file_t *file;
+    /* Offset in file of the page at base */
+    size_t offset;
+};
+
 struct pagemap_t {
     ht_new(struct page_attributes_t, page_attributes);
     pt_entry_t *pml4;
     lock_t lock;
+    /* User mappings sorted by address, protected by lock */
+    struct rb_root vmas;
+    /* Bitmap of the CPUs that have this pagemap loaded, or may still hold
+     * translations for it under its PCID */
+    uint64_t active_cpus[MAX_CPUS / 64];
+    /* PCID of the pagemap on each CPU, tagged with that CPU's generation */
+    uint64_t pcids[MAX_CPUS];
+    /* Link in the list of user address spaces scanned by swap-out */
+    struct pagemap_t *swap_next;
+    struct pagemap_t *swap_prev;
+};
+
+/* Invalidations are collected in a batch and sent to the other CPUs using
+ * the pagemap with a single IPI. Past TLB_BATCH_MAX pages a full flush is done
+ * instead. Frames that were unmapped can be handed to the batch too, they are
+ * only freed once no CPU can reach them through a stale translation. */
+#define TLB_BATCH_MAX 32
+
+struct tlb_batch_t {
+    struct pagemap_t *pagemap;
+    size_t count;
+    size_t addresses[TLB_BATCH_MAX];
+    size_t page_count;
+    void *pages[TLB_BATCH_MAX];
 };
 
 extern struct pagemap_t *kernel_pagemap;
 
-void pmm_change_allocation_method(void);
+/* Subsystems kernel memory is accounted to, both pages handed out by the PMM
+ * and objects handed out by kalloc(). kalloc() gets its own pages from the
+ * PMM under MEM_TAG_KALLOC. */
+#define MEM_TAG_OTHER 0
+#define MEM_TAG_KALLOC 1
+#define MEM_TAG_PAGE_TABLES 2
+/* Anonymous and private pages of user mappings, user stacks */
+#define MEM_TAG_USER 3
+#define MEM_TAG_PAGE_CACHE 4
+/* Block caches of storage drivers and filesystems */
+#define MEM_TAG_BLOCK_CACHE 5
+/* Process and thread structures and tables, address spaces */
+#define MEM_TAG_PROC 6
+#define MEM_TAG_FS 7
+/* Driver buffers, rings and descriptors */
+#define MEM_TAG_DEVICES 8
+#define MEM_TAG_ZSWAP 9
+#define MEM_TAGS 10
+
+extern const char *mem_tag_names[MEM_TAGS];
 
-extern void *(*pmm_alloc)(size_t);
+/* NUMA nodes the PMM keeps separate free lists for, memory of any further
+ * node is put on node 0 */
+#define MAX_NUMA_NODES 8
+
+void pmm_add_high_memory(void);
+
+void *pmm_alloc(size_t);
 void *pmm_allocz(size_t);
+void *pmm_alloc_tagged(size_t, int);
+void *pmm_allocz_tagged(size_t, int);
+void *pmm_try_alloc(size_t, int);
+int pmm_zero_pool_fill(void);
 void pmm_free(void *, size_t);
+void pmm_page_ref(void *);
+void pmm_page_unref(void *);
+int pmm_page_shared(void *);
+uint32_t *pmm_page_private(void *);
+void pmm_set_node(size_t, size_t, int);
+void pmm_init_numa(int, uint8_t [MAX_NUMA_NODES][MAX_NUMA_NODES]);
 void init_pmm(struct stivale_memmap_t *);
 
 int map_page(struct pagemap_t *, size_t, size_t, size_t);
+int map_large_page(struct pagemap_t *, size_t, size_t, size_t, size_t);
 int unmap_page(struct pagemap_t *, size_t);
 int remap_page(struct pagemap_t *, size_t, size_t);
+int map_range(struct pagemap_t *, size_t, size_t, size_t, size_t);
+int unmap_range(struct pagemap_t *, size_t, size_t);
+int protect_range(struct pagemap_t *, size_t, size_t, size_t);
 void init_vmm(struct stivale_memmap_t *);
 
 struct pagemap_t *new_address_space(void);
 struct pagemap_t *fork_address_space(struct pagemap_t *);
 void free_address_space(struct pagemap_t *);
+int vmm_handle_fault(struct pagemap_t *, size_t, size_t);
+int vmm_prefault(struct pagemap_t *, size_t, size_t, int);
+
+struct vma_t *vma_find(struct pagemap_t *, size_t);
+struct vma_t *vma_find_next(struct pagemap_t *, size_t);
+int vma_remove_range(struct pagemap_t *, size_t, size_t, struct tlb_batch_t *);
+void vma_free_all(struct pagemap_t *);
+int vma_copy_all(struct pagemap_t *, struct pagemap_t *);
+struct vm_file_t *vm_file_open(int);
+void vm_file_ref(struct vm_file_t *);
+void vm_file_unref(struct vm_file_t *);
+int vm_file_read(struct vm_file_t *, void *, size_t, size_t);
+void *vm_file_page(struct vm_file_t *, size_t);
+int vmm_map_region(struct pagemap_t *, size_t, size_t, int, int, struct vm_file_t *, size_t);
+void *vmm_mmap(struct pagemap_t *, void *, size_t, int, int, int, size_t);
+int vmm_munmap(struct pagemap_t *, void *, size_t);
+int vmm_mprotect(struct pagemap_t *, void *, size_t, int);
+size_t vmm_prot_to_flags(int);
+int vmm_release_range(struct pagemap_t *, size_t, size_t, struct tlb_batch_t *);
+int vmm_protect_range(struct pagemap_t *, size_t, size_t, size_t, struct tlb_batch_t *);
+int vmm_populate_range(struct pagemap_t *, size_t, size_t, size_t);
+size_t vmm_swap_out_range(struct pagemap_t *, size_t, size_t, size_t *);
+size_t vmm_swap_out(size_t);
+
+/* A kernel cache that can give memory back under memory pressure */
+struct shrinker_t {
+    const char *name;
+    /* Bytes currently held by the cache */
+    size_t (*count)(void);
+    /* Free up to the given number of bytes, writing dirty data back first if
+     * the second argument is non-zero, and return the number of bytes freed.
+     * It may be called from an allocation with any lock held, so it must give
+     * up instead of waiting on a lock of its own. The block device caches
+     * free clean blocks, and dirty ones only once written back. */
+    size_t (*scan)(size_t, int);
+    /* Bytes freed by the shrinker so far */
+    size_t reclaimed;
+    struct shrinker_t *next;
+};
+
+struct cachestats {
+    char name[32];
+    size_t size;
+    size_t reclaimed;
+};
+
+void register_shrinker(struct shrinker_t *);
+size_t shrink_caches(size_t, int);
+int getcachestats(struct cachestats *, int);
+void reclaim_worker(void *);
+
+typedef int (*page_cache_fill_t)(void *, void *, uint64_t);
+
+void init_page_cache(void);
+
+void *page_cache_lookup(dev_t, ino_t, uint64_t);
+void *page_cache_get(dev_t, ino_t, uint64_t, page_cache_fill_t, void *);
+void page_cache_invalidate(dev_t, ino_t);
+size_t page_cache_reclaim(size_t);
+
+void init_zswap(void);
+void *zswap_store(void *, size_t *);
+void *zswap_load(void *);
+void zswap_ref(void *);
+void zswap_drop(void *);
+void zswap_benchmark(void);
+
+void tlb_batch_init(struct tlb_batch_t *, struct pagemap_t *);
+void tlb_batch_add(struct tlb_batch_t *, size_t);
+void tlb_batch_free_page(struct tlb_batch_t *, void *);
+void tlb_batch_flush(struct tlb_batch_t *);
+void tlb_shootdown(struct pagemap_t *, size_t);
+void tlb_shootdown_poll(void);
+size_t vmm_activate(struct pagemap_t *);
+void vmm_deactivate(struct pagemap_t *);
+void tlb_benchmark(void);
 
 struct memstats {
     size_t total;
     size_t used;
+    /* Per-CPU page magazines, summed over all CPUs */
+    size_t magazine_cached;
+    size_t magazine_hits;
+    size_t magazine_refills;
+    size_t magazine_drains;
+    /* Pre-zeroed page pool, hits and misses of single page pmm_allocz() */
+    size_t zero_pool_cached;
+    size_t zero_pool_hits;
+    size_t zero_pool_misses;
+    /* File pages held by the page cache */
+    size_t page_cache_cached;
+    size_t page_cache_hits;
+    size_t page_cache_misses;
+    size_t page_cache_evictions;
+    /* Anonymous pages swapped out to the compressed store, and the memory
+     * their compressed copies take */
+    size_t zswap_pages;
+    size_t zswap_stored;
+    size_t zswap_outs;
+    size_t zswap_ins;
+    /* Pages that did not compress well enough to be swapped out */
+    size_t zswap_rejects;
+    /* TSC cycles spent decompressing pages on swap-in faults */
+    size_t zswap_in_cycles;
+    /* 2 MiB pages backing anonymous user mappings, and how many of them
+     * were broken up into 4 KiB pages so far */
+    size_t thp_mapped;
+    size_t thp_splits;
+    /* Per MEM_TAG_* subsystem: bytes of pages allocated from the PMM, and
+     * kalloc() objects along with the bytes of their size classes */
+    size_t tag_pmm_bytes[MEM_TAGS];
+    size_t tag_kalloc_objects[MEM_TAGS];
+    size_t tag_kalloc_bytes[MEM_TAGS];
+    /* Page allocations served by the node of the calling CPU, and by another
+     * node because the local one was out of memory, with the free memory of
+     * every node */
+    size_t numa_nodes;
+    size_t numa_local;
+    size_t numa_fallbacks;
+    size_t numa_free[MAX_NUMA_NODES];
 };
 
 int getmemstats(struct memstats *);
+void page_cache_stats(struct memstats *);
+void zswap_stats(struct memstats *);
+void vmm_stats(struct memstats *);
 
 #endif
@@ -0,0 +1,314 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+
+/* The page cache holds the data of regular files, page by page, keyed by the
+ * device and inode of the file and the index of the page in it. Filesystems
+ * read and write through it, and file mappings map its frames directly, so a
+ * page of a file is only ever in memory once no matter how it is accessed.
+ *
+ * Every cached page sits on a clock. Lookups set its referenced bit, the hand
+ * clears it on the first pass and evicts the page on the second, unless the
+ * frame is still mapped somewhere. */
+
+#define PAGE_CACHE_HASH_SHIFT 12
+#define PAGE_CACHE_BUCKETS ((size_t)1 << PAGE_CACHE_HASH_SHIFT)
+/* Past 1/PAGE_CACHE_MAX_RATIO of memory, insertions start evicting */
+#define PAGE_CACHE_MAX_RATIO 4
+#define PAGE_CACHE_EVICT_BATCH 32
+
+struct page_cache_entry_t {
+    dev_t dev;
+    ino_t ino;
+    uint64_t index;
+    /* The cache holds a reference to the frame */
+    void *frame;
+    int referenced;
+    struct page_cache_entry_t *hash_next;
+    struct page_cache_entry_t *clock_next;
+    struct page_cache_entry_t *clock_prev;
+};
+
+static lock_t page_cache_lock = new_lock;
+static struct page_cache_entry_t *buckets[PAGE_CACHE_BUCKETS];
+static struct page_cache_entry_t *clock_hand = NULL;
+/* Entries are carved out of whole pages and never given back, so that
+ * evicting under memory pressure does not need to call into the heap */
+static struct page_cache_entry_t *free_entries = NULL;
+
+static size_t page_cache_count = 0;
+static size_t page_cache_max = 0;
+static size_t page_cache_hits = 0;
+static size_t page_cache_misses = 0;
+static size_t page_cache_evictions = 0;
+
+static inline size_t page_cache_hash(dev_t dev, ino_t ino, uint64_t index) {
+    uint64_t h = (dev << 48) ^ (ino << 20) ^ index;
+    return (h * 0x9e3779b97f4a7c15) >> (64 - PAGE_CACHE_HASH_SHIFT);
+}
+
+static struct page_cache_entry_t *page_cache_find(dev_t dev, ino_t ino, uint64_t index) {
+    struct page_cache_entry_t *e = buckets[page_cache_hash(dev, ino, index)];
+    for (; e; e = e->hash_next) {
+        if (e->dev == dev && e->ino == ino && e->index == index)
+            return e;
+    }
+    return NULL;
+}
+
+static void page_cache_unlink(struct page_cache_entry_t *e) {
+    struct page_cache_entry_t **p = &buckets[page_cache_hash(e->dev, e->ino, e->index)];
+    while (*p != e)
+        p = &(*p)->hash_next;
+    *p = e->hash_next;
+
+    if (e->clock_next == e) {
+        clock_hand = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (clock_hand == e)
+            clock_hand = e->clock_next;
+    }
+
+    page_cache_count--;
+}
+
+/* Drop the references of a list of unlinked entries, chained through
+ * clock_next, and return the entries to the free list */
+static void page_cache_release(struct page_cache_entry_t *list) {
+    struct page_cache_entry_t *last = NULL;
+
+    for (struct page_cache_entry_t *e = list; e; e = e->clock_next) {
+        pmm_page_unref(e->frame);
+        e->hash_next = e->clock_next;
+        last = e;
+    }
+
+    if (!last)
+        return;
+
+    spinlock_acquire(&page_cache_lock);
+    last->hash_next = free_entries;
+    free_entries = list;
+    spinlock_release(&page_cache_lock);
+}
+
+/* Take an entry off the free list, page_cache_lock must not be held */
+static struct page_cache_entry_t *page_cache_entry_alloc(void) {
+    spinlock_acquire(&page_cache_lock);
+    struct page_cache_entry_t *e = free_entries;
+    if (e)
+        free_entries = e->hash_next;
+    spinlock_release(&page_cache_lock);
+
+    if (e)
+        return e;
+
+    char *page = pmm_alloc_tagged(1, MEM_TAG_PAGE_CACHE);
+    if (!page)
+        return NULL;
+    page += MEM_PHYS_OFFSET;
+
+    /* Keep the first entry of the page, put the rest on the free list */
+    e = (struct page_cache_entry_t *)page;
+    size_t count = PAGE_SIZE / sizeof(struct page_cache_entry_t);
+
+    spinlock_acquire(&page_cache_lock);
+    for (size_t i = 1; i < count; i++) {
+        e[i].hash_next = free_entries;
+        free_entries = &e[i];
+    }
+    spinlock_release(&page_cache_lock);
+
+    return e;
+}
+
+/* Return a referenced frame holding the page, or NULL if it is not cached */
+void *page_cache_lookup(dev_t dev, ino_t ino, uint64_t index) {
+    void *frame = NULL;
+
+    spinlock_acquire(&page_cache_lock);
+
+    struct page_cache_entry_t *e = page_cache_find(dev, ino, index);
+    if (e) {
+        e->referenced = 1;
+        frame = e->frame;
+        pmm_page_ref(frame);
+        page_cache_hits++;
+    }
+
+    spinlock_release(&page_cache_lock);
+    return frame;
+}
+
+/* Return a referenced frame holding the page, calling fill on a freshly
+ * zeroed page to read it in on a miss. The fill function is called without
+ * the cache locked and returns non-zero on failure. */
+void *page_cache_get(dev_t dev, ino_t ino, uint64_t index,
+                     page_cache_fill_t fill, void *arg) {
+    void *frame = page_cache_lookup(dev, ino, index);
+    if (frame)
+        return frame;
+
+    frame = pmm_allocz_tagged(1, MEM_TAG_PAGE_CACHE);
+    if (!frame)
+        return NULL;
+
+    if (fill(arg, (void *)((size_t)frame + MEM_PHYS_OFFSET), index)) {
+        pmm_free(frame, 1);
+        return NULL;
+    }
+
+    struct page_cache_entry_t *e = page_cache_entry_alloc();
+    if (!e) {
+        /* Still good for the caller, it just does not get cached */
+        return frame;
+    }
+
+    if (!page_cache_max) {
+        struct memstats st;
+        getmemstats(&st);
+        page_cache_max = st.total / PAGE_SIZE / PAGE_CACHE_MAX_RATIO;
+    }
+
+    spinlock_acquire(&page_cache_lock);
+
+    page_cache_misses++;
+
+    struct page_cache_entry_t *other = page_cache_find(dev, ino, index);
+    if (other) {
+        /* Somebody else read it in the meantime */
+        e->hash_next = free_entries;
+        free_entries = e;
+        pmm_free(frame, 1);
+        frame = other->frame;
+        pmm_page_ref(frame);
+        spinlock_release(&page_cache_lock);
+        return frame;
+    }
+
+    e->dev = dev;
+    e->ino = ino;
+    e->index = index;
+    e->frame = frame;
+    e->referenced = 1;
+
+    size_t bucket = page_cache_hash(dev, ino, index);
+    e->hash_next = buckets[bucket];
+    buckets[bucket] = e;
+
+    /* New pages go right behind the hand, the farthest from eviction */
+    if (!clock_hand) {
+        e->clock_next = e->clock_prev = e;
+        clock_hand = e;
+    } else {
+        e->clock_next = clock_hand;
+        e->clock_prev = clock_hand->clock_prev;
+        clock_hand->clock_prev->clock_next = e;
+        clock_hand->clock_prev = e;
+    }
+
+    /* One reference for the cache, one for the caller */
+    pmm_page_ref(frame);
+
+    int over = ++page_cache_count > page_cache_max;
+
+    spinlock_release(&page_cache_lock);
+
+    if (over)
+        page_cache_reclaim(PAGE_CACHE_EVICT_BATCH);
+
+    return frame;
+}
+
+/* Drop every cached page of a file, mappings of it keep their frames */
+void page_cache_invalidate(dev_t dev, ino_t ino) {
+    struct page_cache_entry_t *dropped = NULL;
+
+    spinlock_acquire(&page_cache_lock);
+
+    if (clock_hand) {
+        struct page_cache_entry_t *e = clock_hand;
+        size_t count = page_cache_count;
+        for (size_t i = 0; i < count; i++) {
+            struct page_cache_entry_t *next = e->clock_next;
+            if (e->dev == dev && e->ino == ino) {
+                page_cache_unlink(e);
+                e->clock_next = dropped;
+                dropped = e;
+            }
+            e = next;
+        }
+    }
+
+    spinlock_release(&page_cache_lock);
+
+    page_cache_release(dropped);
+}
+
+/* Evict up to count pages nobody has mapped, returns the number evicted */
+size_t page_cache_reclaim(size_t count) {
+    struct page_cache_entry_t *evicted = NULL;
+    size_t freed = 0;
+
+    spinlock_acquire(&page_cache_lock);
+
+    /* Two full turns clear every referenced bit on the way */
+    size_t scan = page_cache_count * 2;
+    while (freed < count && clock_hand && scan--) {
+        struct page_cache_entry_t *e = clock_hand;
+        clock_hand = e->clock_next;
+
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        if (pmm_page_shared(e->frame))
+            continue;
+
+        page_cache_unlink(e);
+        e->clock_next = evicted;
+        evicted = e;
+        freed++;
+    }
+
+    page_cache_evictions += freed;
+
+    spinlock_release(&page_cache_lock);
+
+    page_cache_release(evicted);
+
+    return freed;
+}
+
+void page_cache_stats(struct memstats *memstats) {
+    spinlock_acquire(&page_cache_lock);
+    memstats->page_cache_cached = page_cache_count * PAGE_SIZE;
+    memstats->page_cache_hits = page_cache_hits;
+    memstats->page_cache_misses = page_cache_misses;
+    memstats->page_cache_evictions = page_cache_evictions;
+    spinlock_release(&page_cache_lock);
+}
+
+static size_t page_cache_shrinker_count(void) {
+    return locked_read(size_t, &page_cache_count) * PAGE_SIZE;
+}
+
+/* Cached pages are never dirty, they are all written through */
+static size_t page_cache_shrinker_scan(size_t bytes, int writeback) {
+    (void)writeback;
+    return page_cache_reclaim((bytes + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+}
+
+static struct shrinker_t page_cache_shrinker = {
+    .name = "page_cache",
+    .count = page_cache_shrinker_count,
+    .scan = page_cache_shrinker_scan
+};
+
+void init_page_cache(void) {
+    register_shrinker(&page_cache_shrinker);
+}
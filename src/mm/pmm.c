@@ -3,205 +3,695 @@
 #include <mm/mm.h>
 #include <lib/klib.h>
 #include <lib/lock.h>
-#include <lib/bit.h>
+#include <lib/alloc.h>
 #include <startup/stivale.h>
 #include <sys/panic.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
 
 #define MEMORY_BASE 0x1000000
-#define BITMAP_BASE (MEMORY_BASE / PAGE_SIZE)
+#define LOW_MEMORY_LIMIT ((size_t)0x100000000)
+
+/* Largest block the buddy allocator manages, 2^18 pages (1 GiB) */
+#define BUDDY_MAX_ORDER 18
+
+#define PAGE_NIL ((uint32_t)0xffffffff)
+
+/* One of these exists for every physical page up to the highest usable one.
+ * Only the first page of a free block is meaningful: it holds the order of
+ * the block and links it into the free list of that order. Every other
+ * page (allocated, reserved, or inside a bigger free block) has order -1.
+ * refcount counts the extra mappings of a page shared between address
+ * spaces, 0 means the page has a single owner. The links of an allocated
+ * page are unused, its owner may keep a word of its own in next. tag is the
+ * MEM_TAG_* subsystem an allocated page is accounted to, node the NUMA node
+ * the page sits on. */
+struct pmm_page_t {
+    uint32_t next;
+    uint32_t prev;
+    int16_t order;
+    uint8_t tag;
+    uint8_t node;
+    int32_t refcount;
+};
+
+static struct pmm_page_t *pmm_pages;
+static size_t pmm_page_count;
+
+const char *mem_tag_names[MEM_TAGS] = {
+    [MEM_TAG_OTHER] = "other",
+    [MEM_TAG_KALLOC] = "kalloc",
+    [MEM_TAG_PAGE_TABLES] = "page_tables",
+    [MEM_TAG_USER] = "user",
+    [MEM_TAG_PAGE_CACHE] = "page_cache",
+    [MEM_TAG_BLOCK_CACHE] = "block_cache",
+    [MEM_TAG_PROC] = "proc",
+    [MEM_TAG_FS] = "fs",
+    [MEM_TAG_DEVICES] = "devices",
+    [MEM_TAG_ZSWAP] = "zswap"
+};
+
+/* Pages allocated per tag */
+static size_t tag_pages[MEM_TAGS];
+
+/* Every NUMA node has free lists of its own, blocks never span two nodes */
+static uint32_t free_lists[MAX_NUMA_NODES][BUDDY_MAX_ORDER + 1];
+
+static size_t total_pages = 0;
+static size_t free_pages = 0;
+static size_t node_free_pages[MAX_NUMA_NODES];
+
+/* Nodes to allocate from for a CPU on each node, nearest first. With a single
+ * node everything lives on node 0. */
+static int numa_nodes = 1;
+static uint8_t node_order[MAX_NUMA_NODES][MAX_NUMA_NODES];
+/* Buddy allocations served by the node of the calling CPU, or by another one
+ * because the local node had nothing left */
+static size_t numa_local = 0;
+static size_t numa_fallbacks = 0;
+
+/* Memory ranges of each node, as reported by the firmware, until
+ * pmm_init_numa() applies them */
+#define PMM_NODE_RANGES 64
+
+struct pmm_node_range_t {
+    size_t base;
+    size_t length;
+    int node;
+};
+
+static struct pmm_node_range_t node_ranges[PMM_NODE_RANGES];
+static size_t node_range_i = 0;
+
+static struct stivale_memmap_t *pmm_memmap;
+
+/* A core wishing to modify the buddy free lists must first acquire this lock,
+ * to ensure other cores cannot simultaneously modify them */
+static lock_t pmm_lock = new_lock;
 
-#define BMREALLOC_STEP 1
+/* Per-CPU caches of free single pages sitting in front of the buddy allocator.
+ * They are refilled from and drained to it PMM_MAGAZINE_BATCH pages at a time,
+ * so that pmm_lock is only taken once per batch. */
+#define PMM_MAGAZINE_SIZE 64
+#define PMM_MAGAZINE_BATCH 32
+
+struct pmm_magazine_t {
+    lock_t lock;
+    size_t count;
+    size_t hits;
+    size_t refills;
+    size_t drains;
+    void *pages[PMM_MAGAZINE_SIZE];
+};
+
+static struct pmm_magazine_t pmm_magazines[MAX_CPUS];
+
+/* Pool of single pages zeroed ahead of time by idle CPUs, for pmm_allocz().
+ * Pooled pages are allocated as far as the buddy allocator is concerned and
+ * are chained through the next field of their pmm_pages entry. zero_pool_lock
+ * is only ever held with interrupts disabled, as idle CPUs spin on it with
+ * interrupts disabled and must not wait on a preempted thread. Filling stops
+ * at ZERO_POOL_TARGET pages or when less than 1/ZERO_POOL_MIN_FREE_RATIO of
+ * memory is left free, so the pool never competes with real allocations. */
+#define ZERO_POOL_TARGET 1024
+#define ZERO_POOL_MIN_FREE_RATIO 8
+
+/* Pages worth of cache shrunk per round when an allocation fails */
+#define PMM_RECLAIM_BATCH 64
+
+/* Zeroed pages are pooled per node and only handed out on their own node */
+static lock_t zero_pool_lock = new_lock;
+static uint32_t zero_pool_heads[MAX_NUMA_NODES] = {
+    [0 ... MAX_NUMA_NODES - 1] = PAGE_NIL
+};
+static size_t zero_pool_counts[MAX_NUMA_NODES];
+static size_t zero_pool_count = 0;
+static size_t zero_pool_hits = 0;
+static size_t zero_pool_misses = 0;
+
+/* NUMA node of the calling CPU */
+static inline int pmm_local_node(void) {
+    return smp_ready ? cpu_locals[current_cpu].numa_node : 0;
+}
 
-static volatile uint32_t *mem_bitmap;
-static volatile uint32_t initial_bitmap[] = { 0xffffff7f };
-static volatile uint32_t *tmp_bitmap;
+static inline void free_list_push(int order, size_t page) {
+    uint32_t *list = &free_lists[pmm_pages[page].node][order];
 
-/* 32 entries because initial_bitmap is a single dword */
-static size_t bitmap_entries = 32;
+    pmm_pages[page].order = order;
+    pmm_pages[page].prev = PAGE_NIL;
+    pmm_pages[page].next = *list;
+    if (*list != PAGE_NIL)
+        pmm_pages[*list].prev = page;
+    *list = page;
+}
 
-static size_t total_pages = 1;
-static size_t free_pages = 1;
+static inline void free_list_remove(int order, size_t page) {
+    struct pmm_page_t *p = &pmm_pages[page];
 
-static size_t cur_ptr = BITMAP_BASE;
+    if (p->prev != PAGE_NIL)
+        pmm_pages[p->prev].next = p->next;
+    else
+        free_lists[p->node][order] = p->next;
+    if (p->next != PAGE_NIL)
+        pmm_pages[p->next].prev = p->prev;
 
-/* A core wishing to modify the PMM bitmap must first acquire this lock,
- * to ensure other cores cannot simultaneously modify the bitmap */
-static lock_t pmm_lock = new_lock;
+    p->order = -1;
+}
 
-__attribute__((always_inline)) static inline int read_bitmap(size_t i) {
-    i -= BITMAP_BASE;
+/* Free a naturally aligned block of 2^order pages, merging it with its
+ * buddy for as long as the buddy is free as a whole and on the same node. */
+static void buddy_free_block(size_t page, int order) {
+    while (order < BUDDY_MAX_ORDER) {
+        size_t buddy = page ^ ((size_t)1 << order);
+        if (buddy >= pmm_page_count || pmm_pages[buddy].order != order
+         || pmm_pages[buddy].node != pmm_pages[page].node)
+            break;
+        free_list_remove(order, buddy);
+        page &= ~((size_t)1 << order);
+        order++;
+    }
 
-    return test_bit(mem_bitmap, i);
+    free_list_push(order, page);
 }
 
-__attribute__((always_inline)) static inline void set_bitmap(size_t i, size_t count) {
-    i -= BITMAP_BASE;
+/* Free an arbitrary run of pages by splitting it into the largest aligned
+ * power-of-two blocks it contains. The run must lie on a single node.
+ * pmm_lock must be held. */
+static void buddy_free(size_t page, size_t count) {
+    free_pages += count;
+    node_free_pages[pmm_pages[page].node] += count;
+
+    while (count) {
+        int order = 0;
+        while (order < BUDDY_MAX_ORDER
+            && !(page & ((size_t)1 << order))
+            && ((size_t)2 << order) <= count)
+            order++;
+        buddy_free_block(page, order);
+        page += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
 
-    free_pages -= count;
+/* Allocate a run of pg_count contiguous pages on node. The run is carved out
+ * of the smallest block that fits, with the unused tail given back straight
+ * away. pmm_lock must be held. Returns 0 if no block is big enough. */
+static size_t buddy_alloc_node(size_t pg_count, int node) {
+    int order = 0;
+    while (((size_t)1 << order) < pg_count)
+        order++;
 
-    size_t f = i + count;
-    for (size_t j = i; j < f; j++)
-        set_bit(mem_bitmap, j);
-}
+    if (order > BUDDY_MAX_ORDER)
+        return 0;
 
-__attribute__((always_inline)) static inline void unset_bitmap(size_t i, size_t count) {
-    i -= BITMAP_BASE;
+    int cur_order;
+    for (cur_order = order; cur_order <= BUDDY_MAX_ORDER; cur_order++)
+        if (free_lists[node][cur_order] != PAGE_NIL)
+            goto found;
 
-    free_pages += count;
+    return 0;
+
+found:;
+    size_t page = free_lists[node][cur_order];
+    free_list_remove(cur_order, page);
+
+    /* Split until we are down to the requested order, keeping the lower half */
+    while (cur_order > order) {
+        cur_order--;
+        free_list_push(cur_order, page + ((size_t)1 << cur_order));
+    }
 
-    size_t f = i + count;
-    for (size_t j = i; j < f; j++)
-        reset_bit(mem_bitmap, j);
+    free_pages -= (size_t)1 << order;
+    node_free_pages[node] -= (size_t)1 << order;
+
+    size_t excess = ((size_t)1 << order) - pg_count;
+    if (excess)
+        buddy_free(page + pg_count, excess);
+
+    return page;
 }
 
-/* Populate bitmap using e820 data. */
-void init_pmm(struct stivale_memmap_t *memmap) {
-    mem_bitmap = initial_bitmap;
-    if (!(tmp_bitmap = pmm_allocz(BMREALLOC_STEP))) {
-        panic(NULL, 0, "pmm_alloc failure in init_pmm()");
+/* Allocate a run of pg_count contiguous pages, from the node of the calling
+ * CPU if it has room and from the nearest node that does otherwise.
+ * pmm_lock must be held. Returns 0 if no node has a block big enough. */
+static size_t buddy_alloc(size_t pg_count) {
+    int local = pmm_local_node();
+
+    for (int i = 0; i < numa_nodes; i++) {
+        size_t page = buddy_alloc_node(pg_count, node_order[local][i]);
+        if (!page)
+            continue;
+        if (i)
+            numa_fallbacks++;
+        else
+            numa_local++;
+        return page;
     }
 
-    tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
+    return 0;
+}
+
+/* Free a run of pages that may cross nodes, node by node. pmm_lock must be
+ * held. */
+static void buddy_free_nodes(size_t page, size_t count) {
+    while (count) {
+        size_t run = 1;
+        while (run < count && pmm_pages[page + run].node == pmm_pages[page].node)
+            run++;
+        buddy_free(page, run);
+        page += run;
+        count -= run;
+    }
+}
+
+/* Hand the usable pages of every memmap entry within [floor, ceiling) to
+ * the buddy allocator, skipping the page array itself. */
+static void add_usable_memory(size_t floor, size_t ceiling,
+                              size_t array_base, size_t array_top) {
+    for (size_t i = 0; i < pmm_memmap->entries; i++) {
+        struct stivale_memmap_entry_t *entry = &(pmm_memmap->address[i]);
+
+        if (entry->type != USABLE)
+            continue;
+
+        size_t base = DIV_ROUNDUP(entry->base, PAGE_SIZE) * PAGE_SIZE;
+        size_t top = ((entry->base + entry->size) / PAGE_SIZE) * PAGE_SIZE;
+
+        if (base < floor)
+            base = floor;
+        if (top > ceiling)
+            top = ceiling;
+
+        for (size_t addr = base; addr < top; ) {
+            size_t run_top = top;
+
+            if (addr >= array_base && addr < array_top) {
+                addr = array_top;
+                continue;
+            }
+            if (addr < array_base && run_top > array_base)
+                run_top = array_base;
+
+            total_pages += (run_top - addr) / PAGE_SIZE;
+            buddy_free(addr / PAGE_SIZE, (run_top - addr) / PAGE_SIZE);
 
-    for (size_t i = 0; i < (BMREALLOC_STEP * PAGE_SIZE) / sizeof(uint32_t); i++)
-        tmp_bitmap[i] = 0xffffffff;
+            addr = run_top;
+        }
+    }
+}
 
-    mem_bitmap = tmp_bitmap;
+static size_t page_array_base;
+static size_t page_array_top;
 
-    bitmap_entries = ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
+/* Set up the buddy allocator using e820 data. Only memory below 4 GiB, which
+ * the bootloader maps for us, is made available at this point; the rest is
+ * added by pmm_add_high_memory() once the VMM has mapped it. */
+void init_pmm(struct stivale_memmap_t *memmap) {
+    pmm_memmap = memmap;
 
     kprint(KPRN_INFO, "pmm: Mapping memory");
 
-    /* For each region specified by the memmap, iterate over each page which
-       fits in that region and if the region type indicates the area itself
-       is usable, write that page as free in the bitmap. Otherwise, mark the page as used. */
+    /* Size the page array after the highest usable address */
+    size_t highest = 0;
     for (size_t i = 0; i < memmap->entries; i++) {
-        size_t aligned_base;
         struct stivale_memmap_entry_t *entry = &(memmap->address[i]);
+        if (entry->type != USABLE)
+            continue;
+        if (entry->base + entry->size > highest)
+            highest = entry->base + entry->size;
+    }
 
-        if (entry->base % PAGE_SIZE)
-            aligned_base = entry->base + (PAGE_SIZE - (entry->base % PAGE_SIZE));
-        else
-            aligned_base = entry->base;
+    pmm_page_count = highest / PAGE_SIZE;
+    size_t array_size = DIV_ROUNDUP(pmm_page_count * sizeof(struct pmm_page_t), PAGE_SIZE)
+                        * PAGE_SIZE;
 
-        size_t aligned_length = (entry->size / PAGE_SIZE) * PAGE_SIZE;
+    /* Place it in the first low memory region that can hold it */
+    for (size_t i = 0; i < memmap->entries; i++) {
+        struct stivale_memmap_entry_t *entry = &(memmap->address[i]);
+        if (entry->type != USABLE)
+            continue;
+
+        size_t base = DIV_ROUNDUP(entry->base, PAGE_SIZE) * PAGE_SIZE;
+        size_t top = ((entry->base + entry->size) / PAGE_SIZE) * PAGE_SIZE;
+        if (base < MEMORY_BASE)
+            base = MEMORY_BASE;
+        if (top > LOW_MEMORY_LIMIT)
+            top = LOW_MEMORY_LIMIT;
+
+        if (top > base && top - base >= array_size) {
+            page_array_base = base;
+            page_array_top = base + array_size;
+            goto found_array;
+        }
+    }
 
-        if ((entry->base % PAGE_SIZE) && aligned_length)
-            aligned_length -= PAGE_SIZE;
+    panic(NULL, 0, "pmm: Unable to find room for the page array");
 
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
+found_array:
+    pmm_pages = (struct pmm_page_t *)(page_array_base + MEM_PHYS_OFFSET);
 
-            size_t page = addr / PAGE_SIZE;
+    for (size_t i = 0; i < pmm_page_count; i++) {
+        pmm_pages[i].order = -1;
+        pmm_pages[i].tag = MEM_TAG_OTHER;
+        pmm_pages[i].node = 0;
+        pmm_pages[i].refcount = 0;
+    }
 
-            if (addr < (MEMORY_BASE + PAGE_SIZE /* bitmap */))
-                continue;
+    for (size_t i = 0; i < MAX_NUMA_NODES; i++)
+        for (size_t j = 0; j <= BUDDY_MAX_ORDER; j++)
+            free_lists[i][j] = PAGE_NIL;
 
-            if (addr >= (MEMORY_BASE + bitmap_entries * PAGE_SIZE)) {
-                /* Reallocate bitmap */
-                size_t cur_bitmap_size_in_pages = ((bitmap_entries / 32) * sizeof(uint32_t)) / PAGE_SIZE;
-                size_t new_bitmap_size_in_pages = cur_bitmap_size_in_pages + BMREALLOC_STEP;
-                if (!(tmp_bitmap = pmm_allocz(new_bitmap_size_in_pages))) {
-                    kprint(KPRN_ERR, "pmm_alloc failure in init_pmm(). Halted.");
-                    for (;;);
-                }
-                tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
-                /* Copy over previous bitmap */
-                for (size_t i = 0;
-                     i < (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = mem_bitmap[i];
-                /* Fill in the rest */
-                for (size_t i = (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i < (new_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = 0xffffffff;
-                bitmap_entries += ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
-                uint32_t *old_bitmap = (uint32_t *)((size_t)mem_bitmap - MEM_PHYS_OFFSET);
-                mem_bitmap = tmp_bitmap;
-                pmm_free(old_bitmap, cur_bitmap_size_in_pages);
-            }
+    node_order[0][0] = 0;
+
+    add_usable_memory(MEMORY_BASE, LOW_MEMORY_LIMIT, page_array_base, page_array_top);
+}
+
+/* Release memory above 4 GiB to the allocator, now that it is mapped */
+void pmm_add_high_memory(void) {
+    spinlock_acquire(&pmm_lock);
+    add_usable_memory(LOW_MEMORY_LIMIT, (size_t)-1, page_array_base, page_array_top);
+    spinlock_release(&pmm_lock);
+}
+
+/* Record that the physical range [base, base + length) belongs to node, it
+ * takes effect once pmm_init_numa() is called */
+void pmm_set_node(size_t base, size_t length, int node) {
+    if (node_range_i == PMM_NODE_RANGES) {
+        kprint(KPRN_WARN, "pmm: Too many NUMA memory ranges, %X-%X left on node 0",
+               base, base + length);
+        return;
+    }
+
+    node_ranges[node_range_i].base = base;
+    node_ranges[node_range_i].length = length;
+    node_ranges[node_range_i].node = node;
+    node_range_i++;
+}
 
-            if (entry->type == USABLE) {
-                total_pages++;
-                unset_bitmap(page, 1);
+/* Split the free memory between node_count nodes, according to the ranges
+ * given to pmm_set_node(), and order the nodes to fall back on for every node
+ * by distance. Up to now all memory was on node 0. Must be called before
+ * smp_ready, while the magazines and zero pool are still empty. */
+void pmm_init_numa(int node_count, uint8_t distances[MAX_NUMA_NODES][MAX_NUMA_NODES]) {
+    for (int i = 0; i < node_count; i++) {
+        /* The node itself comes first no matter what the firmware says */
+        node_order[i][0] = i;
+        int n = 1;
+        for (int j = 0; j < node_count; j++) {
+            if (j == i)
+                continue;
+            int k = n++;
+            while (k > 1 && distances[i][node_order[i][k - 1]] > distances[i][j]) {
+                node_order[i][k] = node_order[i][k - 1];
+                k--;
             }
+            node_order[i][k] = j;
         }
     }
-}
 
-/* Allocate physical memory without optimisation for early boot */
-static void *pmm_alloc_slow(size_t pg_count) {
     spinlock_acquire(&pmm_lock);
 
-    size_t pg_cnt = pg_count;
+    /* Take every free block off the lists, unmarking it so that the blocks
+     * freed again below do not merge with it before its turn */
+    uint32_t lists[BUDDY_MAX_ORDER + 1];
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        lists[order] = free_lists[0][order];
+        free_lists[0][order] = PAGE_NIL;
+        for (uint32_t page = lists[order]; page != PAGE_NIL; page = pmm_pages[page].next)
+            pmm_pages[page].order = -1;
+    }
+
+    free_pages = 0;
+    node_free_pages[0] = 0;
 
-    size_t i;
-    for (i = BITMAP_BASE; i < BITMAP_BASE + bitmap_entries; ) {
-        if (!read_bitmap(i++)) {
-            if (!--pg_cnt)
-                goto found;
-        } else {
-            pg_cnt = pg_count;
+    for (size_t i = 0; i < node_range_i; i++) {
+        size_t base = DIV_ROUNDUP(node_ranges[i].base, PAGE_SIZE);
+        size_t top = (node_ranges[i].base + node_ranges[i].length) / PAGE_SIZE;
+        if (top > pmm_page_count)
+            top = pmm_page_count;
+        for (size_t page = base; page < top; page++)
+            pmm_pages[page].node = node_ranges[i].node;
+    }
+
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint32_t page = lists[order];
+        while (page != PAGE_NIL) {
+            uint32_t next = pmm_pages[page].next;
+            buddy_free_nodes(page, (size_t)1 << order);
+            page = next;
         }
     }
 
+    numa_nodes = node_count;
+
+    for (int i = 0; i < node_count; i++)
+        kprint(KPRN_INFO, "pmm: Node %u: %U MiB free", i,
+               node_free_pages[i] * PAGE_SIZE / 0x100000);
+
     spinlock_release(&pmm_lock);
+}
 
-    panic(NULL, 1, "Kernel ran out of memory.");
+/* Refill an empty magazine with a batch of single pages from the node of the
+ * calling CPU, falling back to other nodes is left to the buddy allocator */
+static void magazine_refill(struct pmm_magazine_t *mag) {
+    int node = pmm_local_node();
 
-found:;
-    size_t start = i - pg_count;
-    set_bitmap(start, pg_count);
+    spinlock_acquire(&pmm_lock);
+
+    while (mag->count < PMM_MAGAZINE_BATCH) {
+        size_t page = buddy_alloc_node(1, node);
+        if (!page)
+            break;
+        mag->pages[mag->count++] = (void *)(page * PAGE_SIZE);
+        numa_local++;
+    }
 
     spinlock_release(&pmm_lock);
 
-    // Return the physical address that represents the start of this physical page(s).
-    return (void *)(start * PAGE_SIZE);
+    mag->refills++;
 }
 
-/* Allocate physical memory with O(1)-like optimisation */
-static void *pmm_alloc_fast(size_t pg_count) {
+/* Return a batch of pages from a full magazine to the buddy allocator */
+static void magazine_drain(struct pmm_magazine_t *mag) {
     spinlock_acquire(&pmm_lock);
 
-    size_t pg_cnt = pg_count;
+    while (mag->count > PMM_MAGAZINE_SIZE - PMM_MAGAZINE_BATCH)
+        buddy_free((size_t)mag->pages[--mag->count] / PAGE_SIZE, 1);
 
-    for (size_t i = 0; i < bitmap_entries; i++) {
-        if (cur_ptr == BITMAP_BASE + bitmap_entries) {
-            cur_ptr = BITMAP_BASE;
-            pg_cnt = pg_count;
-        }
-        if (!read_bitmap(cur_ptr++)) {
-            if (!--pg_cnt)
-                goto found;
-        } else {
-            pg_cnt = pg_count;
+    spinlock_release(&pmm_lock);
+
+    mag->drains++;
+}
+
+/* Steal the cached pages of every CPU back into the buddy allocator. This is
+ * the last resort before declaring the system out of memory. */
+static void magazine_reclaim(void) {
+    for (int i = 0; i < smp_cpu_count; i++) {
+        struct pmm_magazine_t *mag = &pmm_magazines[i];
+
+        spinlock_acquire(&mag->lock);
+        spinlock_acquire(&pmm_lock);
+
+        while (mag->count)
+            buddy_free((size_t)mag->pages[--mag->count] / PAGE_SIZE, 1);
+
+        spinlock_release(&pmm_lock);
+        spinlock_release(&mag->lock);
+    }
+}
+
+static void *magazine_alloc(void) {
+    struct pmm_magazine_t *mag = &pmm_magazines[current_cpu];
+
+    spinlock_acquire(&mag->lock);
+
+    if (mag->count)
+        mag->hits++;
+    else
+        magazine_refill(mag);
+
+    void *ptr = NULL;
+    if (mag->count)
+        ptr = mag->pages[--mag->count];
+
+    spinlock_release(&mag->lock);
+
+    return ptr;
+}
+
+static void magazine_free(void *ptr) {
+    struct pmm_magazine_t *mag = &pmm_magazines[current_cpu];
+
+    spinlock_acquire(&mag->lock);
+
+    if (mag->count == PMM_MAGAZINE_SIZE)
+        magazine_drain(mag);
+
+    mag->pages[mag->count++] = ptr;
+
+    spinlock_release(&mag->lock);
+}
+
+static void *zero_pool_alloc(void) {
+    void *ptr = NULL;
+
+    size_t rflags = save_and_cli();
+    spinlock_acquire(&zero_pool_lock);
+
+    int node = pmm_local_node();
+    if (zero_pool_counts[node]) {
+        ptr = (void *)((size_t)zero_pool_heads[node] * PAGE_SIZE);
+        zero_pool_heads[node] = pmm_pages[zero_pool_heads[node]].next;
+        zero_pool_counts[node]--;
+        zero_pool_count--;
+        zero_pool_hits++;
+    } else {
+        zero_pool_misses++;
+    }
+
+    spinlock_release(&zero_pool_lock);
+    restore_if(rflags);
+
+    return ptr;
+}
+
+/* Give every pooled page back to the buddy allocator, last resort before
+ * declaring the system out of memory */
+static void zero_pool_reclaim(void) {
+    size_t rflags = save_and_cli();
+    spinlock_acquire(&zero_pool_lock);
+    spinlock_acquire(&pmm_lock);
+
+    for (int node = 0; node < numa_nodes; node++) {
+        while (zero_pool_counts[node]) {
+            size_t page = zero_pool_heads[node];
+            zero_pool_heads[node] = pmm_pages[page].next;
+            zero_pool_counts[node]--;
+            zero_pool_count--;
+            buddy_free(page, 1);
         }
     }
 
     spinlock_release(&pmm_lock);
+    spinlock_release(&zero_pool_lock);
+    restore_if(rflags);
+}
 
-    panic(NULL, 1, "Kernel ran out of memory.");
+/* Zero one more page for the pool of the node of the calling CPU. Called by
+ * idle CPUs with interrupts disabled, so it never waits on a lock somebody
+ * else holds. */
+/* Returns 0 if there is nothing to do right now */
+int pmm_zero_pool_fill(void) {
+    int node = pmm_local_node();
 
-found:;
-    size_t start = cur_ptr - pg_count;
-    set_bitmap(start, pg_count);
+    if (zero_pool_counts[node] >= ZERO_POOL_TARGET)
+        return 0;
+
+    if (!spinlock_test_and_acquire(&pmm_lock))
+        return 0;
+
+    size_t page = 0;
+    if (free_pages > total_pages / ZERO_POOL_MIN_FREE_RATIO)
+        page = buddy_alloc_node(1, node);
+
+    spinlock_release(&pmm_lock);
+
+    if (!page)
+        return 0;
+
+    uint64_t *ptr = (uint64_t *)(page * PAGE_SIZE + MEM_PHYS_OFFSET);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        ptr[i] = 0;
+
+    spinlock_acquire(&zero_pool_lock);
+    pmm_pages[page].next = zero_pool_heads[node];
+    zero_pool_heads[node] = page;
+    zero_pool_counts[node]++;
+    zero_pool_count++;
+    spinlock_release(&zero_pool_lock);
+
+    return 1;
+}
+
+/* Account a run of freshly allocated pages to tag */
+static void *pmm_tag(void *ptr, size_t pg_count, int tag) {
+    size_t page = (size_t)ptr / PAGE_SIZE;
+
+    for (size_t i = 0; i < pg_count; i++)
+        pmm_pages[page + i].tag = tag;
+    atomic_add_uint64_relaxed(&tag_pages[tag], pg_count);
+
+    return ptr;
+}
+
+/* Allocate physical memory accounted to tag */
+void *pmm_alloc_tagged(size_t pg_count, int tag) {
+    if (pg_count == 1 && smp_ready) {
+        void *ptr = magazine_alloc();
+        if (ptr)
+            return pmm_tag(ptr, 1, tag);
+    }
+
+    spinlock_acquire(&pmm_lock);
+
+    size_t start = buddy_alloc(pg_count);
 
     spinlock_release(&pmm_lock);
 
+    /* Shrink the kernel caches until the allocation fits, dropping clean
+     * data first and then writing dirty data back, if interrupts are on so
+     * that we can wait for the I/O. What they free may end up in the
+     * magazines, so those are drained on every round. */
+    int writeback = 0;
+    while (!start && smp_ready) {
+        size_t freed = shrink_caches(PMM_RECLAIM_BATCH * PAGE_SIZE, writeback);
+        magazine_reclaim();
+        zero_pool_reclaim();
+
+        spinlock_acquire(&pmm_lock);
+        start = buddy_alloc(pg_count);
+        spinlock_release(&pmm_lock);
+
+        if (!freed) {
+            if (writeback || !interrupts_enabled())
+                break;
+            writeback = 1;
+        }
+    }
+
+    if (!start)
+        panic(NULL, 1, "Kernel ran out of memory.");
+
     // Return the physical address that represents the start of this physical page(s).
-    return (void *)(start * PAGE_SIZE);
+    return pmm_tag((void *)(start * PAGE_SIZE), pg_count, tag);
+}
+
+/* Allocate physical memory */
+void *pmm_alloc(size_t pg_count) {
+    return pmm_alloc_tagged(pg_count, MEM_TAG_OTHER);
 }
 
-void *(*pmm_alloc)(size_t) = pmm_alloc_slow;
+/* Allocate physical memory accounted to tag only if it is free right away,
+ * without reclaiming anything. Returns NULL on failure. */
+void *pmm_try_alloc(size_t pg_count, int tag) {
+    spinlock_acquire(&pmm_lock);
+    size_t start = buddy_alloc(pg_count);
+    spinlock_release(&pmm_lock);
 
-void pmm_change_allocation_method(void) {
-    pmm_alloc = pmm_alloc_fast;
+    if (!start)
+        return NULL;
+    return pmm_tag((void *)(start * PAGE_SIZE), pg_count, tag);
 }
 
-/* Allocate physical memory and zero it out. */
-void *pmm_allocz(size_t pg_count) {
-    void *ptr = pmm_alloc(pg_count);
+/* Allocate physical memory accounted to tag and zero it out. */
+void *pmm_allocz_tagged(size_t pg_count, int tag) {
+    if (pg_count == 1 && smp_ready) {
+        void *ptr = zero_pool_alloc();
+        if (ptr)
+            return pmm_tag(ptr, 1, tag);
+    }
+
+    void *ptr = pmm_alloc_tagged(pg_count, tag);
     if (!ptr)
         return NULL;
 
@@ -213,20 +703,97 @@ void *pmm_allocz(size_t pg_count) {
     return ptr;
 }
 
+/* Allocate physical memory and zero it out. */
+void *pmm_allocz(size_t pg_count) {
+    return pmm_allocz_tagged(pg_count, MEM_TAG_OTHER);
+}
+
 /* Release physical memory. */
 void pmm_free(void *ptr, size_t pg_count) {
-    spinlock_acquire(&pmm_lock);
+    /* Runs of pages are always freed with the tag they were allocated with */
+    atomic_add_uint64_relaxed(&tag_pages[pmm_pages[(size_t)ptr / PAGE_SIZE].tag], -pg_count);
+
+    /* Pages of other nodes go straight back to their own free lists, so that
+     * the magazines only ever hold local memory */
+    if (pg_count == 1 && smp_ready
+     && pmm_pages[(size_t)ptr / PAGE_SIZE].node == pmm_local_node()) {
+        magazine_free(ptr);
+        return;
+    }
 
-    size_t start = (size_t)ptr / PAGE_SIZE;
+    spinlock_acquire(&pmm_lock);
 
-    unset_bitmap(start, pg_count);
+    buddy_free((size_t)ptr / PAGE_SIZE, pg_count);
 
     spinlock_release(&pmm_lock);
 }
 
+/* Take an extra reference to a page that is about to be shared */
+void pmm_page_ref(void *ptr) {
+    locked_inc(&pmm_pages[(size_t)ptr / PAGE_SIZE].refcount);
+}
+
+/* Drop a reference to a page, freeing it if this was the last one */
+void pmm_page_unref(void *ptr) {
+    struct pmm_page_t *page = &pmm_pages[(size_t)ptr / PAGE_SIZE];
+
+    int old;
+    atomic_fetch_add_int(&page->refcount, &old, -1);
+
+    if (!old) {
+        /* We were the only owner, nobody else can be looking at it */
+        page->refcount = 0;
+        pmm_free(ptr, 1);
+    }
+}
+
+/* Returns non-zero if the page is mapped by more than one address space */
+int pmm_page_shared(void *ptr) {
+    return locked_read(int, &pmm_pages[(size_t)ptr / PAGE_SIZE].refcount);
+}
+
+/* Return the word of the pmm_pages entry of an allocated page that its owner
+ * is free to use. It is not initialised, and is lost when the page is freed. */
+uint32_t *pmm_page_private(void *ptr) {
+    return &pmm_pages[(size_t)ptr / PAGE_SIZE].next;
+}
+
 int getmemstats(struct memstats *memstats) {
+    size_t cached_pages = 0;
+
+    memstats->magazine_hits = 0;
+    memstats->magazine_refills = 0;
+    memstats->magazine_drains = 0;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        cached_pages += pmm_magazines[i].count;
+        memstats->magazine_hits += pmm_magazines[i].hits;
+        memstats->magazine_refills += pmm_magazines[i].refills;
+        memstats->magazine_drains += pmm_magazines[i].drains;
+    }
+
+    memstats->zero_pool_cached = zero_pool_count * PAGE_SIZE;
+    memstats->zero_pool_hits = zero_pool_hits;
+    memstats->zero_pool_misses = zero_pool_misses;
+
     memstats->total = total_pages * PAGE_SIZE;
-    memstats->used  = total_pages * PAGE_SIZE - free_pages * PAGE_SIZE;
+    memstats->used  = total_pages * PAGE_SIZE
+                    - (free_pages + cached_pages + zero_pool_count) * PAGE_SIZE;
+    memstats->magazine_cached = cached_pages * PAGE_SIZE;
+
+    for (int i = 0; i < MEM_TAGS; i++)
+        memstats->tag_pmm_bytes[i] = locked_read(size_t, &tag_pages[i]) * PAGE_SIZE;
+
+    memstats->numa_nodes = numa_nodes;
+    memstats->numa_local = numa_local;
+    memstats->numa_fallbacks = numa_fallbacks;
+    for (int i = 0; i < MAX_NUMA_NODES; i++)
+        memstats->numa_free[i] = node_free_pages[i] * PAGE_SIZE;
+
+    page_cache_stats(memstats);
+    kalloc_stats(memstats);
+    zswap_stats(memstats);
+    vmm_stats(memstats);
 
     return 0;
 }
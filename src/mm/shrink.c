@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/cstring.h>
+#include <proc/task.h>
+
+/* Caches that hold on to memory they could do without register a shrinker.
+ * When an allocation cannot be satisfied, or free memory drops below the low
+ * watermark, every shrinker is asked in turn to give memory back: clean data
+ * is simply dropped, dirty data is written back first when that is allowed. */
+
+/* The reclaim worker kicks in below 1/RECLAIM_LOW_RATIO of memory free, and
+ * keeps going until 1/RECLAIM_HIGH_RATIO is free again */
+#define RECLAIM_LOW_RATIO 16
+#define RECLAIM_HIGH_RATIO 8
+#define RECLAIM_INTERVAL 100
+
+static lock_t shrinkers_lock = new_lock;
+/* Shrinkers are never unregistered, so the list can be walked unlocked */
+static struct shrinker_t *shrinkers = NULL;
+static struct shrinker_t **shrinkers_tail = &shrinkers;
+
+void register_shrinker(struct shrinker_t *shrinker) {
+    shrinker->reclaimed = 0;
+    shrinker->next = NULL;
+
+    spinlock_acquire(&shrinkers_lock);
+    *shrinkers_tail = shrinker;
+    shrinkers_tail = &shrinker->next;
+    spinlock_release(&shrinkers_lock);
+}
+
+/* Ask the registered caches, in registration order, to free up to bytes */
+/* Returns the number of bytes freed */
+size_t shrink_caches(size_t bytes, int writeback) {
+    size_t freed = 0;
+
+    for (struct shrinker_t *s = shrinkers; s && freed < bytes; s = s->next) {
+        size_t n = s->scan(bytes - freed, writeback);
+        if (n) {
+            spinlock_acquire(&shrinkers_lock);
+            s->reclaimed += n;
+            spinlock_release(&shrinkers_lock);
+        }
+        freed += n;
+    }
+
+    return freed;
+}
+
+/* Fill in the usage of up to count registered caches */
+/* Returns the number of caches registered */
+int getcachestats(struct cachestats *stats, int count) {
+    int i = 0;
+
+    for (struct shrinker_t *s = shrinkers; s; s = s->next, i++) {
+        if (i >= count)
+            continue;
+        /* Query before touching stats, which may fault */
+        size_t size = s->count();
+        spinlock_acquire(&shrinkers_lock);
+        size_t reclaimed = s->reclaimed;
+        spinlock_release(&shrinkers_lock);
+
+        strncpy(stats[i].name, s->name, sizeof(stats[i].name) - 1);
+        stats[i].name[sizeof(stats[i].name) - 1] = 0;
+        stats[i].size = size;
+        stats[i].reclaimed = reclaimed;
+    }
+
+    return i;
+}
+
+/* Keep some memory free ahead of time, so that allocations rarely have to
+ * reclaim synchronously with whatever locks their callers hold */
+void reclaim_worker(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        struct memstats st;
+        getmemstats(&st);
+
+        size_t free = st.total - st.used;
+        if (free < st.total / RECLAIM_LOW_RATIO)
+            shrink_caches(st.total / RECLAIM_HIGH_RATIO - free, 1);
+
+        relaxed_sleep(RECLAIM_INTERVAL);
+    }
+}
@@ -0,0 +1,311 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/apic.h>
+#include <sys/ipi.h>
+#include <lib/rand.h>
+#include <lib/cmdline.h>
+
+/* With PCIDs, translations survive CR3 reloads tagged with the PCID they were
+ * cached under. PCID 0 belongs to the kernel pagemap, the others are handed
+ * out by every CPU on its own, in generations: when a CPU runs out it flushes
+ * everything and starts over, which retires every PCID it gave out before. */
+#define PCID_COUNT 4096
+#define CR3_NOFLUSH ((size_t)1 << 63)
+
+/* A single shootdown is in flight at any time. CPUs spinning for their turn
+ * keep answering the one in flight, so two CPUs never wait on each other. */
+static lock_t shootdown_lock = new_lock;
+static struct tlb_batch_t *shootdown_batch;
+static int shootdown_pending;
+static int shootdown_requested[MAX_CPUS];
+
+static inline void cpu_mask_set(uint64_t *mask, int cpu) {
+    asm volatile (
+        "lock bts qword ptr [%0], %1;"
+        :
+        : "r" (&mask[cpu / 64]), "r" ((uint64_t)(cpu % 64))
+        : "memory", "cc"
+    );
+}
+
+static inline void cpu_mask_clear(uint64_t *mask, int cpu) {
+    asm volatile (
+        "lock btr qword ptr [%0], %1;"
+        :
+        : "r" (&mask[cpu / 64]), "r" ((uint64_t)(cpu % 64))
+        : "memory", "cc"
+    );
+}
+
+static inline int cpu_mask_test(uint64_t *mask, int cpu) {
+    return (mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static void tlb_flush_all(int global) {
+    size_t cr4 = read_cr("4");
+
+    if (global && (cr4 & (1 << 7))) {
+        /* Toggling PGE drops global translations too */
+        write_cr("4", cr4 & ~((size_t)1 << 7));
+        write_cr("4", cr4);
+    } else {
+        write_cr("3", read_cr("3"));
+    }
+}
+
+static void tlb_flush_local(struct tlb_batch_t *batch) {
+    int kernel = batch->pagemap == kernel_pagemap;
+
+    if (!kernel && (read_cr("3") & ~(size_t)0xfff) != (size_t)batch->pagemap->pml4 - MEM_PHYS_OFFSET) {
+        /* Not running on it, but translations may be cached under its PCID.
+         * Instead of flushing them now, get the pagemap a fresh PCID the
+         * next time it is loaded here. */
+        if (cpu_pcid_enabled && smp_ready) {
+            int cpu = current_cpu;
+            batch->pagemap->pcids[cpu] = 0;
+            cpu_mask_clear(batch->pagemap->active_cpus, cpu);
+        }
+        return;
+    }
+
+    if (batch->count > TLB_BATCH_MAX) {
+        tlb_flush_all(kernel);
+        return;
+    }
+
+    for (size_t i = 0; i < batch->count; i++)
+        invlpg(batch->addresses[i]);
+}
+
+void tlb_batch_init(struct tlb_batch_t *batch, struct pagemap_t *pagemap) {
+    batch->pagemap = pagemap;
+    batch->count = 0;
+    batch->page_count = 0;
+}
+
+void tlb_batch_add(struct tlb_batch_t *batch, size_t virt_addr) {
+    /* Once over the limit, only the count matters */
+    if (batch->count < TLB_BATCH_MAX)
+        batch->addresses[batch->count] = virt_addr & ~(PAGE_SIZE - 1);
+    batch->count++;
+}
+
+/* Drop a reference to a frame unmapped through this batch once it is flushed */
+void tlb_batch_free_page(struct tlb_batch_t *batch, void *page) {
+    if (batch->page_count == TLB_BATCH_MAX)
+        tlb_batch_flush(batch);
+    batch->pages[batch->page_count++] = page;
+}
+
+/* Answer the shootdown in flight, if it concerns the calling CPU */
+/* Interrupts must be disabled */
+void tlb_shootdown_poll(void) {
+    int cpu = current_cpu;
+
+    if (!locked_write(int, &shootdown_requested[cpu], 0))
+        return;
+
+    tlb_flush_local(shootdown_batch);
+    locked_dec(&shootdown_pending);
+}
+
+/* Invalidate the batched addresses on every CPU using the pagemap */
+void tlb_batch_flush(struct tlb_batch_t *batch) {
+    if (!batch->count)
+        goto free_pages;
+
+    size_t rflags = save_and_cli();
+
+    if (!smp_ready || smp_cpu_count == 1) {
+        tlb_flush_local(batch);
+        restore_if(rflags);
+        goto free_pages;
+    }
+
+    while (!spinlock_test_and_acquire(&shootdown_lock)) {
+        tlb_shootdown_poll();
+        asm volatile ("pause");
+    }
+
+    int cpu = current_cpu;
+    int kernel = batch->pagemap == kernel_pagemap;
+    int targets = 0;
+
+    shootdown_batch = batch;
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (i == cpu)
+            continue;
+        if (kernel || cpu_mask_test(batch->pagemap->active_cpus, i)) {
+            locked_write(int, &shootdown_requested[i], 1);
+            targets++;
+        }
+    }
+    locked_write(int, &shootdown_pending, targets);
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (shootdown_requested[i])
+            lapic_send_ipi(i, IPI_SHOOTDOWN);
+    }
+
+    tlb_flush_local(batch);
+
+    while (locked_read(int, &shootdown_pending))
+        asm volatile ("pause");
+
+    spinlock_release(&shootdown_lock);
+    restore_if(rflags);
+
+free_pages:
+    for (size_t i = 0; i < batch->page_count; i++)
+        pmm_page_unref(batch->pages[i]);
+    batch->count = 0;
+    batch->page_count = 0;
+}
+
+/* Invalidate a single page on every CPU using the pagemap */
+void tlb_shootdown(struct pagemap_t *pagemap, size_t virt_addr) {
+    struct tlb_batch_t batch;
+
+    tlb_batch_init(&batch, pagemap);
+    tlb_batch_add(&batch, virt_addr);
+    tlb_batch_flush(&batch);
+}
+
+/* Get the PCID of pagemap on cpu, allocating a new one if it has none in
+ * the current generation. Returns the PCID and flush control bits for CR3. */
+static size_t pcid_get(struct pagemap_t *pagemap, int cpu) {
+    struct cpu_local_t *cpu_local = &cpu_locals[cpu];
+    uint64_t pcid = pagemap->pcids[cpu];
+
+    if (cpu_local->pcid_generation && (pcid >> 12) == cpu_local->pcid_generation)
+        return (pcid & 0xfff) | CR3_NOFLUSH;
+
+    if (!cpu_local->pcid_generation || cpu_local->pcid_next == PCID_COUNT) {
+        /* Start a new generation, toggling PGE drops all PCIDs' translations */
+        size_t cr4 = read_cr("4");
+        write_cr("4", cr4 & ~((size_t)1 << 7));
+        write_cr("4", cr4);
+        cpu_local->pcid_generation++;
+        cpu_local->pcid_next = 1;
+    }
+
+    pcid = cpu_local->pcid_next++;
+    pagemap->pcids[cpu] = (cpu_local->pcid_generation << 12) | pcid;
+
+    return pcid;
+}
+
+/* Record the calling CPU switching to pagemap, so that it gets sent the
+ * shootdowns for it. Returns the value to load CR3 with, or 0 if the
+ * pagemap is loaded already. */
+/* Interrupts must be disabled */
+size_t vmm_activate(struct pagemap_t *pagemap) {
+    int cpu = current_cpu;
+    struct pagemap_t *old_pagemap = cpu_locals[cpu].active_pagemap;
+
+    if (old_pagemap == pagemap)
+        return 0;
+
+    size_t cr3 = (size_t)pagemap->pml4 - MEM_PHYS_OFFSET;
+
+    /* Kernel mappings are shot down everywhere, no need to track them */
+    if (pagemap != kernel_pagemap) {
+        cpu_mask_set(pagemap->active_cpus, cpu);
+        if (cpu_pcid_enabled)
+            cr3 |= pcid_get(pagemap, cpu);
+    } else if (cpu_pcid_enabled) {
+        cr3 |= CR3_NOFLUSH;
+    }
+
+    /* Without PCIDs, reloading CR3 drops everything cached for the old
+     * pagemap. With them, the CPU stays in its mask until a shootdown. */
+    if (!cpu_pcid_enabled && old_pagemap && old_pagemap != kernel_pagemap)
+        cpu_mask_clear(old_pagemap->active_cpus, cpu);
+
+    cpu_locals[cpu].active_pagemap = pagemap;
+
+    return cr3;
+}
+
+/* Make sure the calling CPU no longer runs on a pagemap about to be freed */
+void vmm_deactivate(struct pagemap_t *pagemap) {
+    if (!smp_ready)
+        return;
+
+    size_t rflags = save_and_cli();
+
+    if (cpu_locals[current_cpu].active_pagemap == pagemap)
+        write_cr("3", vmm_activate(kernel_pagemap));
+
+    restore_if(rflags);
+}
+
+#define BENCH_BASE ((size_t)0x10000000)
+#define BENCH_PAGES 64
+#define BENCH_SWITCHES 20000
+
+static uint64_t bench_run(struct pagemap_t **pagemaps, int tagged) {
+    uint64_t start = rdtsc(uint64_t);
+
+    for (size_t i = 0; i < BENCH_SWITCHES; i++) {
+        size_t cr3 = vmm_activate(pagemaps[i & 1]);
+        if (!tagged)
+            cr3 &= ~CR3_NOFLUSH;
+        write_cr("3", cr3);
+
+        /* Touch the working set of the address space */
+        for (size_t j = 0; j < BENCH_PAGES; j++)
+            (void)*(volatile uint64_t *)(BENCH_BASE + j * PAGE_SIZE);
+    }
+
+    uint64_t end = rdtsc(uint64_t);
+
+    write_cr("3", vmm_activate(kernel_pagemap));
+
+    return (end - start) / BENCH_SWITCHES;
+}
+
+/* Context switch microbenchmark, run at boot if "tlbbench=1" is passed on the
+ * command line. Bounces between two address spaces touching a few pages in
+ * each, once flushing the TLB on every switch as without PCIDs, and once
+ * keeping translations tagged with PCIDs. */
+void tlb_benchmark(void) {
+    char buf[8];
+    if (!cmdline_get_value(buf, sizeof(buf), "tlbbench"))
+        return;
+
+    struct pagemap_t *pagemaps[2] = { NULL, NULL };
+
+    for (int i = 0; i < 2; i++) {
+        pagemaps[i] = new_address_space();
+        if (!pagemaps[i])
+            goto out;
+        for (size_t j = PAGE_TABLE_ENTRIES / 2; j < PAGE_TABLE_ENTRIES; j++)
+            pagemaps[i]->pml4[j] = kernel_pagemap->pml4[j];
+        /* Shared anonymous mappings are populated right away */
+        if (vmm_map_region(pagemaps[i], BENCH_BASE, BENCH_PAGES * PAGE_SIZE,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, NULL, 0))
+            goto out;
+    }
+
+    size_t rflags = save_and_cli();
+
+    uint64_t flushing = bench_run(pagemaps, 0);
+    uint64_t tagged = cpu_pcid_enabled ? bench_run(pagemaps, 1) : flushing;
+
+    restore_if(rflags);
+
+    kprint(KPRN_INFO, "tlb: Context switch + %u page touches: %U cycles flushing, %U cycles with PCIDs%s",
+           BENCH_PAGES, flushing, tagged, cpu_pcid_enabled ? "" : " (unsupported)");
+
+out:
+    for (int i = 0; i < 2; i++) {
+        if (pagemaps[i])
+            free_address_space(pagemaps[i]);
+    }
+}
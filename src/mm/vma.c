@@ -0,0 +1,479 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/alloc.h>
+#include <lib/lock.h>
+#include <lib/errno.h>
+#include <lib/rbtree.h>
+#include <fd/fd.h>
+
+/* Mappings without MAP_FIXED nor a usable hint are placed in this window,
+ * below the signal trampoline, the sbrk-like heap and the thread stacks */
+#define MMAP_BASE ((size_t)0x0000600000000000)
+#define MMAP_TOP ((size_t)0x0000740000000000)
+#define USER_TOP ((size_t)0x0000800000000000)
+
+static int vma_comp(struct rb_node *a, struct rb_node *b, void *arg) {
+    (void)arg;
+    struct vma_t *vma_a = (struct vma_t *)a;
+    struct vma_t *vma_b = (struct vma_t *)b;
+
+    if (vma_a->base < vma_b->base)
+        return -1;
+    if (vma_a->base > vma_b->base)
+        return 1;
+    return 0;
+}
+
+static inline struct vma_t *vma_next(struct vma_t *vma) {
+    return (struct vma_t *)rb_next(&vma->node);
+}
+
+/* Return the first VMA ending above addr, NULL if there is none */
+/* The pagemap lock must be held */
+struct vma_t *vma_find_next(struct pagemap_t *pagemap, size_t addr) {
+    struct rb_node *node = pagemap->vmas.root;
+    struct vma_t *ret = NULL;
+
+    while (node) {
+        struct vma_t *vma = (struct vma_t *)node;
+        if (vma->top > addr) {
+            ret = vma;
+            node = node->desc[0];
+        } else {
+            node = node->desc[1];
+        }
+    }
+
+    return ret;
+}
+
+/* Return the VMA containing addr, NULL if addr is not mapped */
+/* The pagemap lock must be held */
+struct vma_t *vma_find(struct pagemap_t *pagemap, size_t addr) {
+    struct vma_t *vma = vma_find_next(pagemap, addr);
+
+    if (vma && vma->base <= addr)
+        return vma;
+    return NULL;
+}
+
+struct vm_file_t *vm_file_open(int fd) {
+    struct vm_file_t *file = kalloc_tagged(sizeof(struct vm_file_t), MEM_TAG_PROC);
+    if (!file)
+        return NULL;
+
+    /* A descriptor of our own keeps the file open once the process closes
+     * its one. Reopening it gives it a file position nobody else moves, but
+     * only filesystems that can tell the path of a handle can do that, for
+     * the others the handle is shared through dup() instead. */
+    file->shared_pos = 0;
+    file->fd = reopen(fd, O_RDONLY);
+    if (file->fd == -1) {
+        file->shared_pos = 1;
+        file->fd = dup(fd);
+    }
+    if (file->fd == -1) {
+        kfree(file);
+        return NULL;
+    }
+    file->refcount = 1;
+    file->lock = new_lock;
+
+    /* Only regular files have their pages cached, under the same key the
+     * filesystem uses for read() */
+    struct stat st;
+    if (fstat(file->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        file->dev = 0;
+        file->ino = 0;
+    } else {
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+    }
+
+    return file;
+}
+
+void vm_file_ref(struct vm_file_t *file) {
+    if (file)
+        locked_inc(&file->refcount);
+}
+
+void vm_file_unref(struct vm_file_t *file) {
+    if (!file || locked_dec(&file->refcount))
+        return;
+
+    close(file->fd);
+    kfree(file);
+}
+
+/* Read len bytes at offset of a mapped file into buf, the part of buf past
+ * the end of the file is left untouched. Returns -1 on error. */
+int vm_file_read(struct vm_file_t *file, void *buf, size_t offset, size_t len) {
+    struct stat st;
+    int ret = -1;
+
+    spinlock_acquire(&file->lock);
+
+    if (fstat(file->fd, &st) == -1)
+        goto out;
+
+    ret = 0;
+    if (offset >= (size_t)st.st_size)
+        goto out;
+    if (len > (size_t)st.st_size - offset)
+        len = (size_t)st.st_size - offset;
+
+    /* Leave a shared file position where the process had it */
+    int pos = 0;
+    if (file->shared_pos && (pos = lseek(file->fd, 0, SEEK_CUR)) == -1) {
+        ret = -1;
+        goto out;
+    }
+
+    if (lseek(file->fd, offset, SEEK_SET) == -1
+     || read(file->fd, buf, len) == -1)
+        ret = -1;
+
+    if (file->shared_pos)
+        lseek(file->fd, pos, SEEK_SET);
+
+out:
+    spinlock_release(&file->lock);
+    return ret;
+}
+
+static int vm_file_fill(void *file, void *buf, uint64_t index) {
+    return vm_file_read(file, buf, index * PAGE_SIZE, PAGE_SIZE);
+}
+
+/* Return a referenced frame holding page index of a mapped file out of the
+ * page cache, NULL if the file cannot be cached or the read failed */
+void *vm_file_page(struct vm_file_t *file, size_t index) {
+    if (!file->ino)
+        return NULL;
+    return page_cache_get(file->dev, file->ino, index, vm_file_fill, file);
+}
+
+/* Insert a new VMA covering [base, top), the range must be unmapped. An
+ * anonymous range right after a compatible anonymous VMA extends it instead. */
+/* The pagemap lock must be held. Returns -1 on allocation failure. */
+static int vma_insert(struct pagemap_t *pagemap, size_t base, size_t top, int prot,
+                      int flags, struct vm_file_t *file, size_t offset) {
+    if (!file && base) {
+        struct vma_t *prev = vma_find(pagemap, base - 1);
+        if (prev && !prev->file && prev->top == base
+         && prev->prot == prot && prev->flags == flags) {
+            prev->top = top;
+            return 0;
+        }
+    }
+
+    struct vma_t *vma = kalloc_tagged(sizeof(struct vma_t), MEM_TAG_PROC);
+    if (!vma)
+        return -1;
+
+    vma->base = base;
+    vma->top = top;
+    vma->prot = prot;
+    vma->flags = flags;
+    vma->file = file;
+    vma->offset = offset;
+    vm_file_ref(file);
+
+    rb_insert(&pagemap->vmas, vma_comp, NULL, &vma->node);
+
+    return 0;
+}
+
+/* Split vma in two at addr, which must lie strictly inside it */
+/* The pagemap lock must be held. Returns -1 on allocation failure. */
+static int vma_split(struct pagemap_t *pagemap, struct vma_t *vma, size_t addr) {
+    struct vma_t *new_vma = kalloc_tagged(sizeof(struct vma_t), MEM_TAG_PROC);
+    if (!new_vma)
+        return -1;
+
+    new_vma->base = addr;
+    new_vma->top = vma->top;
+    new_vma->prot = vma->prot;
+    new_vma->flags = vma->flags;
+    new_vma->file = vma->file;
+    new_vma->offset = vma->offset + (addr - vma->base);
+    vm_file_ref(new_vma->file);
+
+    vma->top = addr;
+
+    rb_insert(&pagemap->vmas, vma_comp, NULL, &new_vma->node);
+
+    return 0;
+}
+
+/* Remove all mappings in [base, top), splitting the VMAs straddling the
+ * edges, and release the pages backing them into batch */
+/* The pagemap lock must be held. Returns -1 on allocation failure. */
+int vma_remove_range(struct pagemap_t *pagemap, size_t base, size_t top,
+                     struct tlb_batch_t *batch) {
+    for (;;) {
+        struct vma_t *vma = vma_find_next(pagemap, base);
+        if (!vma || vma->base >= top)
+            return 0;
+
+        if (vma->base < base) {
+            if (vma_split(pagemap, vma, base))
+                return -1;
+            continue;
+        }
+        if (vma->top > top && vma_split(pagemap, vma, top))
+            return -1;
+
+        if (vmm_release_range(pagemap, vma->base, vma->top, batch))
+            return -1;
+        vm_file_unref(vma->file);
+        /* Deleting may move the contents of another node into vma,
+         * so it is looked up again on the next iteration */
+        rb_delete(&pagemap->vmas, &vma->node);
+    }
+}
+
+static void vma_free_subtree(struct rb_node *node) {
+    if (!node)
+        return;
+
+    vma_free_subtree(node->desc[0]);
+    vma_free_subtree(node->desc[1]);
+
+    vm_file_unref(((struct vma_t *)node)->file);
+    kfree(node);
+}
+
+/* Drop every VMA of a pagemap without touching the page tables */
+void vma_free_all(struct pagemap_t *pagemap) {
+    vma_free_subtree(pagemap->vmas.root);
+    pagemap->vmas.root = NULL;
+}
+
+/* Copy every VMA of src into the empty tree of dst */
+/* The lock of src must be held. Returns -1 on allocation failure. */
+int vma_copy_all(struct pagemap_t *dst, struct pagemap_t *src) {
+    struct vma_t *vma = (struct vma_t *)rb_first(&src->vmas);
+
+    for (; vma; vma = vma_next(vma)) {
+        struct vma_t *new_vma = kalloc_tagged(sizeof(struct vma_t), MEM_TAG_PROC);
+        if (!new_vma)
+            return -1;
+        new_vma->base = vma->base;
+        new_vma->top = vma->top;
+        new_vma->prot = vma->prot;
+        new_vma->flags = vma->flags;
+        new_vma->file = vma->file;
+        new_vma->offset = vma->offset;
+        vm_file_ref(new_vma->file);
+        rb_insert(&dst->vmas, vma_comp, NULL, &new_vma->node);
+    }
+
+    return 0;
+}
+
+/* Find room for len bytes aligned to align, at hint if that range is free */
+/* The pagemap lock must be held. Returns 0 if there is no room. */
+static size_t vma_find_gap(struct pagemap_t *pagemap, size_t hint, size_t len, size_t align) {
+    if (hint && hint + len > hint && hint + len <= USER_TOP) {
+        struct vma_t *next = vma_find_next(pagemap, hint);
+        if (!next || next->base >= hint + len)
+            return hint;
+    }
+
+    size_t base = MMAP_BASE;
+    for (struct vma_t *vma = vma_find_next(pagemap, base); vma; vma = vma_next(vma)) {
+        if (vma->base >= base + len)
+            break;
+        base = (vma->top + align - 1) & ~(align - 1);
+    }
+
+    if (base + len > MMAP_TOP)
+        return 0;
+    return base;
+}
+
+/* Map [base, base + len) with the given protection, replacing whatever was
+ * mapped there. Pages are populated on first access, except for shared
+ * anonymous mappings which are populated right away so that forked
+ * processes all see the same pages. */
+/* Returns 0 on success, -1 on failure */
+int vmm_map_region(struct pagemap_t *pagemap, size_t base, size_t len, int prot,
+                   int flags, struct vm_file_t *file, size_t offset) {
+    size_t top = base + len;
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    spinlock_acquire(&pagemap->lock);
+
+    if (vma_remove_range(pagemap, base, top, &batch))
+        goto fail;
+    if (vma_insert(pagemap, base, top, prot, flags, file, offset))
+        goto fail;
+
+    if ((flags & MAP_SHARED) && !file
+     && vmm_populate_range(pagemap, base, top, vmm_prot_to_flags(prot))) {
+        vma_remove_range(pagemap, base, top, &batch);
+        goto fail;
+    }
+
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return 0;
+
+fail:
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return -1;
+}
+
+/* mmap() on a pagemap, fd is a global file descriptor or -1 */
+/* Returns the address of the mapping, or MAP_FAILED with errno set */
+void *vmm_mmap(struct pagemap_t *pagemap, void *addr, size_t len, int prot,
+               int flags, int fd, size_t offset) {
+    size_t base = (size_t)addr;
+
+    len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (!len || (base & (PAGE_SIZE - 1)) || (offset & (PAGE_SIZE - 1))
+     || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+     || !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    if ((flags & MAP_FIXED) && (base + len <= base || base + len > USER_TOP)) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    struct vm_file_t *file = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        /* Writes would never reach the file without a page cache */
+        if ((flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+            errno = ENODEV;
+            return MAP_FAILED;
+        }
+        if (!(file = vm_file_open(fd))) {
+            errno = EBADF;
+            return MAP_FAILED;
+        }
+    }
+
+    if (!(flags & MAP_FIXED)) {
+        spinlock_acquire(&pagemap->lock);
+        /* Big private anonymous mappings can use huge pages if aligned */
+        size_t align = PAGE_SIZE;
+        if ((flags & MAP_ANONYMOUS) && (flags & MAP_PRIVATE) && len >= LARGE_PAGE_SIZE)
+            align = LARGE_PAGE_SIZE;
+        base = vma_find_gap(pagemap, base, len, align);
+        /* Claim the range before anybody else can */
+        if (base && vma_insert(pagemap, base, base + len, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0))
+            base = 0;
+        spinlock_release(&pagemap->lock);
+        if (!base) {
+            vm_file_unref(file);
+            errno = ENOMEM;
+            return MAP_FAILED;
+        }
+    }
+
+    int ret = vmm_map_region(pagemap, base, len, prot, flags, file, offset);
+    vm_file_unref(file);
+
+    if (ret) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+
+    return (void *)base;
+}
+
+/* Returns 0 on success, -1 with errno set on failure */
+int vmm_munmap(struct pagemap_t *pagemap, void *addr, size_t len) {
+    size_t base = (size_t)addr;
+    size_t top = base + ((len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    if (!len || (base & (PAGE_SIZE - 1)) || top <= base || top > USER_TOP) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    spinlock_acquire(&pagemap->lock);
+    int ret = vma_remove_range(pagemap, base, top, &batch);
+    spinlock_release(&pagemap->lock);
+
+    tlb_batch_flush(&batch);
+
+    if (ret)
+        errno = ENOMEM;
+    return ret;
+}
+
+/* Returns 0 on success, -1 with errno set on failure */
+int vmm_mprotect(struct pagemap_t *pagemap, void *addr, size_t len, int prot) {
+    size_t base = (size_t)addr;
+    size_t top = base + ((len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    if ((base & (PAGE_SIZE - 1)) || top < base || top > USER_TOP
+     || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    spinlock_acquire(&pagemap->lock);
+
+    /* The whole range must be mapped, and shared file mappings stay read-only */
+    size_t addr_cur = base;
+    for (struct vma_t *vma = vma_find(pagemap, base); addr_cur < top; vma = vma_next(vma)) {
+        if (!vma || vma->base > addr_cur) {
+            errno = ENOMEM;
+            goto fail;
+        }
+        if (vma->file && (vma->flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+            errno = EACCES;
+            goto fail;
+        }
+        addr_cur = vma->top;
+    }
+
+    for (;;) {
+        struct vma_t *vma = vma_find_next(pagemap, base);
+        if (!vma || vma->base >= top)
+            break;
+
+        if (vma->base < base) {
+            if (vma_split(pagemap, vma, base))
+                goto nomem;
+            continue;
+        }
+        if (vma->top > top && vma_split(pagemap, vma, top))
+            goto nomem;
+
+        if (vmm_protect_range(pagemap, vma->base, vma->top, vmm_prot_to_flags(prot), &batch))
+            goto nomem;
+        vma->prot = prot;
+        base = vma->top;
+    }
+
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return 0;
+
+nomem:
+    errno = ENOMEM;
+fail:
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return -1;
+}
@@ -9,120 +9,442 @@
 #include <sys/cpu.h>
 #include <startup/stivale.h>
 
-static struct pagemap_t __kp;
-struct pagemap_t *kernel_pagemap = &__kp;
+/* Software-available PTE bit marking read-only pages to be copied on write */
+#define VMM_COW ((pt_entry_t)1 << 9)
+/* Page size bit, in PDPT entries for 1 GiB pages and in PD entries for 2 MiB pages */
+#define VMM_LARGE ((pt_entry_t)1 << 7)
+/* Position of the PAT bit in large page entries, it is bit 7 in PT entries */
+#define VMM_LARGE_PAT ((pt_entry_t)1 << 12)
+
+/* Global bit, kernel higher half mappings survive CR3 reloads */
+#define VMM_GLOBAL ((pt_entry_t)1 << 8)
+
+/* Software-available bit of non-present PTEs marking pages swapped out to the
+ * compressed store, the bits above the flags point at the compressed copy */
+#define VMM_SWAP ((pt_entry_t)1 << 10)
+
+static inline pt_entry_t swap_entry(void *handle) {
+    return (((pt_entry_t)handle - MEM_PHYS_OFFSET) << 12) | VMM_SWAP;
+}
 
-static inline size_t entries_to_virt_addr(size_t pml4_entry,
-                                   size_t pdpt_entry,
-                                   size_t pd_entry,
-                                   size_t pt_entry) {
-    size_t virt_addr = 0;
+static inline void *swap_handle(pt_entry_t entry) {
+    return (void *)((entry >> 12) + MEM_PHYS_OFFSET);
+}
 
-    virt_addr |= pml4_entry << 39;
-    virt_addr |= pdpt_entry << 30;
-    virt_addr |= pd_entry << 21;
-    virt_addr |= pt_entry << 12;
+/* Software-available bit of 2 MiB entries marking transparent huge pages
+ * backing user mappings */
+#define VMM_THP ((pt_entry_t)1 << 11)
 
-    return virt_addr;
-}
+/* Accessed bit, set by the CPU whenever it loads a translation */
+#define VMM_ACCESSED ((pt_entry_t)1 << 5)
+
+/* Page table entries looked at per swap-out batch, bounding how long the
+ * pagemap lock is held */
+#define SWAP_SCAN_MAX 512
+
+/* Whether the CPU supports 1 GiB pages */
+static int huge_pages_supported = 0;
+
+/* Transparent huge pages currently mapped, and splits of them so far */
+static size_t thp_count = 0;
+static size_t thp_splits = 0;
+
+static struct pagemap_t __kp;
+struct pagemap_t *kernel_pagemap = &__kp;
+
+/* Every user address space, walked round robin by swap-out. The cursor is
+ * the address space and address it left off at. */
+static lock_t address_spaces_lock = new_lock;
+static struct pagemap_t *address_spaces = NULL;
+static size_t address_space_count = 0;
+static struct pagemap_t *swap_cursor = NULL;
+static size_t swap_cursor_addr = 0;
 
 struct pagemap_t *new_address_space(void) {
-    struct pagemap_t *new_pagemap = kalloc(sizeof(struct pagemap_t));
+    struct pagemap_t *new_pagemap = kalloc_tagged(sizeof(struct pagemap_t), MEM_TAG_PROC);
     if (!new_pagemap)
         return NULL;
-    new_pagemap->pml4 = pmm_allocz(1);
+    new_pagemap->pml4 = pmm_allocz_tagged(1, MEM_TAG_PAGE_TABLES);
     if (!new_pagemap->pml4) {
         kfree(new_pagemap);
         return NULL;
     }
     new_pagemap->pml4 = (void *)((size_t)new_pagemap->pml4 + MEM_PHYS_OFFSET);
     new_pagemap->lock = new_lock;
+    new_pagemap->vmas.node_size = sizeof(struct vma_t);
+
+    spinlock_acquire(&address_spaces_lock);
+    new_pagemap->swap_prev = NULL;
+    new_pagemap->swap_next = address_spaces;
+    if (address_spaces)
+        address_spaces->swap_prev = new_pagemap;
+    address_spaces = new_pagemap;
+    address_space_count++;
+    spinlock_release(&address_spaces_lock);
+
     return new_pagemap;
 }
 
+/* Every page table below the PML4 keeps the number of its entries in use,
+ * swapped out pages included, in its pmm_pages entry. A table is freed as
+ * soon as that drops to 0, without looking at the entries. */
+static inline uint32_t *table_count(pt_entry_t *table) {
+    return pmm_page_private((void *)((size_t)table - MEM_PHYS_OFFSET));
+}
+
+/* Allocate an empty page table, returns NULL on failure */
+static pt_entry_t *table_alloc(void) {
+    void *page = pmm_allocz_tagged(1, MEM_TAG_PAGE_TABLES);
+    if (!page)
+        return NULL;
+    *pmm_page_private(page) = 0;
+    return (pt_entry_t *)((size_t)page + MEM_PHYS_OFFSET);
+}
+
+/* Free a page table, through batch if not NULL so that it is only reused once
+ * no CPU can be walking it any more */
+static void table_free(pt_entry_t *table, struct tlb_batch_t *batch) {
+    void *page = (void *)((size_t)table - MEM_PHYS_OFFSET);
+    if (batch)
+        tlb_batch_free_page(batch, page);
+    else
+        pmm_free(page, 1);
+}
+
+/* Free the tables on the way to virt_addr that were left empty, bottom up.
+ * PDPTs of the higher half are shared by every pagemap and always stay. */
+/* The pagemap lock must be held */
+static void prune_tables(struct pagemap_t *pagemap, size_t virt_addr,
+                         struct tlb_batch_t *batch) {
+    pt_entry_t *entries[3];
+    pt_entry_t *tables[3];
+    pt_entry_t *entry = &pagemap->pml4[(virt_addr >> 39) & 0x1ff];
+    int depth;
+
+    for (depth = 0; depth < 3; depth++) {
+        if (!(*entry & 0x1) || (*entry & VMM_LARGE))
+            break;
+        entries[depth] = entry;
+        tables[depth] = (pt_entry_t *)((*entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+        entry = &tables[depth][(virt_addr >> (30 - depth * 9)) & 0x1ff];
+    }
+
+    while (depth--) {
+        if (*table_count(tables[depth]))
+            break;
+        if (!depth && (virt_addr & ((size_t)1 << 47)))
+            break;
+        *entries[depth] = 0;
+        if (depth)
+            (*table_count(tables[depth - 1]))--;
+        table_free(tables[depth], batch);
+    }
+}
+
+/* Walk to the page table entry of virt_addr. If a table on the way is
+ * missing, or maps a large page, return NULL and store in *skip the size
+ * of the range covered by the missing entry. The pagemap lock must be held. */
+static pt_entry_t *walk_pte(struct pagemap_t *pagemap, size_t virt_addr, size_t *skip) {
+    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
+    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
+    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
+    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+
+    pt_entry_t *pdpt, *pd, *pt;
+
+    *skip = (size_t)1 << 39;
+    if (!(pagemap->pml4[pml4_entry] & 0x1))
+        return NULL;
+    pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+    *skip = HUGE_PAGE_SIZE;
+    if (!(pdpt[pdpt_entry] & 0x1) || (pdpt[pdpt_entry] & VMM_LARGE))
+        return NULL;
+    pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+    *skip = LARGE_PAGE_SIZE;
+    if (!(pd[pd_entry] & 0x1) || (pd[pd_entry] & VMM_LARGE))
+        return NULL;
+    pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+    return &pt[pt_entry];
+}
+
+/* Return a pointer to the page table entry of virt_addr, or NULL if one of
+ * the tables on the way is not present. The pagemap lock must be held. */
+static inline pt_entry_t *virt_to_pte(struct pagemap_t *pagemap, size_t virt_addr) {
+    size_t skip;
+    return walk_pte(pagemap, virt_addr, &skip);
+}
+
+/* Return a pointer to the page directory entry of the transparent huge page
+ * covering virt_addr, or NULL if there is none. The pagemap lock must be held. */
+static pt_entry_t *thp_pde(struct pagemap_t *pagemap, size_t virt_addr) {
+    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
+    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
+    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
+
+    if (!(pagemap->pml4[pml4_entry] & 0x1))
+        return NULL;
+    pt_entry_t *pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+    if (!(pdpt[pdpt_entry] & 0x1) || (pdpt[pdpt_entry] & VMM_LARGE))
+        return NULL;
+    pt_entry_t *pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+    if ((pd[pd_entry] & (0x1 | VMM_THP)) != (0x1 | VMM_THP))
+        return NULL;
+    return &pd[pd_entry];
+}
+
+/* Replace the 1 GiB or 2 MiB mapping in *entry with a table of 512 mappings
+ * of the next size down, covering the same range with the same flags */
+/* The pagemap lock must be held. Returns -1 on allocation failure. */
+static int split_large_page(pt_entry_t *entry, size_t page_size) {
+    pt_entry_t *table = table_alloc();
+    if (!table)
+        return -1;
+
+    size_t sub_size = page_size / PAGE_TABLE_ENTRIES;
+    size_t base = *entry & 0xfffffffffffff000 & ~(page_size - 1);
+    size_t flags = *entry & 0xfff & ~VMM_THP;
+
+    if (*entry & VMM_THP) {
+        locked_dec(&thp_count);
+        locked_inc(&thp_splits);
+    }
+
+    if (sub_size == PAGE_SIZE) {
+        /* 4 KiB entries have no page size bit and keep PAT where it was */
+        flags &= ~VMM_LARGE;
+        if (*entry & VMM_LARGE_PAT)
+            flags |= VMM_LARGE;
+    } else {
+        flags |= *entry & VMM_LARGE_PAT;
+    }
+
+    for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+        table[i] = (pt_entry_t)((base + i * sub_size) | flags);
+    *table_count(table) = PAGE_TABLE_ENTRIES;
+
+    /* Present + writable + user (0b111) */
+    *entry = (pt_entry_t)((size_t)table - MEM_PHYS_OFFSET) | 0b111;
+
+    return 0;
+}
+
+/* Return the page table covering virt_addr, breaking up large pages in the
+ * way. Missing tables are allocated if create is set. */
+/* The pagemap lock must be held. Returns NULL if a table is missing and
+ * create is not set, or on allocation failure. */
+static pt_entry_t *get_page_table(struct pagemap_t *pagemap, size_t virt_addr, int create) {
+    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
+    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
+    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
+
+    pt_entry_t *pdpt, *pd, *pt;
+
+    if (pagemap->pml4[pml4_entry] & 0x1) {
+        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+    } else {
+        if (!create || !(pdpt = table_alloc()))
+            return NULL;
+        /* Present + writable + user (0b111) */
+        pagemap->pml4[pml4_entry] = (pt_entry_t)((size_t)pdpt - MEM_PHYS_OFFSET) | 0b111;
+    }
+
+    if (pdpt[pdpt_entry] & 0x1) {
+        /* Break up a 1 GiB page into 2 MiB pages */
+        if ((pdpt[pdpt_entry] & VMM_LARGE)
+         && split_large_page(&pdpt[pdpt_entry], HUGE_PAGE_SIZE))
+            goto fail;
+        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+    } else {
+        if (!create || !(pd = table_alloc()))
+            goto fail;
+        pdpt[pdpt_entry] = (pt_entry_t)((size_t)pd - MEM_PHYS_OFFSET) | 0b111;
+        (*table_count(pdpt))++;
+    }
+
+    if (pd[pd_entry] & 0x1) {
+        /* Break up a 2 MiB page into 4 KiB pages */
+        if ((pd[pd_entry] & VMM_LARGE)
+         && split_large_page(&pd[pd_entry], LARGE_PAGE_SIZE))
+            goto fail;
+        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+    } else {
+        if (!create || !(pt = table_alloc()))
+            goto fail;
+        pd[pd_entry] = (pt_entry_t)((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
+        (*table_count(pd))++;
+    }
+
+    return pt;
+
+fail:
+    /* Drop the tables allocated on the way */
+    prune_tables(pagemap, virt_addr, NULL);
+    return NULL;
+}
+
+/* Free the page tables under a PML4 entry, dropping the pages they map */
+static void free_pml4_entry(pt_entry_t entry) {
+    pt_entry_t *pdpt = (pt_entry_t *)((entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+    for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+        if (!(pdpt[j] & 1))
+            continue;
+        pt_entry_t *pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+        for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
+            if (!(pd[k] & 1))
+                continue;
+            if (pd[k] & VMM_LARGE) {
+                /* Huge pages are never shared */
+                pmm_free((void *)(pd[k] & 0xfffffffffffff000 & ~(LARGE_PAGE_SIZE - 1)),
+                         PAGE_TABLE_ENTRIES);
+                locked_dec(&thp_count);
+                continue;
+            }
+            pt_entry_t *pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+            for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
+                if (pt[l] & 1)
+                    pmm_page_unref((void *)(pt[l] & 0xfffffffffffff000));
+                else if (pt[l] & VMM_SWAP)
+                    zswap_drop(swap_handle(pt[l]));
+            }
+            pmm_free((void *)(pd[k] & 0xfffffffffffff000), 1);
+        }
+        pmm_free((void *)(pdpt[j] & 0xfffffffffffff000), 1);
+    }
+
+    pmm_free((void *)(entry & 0xfffffffffffff000), 1);
+}
+
+/* User pages only ever live inside VMAs, so only the PML4 entries spanned by
+ * one need to be looked at */
 void free_address_space(struct pagemap_t *pagemap) {
-    pt_entry_t *pdpt;
-    pt_entry_t *pd;
-    pt_entry_t *pt;
+    vmm_deactivate(pagemap);
+
+    spinlock_acquire(&address_spaces_lock);
+    if (swap_cursor == pagemap) {
+        swap_cursor = pagemap->swap_next;
+        swap_cursor_addr = 0;
+    }
+    if (pagemap->swap_prev)
+        pagemap->swap_prev->swap_next = pagemap->swap_next;
+    else
+        address_spaces = pagemap->swap_next;
+    if (pagemap->swap_next)
+        pagemap->swap_next->swap_prev = pagemap->swap_prev;
+    address_space_count--;
+    spinlock_release(&address_spaces_lock);
 
     spinlock_acquire(&pagemap->lock);
 
-    for (size_t i = 0; i < PAGE_TABLE_ENTRIES / 2; i++) {
-        if (pagemap->pml4[i] & 1) {
-            pdpt = (pt_entry_t *)((pagemap->pml4[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-            for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
-                if (pdpt[j] & 1) {
-                    pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-                    for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
-                        if (pd[k] & 1) {
-                            pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-                            for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
-                                if (pt[l] & 1)
-                                    pmm_free((void *)(pt[l] & 0xfffffffffffff000), 1);
-                            }
-                            pmm_free((void *)(pd[k] & 0xfffffffffffff000), 1);
-                        }
-                    }
-                    pmm_free((void *)(pdpt[j] & 0xfffffffffffff000), 1);
-                }
-            }
-            pmm_free((void *)(pagemap->pml4[i] & 0xfffffffffffff000), 1);
+    size_t next_entry = 0;
+    struct vma_t *vma = vma_find_next(pagemap, 0);
+    for (; vma; vma = vma_find_next(pagemap, vma->top)) {
+        size_t first = vma->base >> 39;
+        size_t last = (vma->top - 1) >> 39;
+        if (first < next_entry)
+            first = next_entry;
+        for (size_t i = first; i <= last && i < PAGE_TABLE_ENTRIES / 2; i++) {
+            if (pagemap->pml4[i] & 1)
+                free_pml4_entry(pagemap->pml4[i]);
+            pagemap->pml4[i] = 0;
         }
+        if (last + 1 > next_entry)
+            next_entry = last + 1;
     }
 
+    vma_free_all(pagemap);
+
+    spinlock_release(&pagemap->lock);
+
     pmm_free((void *)pagemap->pml4 - MEM_PHYS_OFFSET, 1);
     kfree(pagemap);
 }
 
+/* Duplicate an address space for fork(). User pages are not copied: every
+ * present page of a VMA is mapped into the new address space as well and
+ * gets its reference count bumped. Pages of private mappings are turned into
+ * read-only copy-on-write pages in both address spaces, and duplicated by
+ * vmm_handle_fault() on the first write. Pages of shared mappings stay as
+ * they are in both. */
 struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
     /* Allocate the new pagemap */
     struct pagemap_t *new_pagemap = new_address_space();
+    if (!new_pagemap)
+        return NULL;
+
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, old_pagemap);
+
+    spinlock_acquire(&old_pagemap->lock);
+
+    if (vma_copy_all(new_pagemap, old_pagemap))
+        goto fail;
+
+    /* Nobody else can see the new pagemap yet, but the table helpers expect
+     * its lock to be held */
+    spinlock_acquire(&new_pagemap->lock);
+
+    /* Share all used pages. The tables of both address spaces are walked a
+     * 2 MiB chunk at a time, the child's page table is only looked up for
+     * chunks that have something to share. */
+    struct vma_t *vma = vma_find_next(old_pagemap, 0);
+    for (; vma; vma = vma_find_next(old_pagemap, vma->top)) {
+        for (size_t addr = vma->base; addr < vma->top; ) {
+            size_t skip;
+            pt_entry_t *pte = walk_pte(old_pagemap, addr, &skip);
+            if (!pte) {
+                /* Huge pages are never shared, break them up to share the
+                 * pages one by one */
+                pt_entry_t *pde = thp_pde(old_pagemap, addr);
+                if (pde) {
+                    if (split_large_page(pde, LARGE_PAGE_SIZE))
+                        goto fail_locked;
+                    continue;
+                }
+                addr = (addr & ~(skip - 1)) + skip;
+                continue;
+            }
 
-    pt_entry_t *pdpt;
-    pt_entry_t *pd;
-    pt_entry_t *pt;
-
-    struct {
-        uint8_t data[PAGE_SIZE];
-    } *pool;
-
-    size_t pool_size = 4096;
-    pool = pmm_alloc(pool_size);
-    size_t pool_ptr = 0;
-
-    /* Map and copy all used pages */
-    for (size_t i = 0; i < PAGE_TABLE_ENTRIES / 2; i++) {
-        if (old_pagemap->pml4[i] & 1) {
-            pdpt = (pt_entry_t *)((old_pagemap->pml4[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-            for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
-                if (pdpt[j] & 1) {
-                    pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-                    for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
-                        if (pd[k] & 1) {
-                            pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-                            for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
-                                if (pt[l] & 1) {
-                                    /* FIXME find a way to expand the pool instead of dying */
-                                    if (pool_ptr == pool_size)
-                                        panic(NULL, 1, "Fork memory pool exhausted");
-                                    size_t new_page = (size_t)&pool[pool_ptr++];
-                                    memcpy64((char *)(new_page + MEM_PHYS_OFFSET),
-                                            (char *)((pt[l] & 0xfffffffffffff000) + MEM_PHYS_OFFSET),
-                                            PAGE_SIZE);
-                                    map_page(new_pagemap,
-                                             new_page,
-                                             entries_to_virt_addr(i, j, k, l),
-                                             (pt[l] & 0xfff));
-                                }
-                            }
-                        }
+            size_t chunk_top = (addr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            if (chunk_top > vma->top)
+                chunk_top = vma->top;
+
+            pt_entry_t *new_pt = NULL;
+            for (; addr < chunk_top; addr += PAGE_SIZE, pte++) {
+                if (!(*pte & (0x01 | VMM_SWAP)))
+                    continue;
+                if (!new_pt && !(new_pt = get_page_table(new_pagemap, addr, 1)))
+                    goto fail_locked;
+
+                if (*pte & 0x01) {
+                    if (!(vma->flags & MAP_SHARED)) {
+                        if (*pte & 0x02)
+                            tlb_batch_add(&batch, addr);
+                        *pte = (*pte & ~(pt_entry_t)0x02) | VMM_COW;
                     }
+                    pmm_page_ref((void *)(*pte & 0xfffffffffffff000));
+                } else {
+                    /* Both get their own copy on swap-in */
+                    zswap_ref(swap_handle(*pte));
                 }
+                new_pt[(addr & ((size_t)0x1ff << 12)) >> 12] = *pte;
+                (*table_count(new_pt))++;
             }
         }
     }
 
-    pmm_free(pool + pool_ptr, pool_size - pool_ptr);
+    spinlock_release(&new_pagemap->lock);
+
+    /* The parent lost write access to its pages, drop stale translations
+     * before any of its threads can write to a page shared with the child */
+    tlb_batch_flush(&batch);
+
+    spinlock_release(&old_pagemap->lock);
 
     /* Map kernel into higher half */
     for (size_t i = PAGE_TABLE_ENTRIES / 2; i < PAGE_TABLE_ENTRIES; i++) {
@@ -130,231 +452,743 @@ struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
     }
 
     return new_pagemap;
-}
 
-/* map physaddr -> virtaddr using pml4 pointer */
-/* Returns 0 on success, -1 on failure */
-int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
-    spinlock_acquire(&pagemap->lock);
+fail_locked:
+    spinlock_release(&new_pagemap->lock);
+fail:
+    tlb_batch_flush(&batch);
+    spinlock_release(&old_pagemap->lock);
+    free_address_space(new_pagemap);
+    return NULL;
+}
 
-    /* Calculate the indices in the various tables using the virtual address */
+/* Map a 2 MiB (LARGE_PAGE_SIZE) or 1 GiB (HUGE_PAGE_SIZE) page, both addresses
+ * must be aligned to page_size, and return the entry it replaced in old_entry.
+ * Fails if a page table already lives there. */
+/* The pagemap lock must be held. Returns 0 on success, -1 on failure. */
+/* The caller is responsible for shooting down the address. */
+static int map_large_page_locked(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                                 size_t flags, size_t page_size, pt_entry_t *old_entry) {
     size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
     size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
     size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
 
-    pt_entry_t *pdpt, *pd, *pt;
+    pt_entry_t *pdpt, *pd, *table;
+
+    if (page_size == HUGE_PAGE_SIZE && !huge_pages_supported)
+        return -1;
 
-    /* Check present flag */
     if (pagemap->pml4[pml4_entry] & 0x1) {
-        /* Reference pdpt */
         pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
     } else {
-        /* Allocate a page for the pdpt. */
-        pdpt = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail1;
-        /* Present + writable + user (0b111) */
+        if (!(pdpt = table_alloc()))
+            return -1;
         pagemap->pml4[pml4_entry] = (pt_entry_t)((size_t)pdpt - MEM_PHYS_OFFSET) | 0b111;
     }
 
-    /* Rinse and repeat */
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+    if (page_size == HUGE_PAGE_SIZE) {
+        table = pdpt;
     } else {
-        /* Allocate a page for the pd. */
-        pd = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pd == MEM_PHYS_OFFSET)
-            goto fail2;
-        /* Present + writable + user (0b111) */
-        pdpt[pdpt_entry] = (pt_entry_t)((size_t)pd - MEM_PHYS_OFFSET) | 0b111;
+        if (!(pdpt[pdpt_entry] & 0x1)) {
+            if (!(pd = table_alloc()))
+                goto fail;
+            pdpt[pdpt_entry] = (pt_entry_t)((size_t)pd - MEM_PHYS_OFFSET) | 0b111;
+            (*table_count(pdpt))++;
+        } else if ((pdpt[pdpt_entry] & VMM_LARGE)
+                && split_large_page(&pdpt[pdpt_entry], HUGE_PAGE_SIZE)) {
+            goto fail;
+        }
+        table = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
     }
 
-    /* Once more */
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pt. */
-        pt = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pt == MEM_PHYS_OFFSET)
-            goto fail3;
-        /* Present + writable + user (0b111) */
-        pd[pd_entry] = (pt_entry_t)((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
-    }
+    pt_entry_t *entry = &table[page_size == HUGE_PAGE_SIZE ? pdpt_entry : pd_entry];
+
+    /* Do not throw away a page table and everything mapped through it */
+    if ((*entry & 0x1) && !(*entry & VMM_LARGE))
+        goto fail;
+
+    *old_entry = *entry;
+    if (!*entry)
+        (*table_count(table))++;
+    *entry = (pt_entry_t)(phys_addr | flags | VMM_LARGE);
+
+    return 0;
+
+fail:
+    prune_tables(pagemap, virt_addr, NULL);
+    return -1;
+}
+
+/* Returns 0 on success, -1 on failure */
+int map_large_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                   size_t flags, size_t page_size) {
+    /* The kernel's higher half is shared by every pagemap */
+    if (pagemap == kernel_pagemap && (virt_addr & ((size_t)1 << 47)))
+        flags |= VMM_GLOBAL;
+
+    pt_entry_t old_entry;
+
+    spinlock_acquire(&pagemap->lock);
+    int ret = map_large_page_locked(pagemap, phys_addr, virt_addr, flags, page_size, &old_entry);
+    spinlock_release(&pagemap->lock);
+
+    if (!ret && (old_entry & 0x01))
+        tlb_shootdown(pagemap, virt_addr);
+    return ret;
+}
+
+/* map physaddr -> virtaddr using pml4 pointer, return the entry it replaced
+ * in old_entry */
+/* The pagemap lock must be held. Returns 0 on success, -1 on failure. */
+/* The caller is responsible for shooting down the address. */
+static int map_page_locked(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                           size_t flags, pt_entry_t *old_entry) {
+    pt_entry_t *pt = get_page_table(pagemap, virt_addr, 1);
+    if (!pt)
+        return -1;
+
+    pt_entry_t *entry = &pt[(virt_addr & ((size_t)0x1ff << 12)) >> 12];
 
     /* Set the entry as present and point it to the passed physical address */
     /* Also set the specified flags */
-    pt[pt_entry] = (pt_entry_t)(phys_addr | flags);
+    *old_entry = *entry;
+    if (!*entry)
+        (*table_count(pt))++;
+    *entry = (pt_entry_t)(phys_addr | flags);
 
-    if ((size_t)pagemap->pml4 == read_cr("3")) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+    return 0;
+}
+
+/* Unmap virt_addr and return the entry it had in old_entry, if not NULL.
+ * Tables left empty are freed, through batch if not NULL. */
+/* The pagemap lock must be held. Returns -1 if nothing was mapped there. */
+/* The caller is responsible for shooting down the address. */
+static int unmap_page_locked(struct pagemap_t *pagemap, size_t virt_addr, pt_entry_t *old_entry,
+                             struct tlb_batch_t *batch) {
+    /* We cannot unmap a virtual address if we don't know what it's mapped
+     * to in the first place */
+    pt_entry_t *pt = get_page_table(pagemap, virt_addr, 0);
+    if (!pt)
+        return -1;
+
+    pt_entry_t *entry = &pt[(virt_addr & ((size_t)0x1ff << 12)) >> 12];
+
+    /* Unmap entry */
+    if (old_entry)
+        *old_entry = *entry;
+    if (*entry) {
+        *entry = 0;
+        if (!--*table_count(pt))
+            prune_tables(pagemap, virt_addr, batch);
     }
 
-    spinlock_release(&pagemap->lock);
     return 0;
+}
 
-    /* Free previous levels if empty */
-fail3:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
-        }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+/* Map the physically contiguous range at phys_addr to virt_addr, both page
+ * aligned. The page table is only looked up again every 2 MiB. */
+/* Returns 0 on success, -1 on failure, in which case the part of the range
+ * mapped so far is unmapped again */
+int map_range(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+              size_t length, size_t flags) {
+    /* The kernel's higher half is shared by every pagemap */
+    if (pagemap == kernel_pagemap && (virt_addr & ((size_t)1 << 47)))
+        flags |= VMM_GLOBAL;
+
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pt = NULL;
+    size_t offset;
+    for (offset = 0; offset < length; offset += PAGE_SIZE) {
+        size_t addr = virt_addr + offset;
+        if (!pt || !(addr & (LARGE_PAGE_SIZE - 1))) {
+            pt = get_page_table(pagemap, addr, 1);
+            if (!pt)
+                goto fail;
         }
+
+        pt_entry_t *entry = &pt[(addr & ((size_t)0x1ff << 12)) >> 12];
+        /* Non-present entries are never cached, only replacing a mapping
+         * needs a shootdown */
+        if (*entry & 0x01)
+            tlb_batch_add(&batch, addr);
+        else if (!*entry)
+            (*table_count(pt))++;
+        *entry = (pt_entry_t)((phys_addr + offset) | flags);
     }
 
-fail2:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
-            break;
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return 0;
+
+fail:
+    for (size_t i = 0; i < offset; i += PAGE_SIZE) {
+        tlb_batch_add(&batch, virt_addr + i);
+        unmap_page_locked(pagemap, virt_addr + i, NULL, &batch);
+    }
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return -1;
+}
+
+/* Unmap every page in [virt_addr, virt_addr + length), the frames are left
+ * alone. Tables left empty are freed once no CPU can walk them any more. */
+/* Returns -1 if nothing was mapped in the range */
+int unmap_range(struct pagemap_t *pagemap, size_t virt_addr, size_t length) {
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+    int ret = -1;
+
+    spinlock_acquire(&pagemap->lock);
+
+    size_t top = virt_addr + length;
+    for (size_t addr = virt_addr; addr < top; ) {
+        size_t chunk_top = (addr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+        if (chunk_top > top)
+            chunk_top = top;
+
+        pt_entry_t *pt = get_page_table(pagemap, addr, 0);
+        if (!pt) {
+            addr = chunk_top;
+            continue;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+
+        for (; addr < chunk_top; addr += PAGE_SIZE) {
+            pt_entry_t *entry = &pt[(addr & ((size_t)0x1ff << 12)) >> 12];
+            if (!*entry)
+                continue;
+            if (*entry & 0x01)
+                tlb_batch_add(&batch, addr);
+            *entry = 0;
+            ret = 0;
+            if (!--*table_count(pt)) {
+                /* Nothing left to unmap in this table */
+                prune_tables(pagemap, addr, &batch);
+                addr = chunk_top;
+                break;
+            }
         }
     }
 
-fail1:
     spinlock_release(&pagemap->lock);
-    return -1;
+    tlb_batch_flush(&batch);
+    return ret;
 }
 
-int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+/* Update the flags of every page mapped in [virt_addr, virt_addr + length) */
+/* Returns -1 if nothing was mapped in the range */
+int protect_range(struct pagemap_t *pagemap, size_t virt_addr, size_t length, size_t flags) {
+    if (pagemap == kernel_pagemap && (virt_addr & ((size_t)1 << 47)))
+        flags |= VMM_GLOBAL;
+
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+    int ret = -1;
+
     spinlock_acquire(&pagemap->lock);
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+    size_t top = virt_addr + length;
+    for (size_t addr = virt_addr; addr < top; ) {
+        size_t chunk_top = (addr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+        if (chunk_top > top)
+            chunk_top = top;
 
-    pt_entry_t *pdpt, *pd, *pt;
+        pt_entry_t *pt = get_page_table(pagemap, addr, 0);
+        if (!pt) {
+            addr = chunk_top;
+            continue;
+        }
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+        for (; addr < chunk_top; addr += PAGE_SIZE) {
+            pt_entry_t *entry = &pt[(addr & ((size_t)0x1ff << 12)) >> 12];
+            if (!(*entry & 0x01))
+                continue;
+            *entry = (*entry & 0xfffffffffffff000) | flags;
+            tlb_batch_add(&batch, addr);
+            ret = 0;
+        }
     }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
-    }
+    spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
+    return ret;
+}
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+/* Returns 0 on success, -1 on failure */
+int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
+    return map_range(pagemap, phys_addr, virt_addr, PAGE_SIZE, flags);
+}
+
+int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+    return unmap_range(pagemap, virt_addr, PAGE_SIZE);
+}
+
+/* Update flags for a mapping */
+int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+    return protect_range(pagemap, virt_addr, PAGE_SIZE, flags);
+}
+
+/* Page table flags of user pages with the given protection. PROT_NONE pages
+ * are kept mapped but out of reach of userspace. */
+size_t vmm_prot_to_flags(int prot) {
+    if (prot == PROT_NONE)
+        return 0x01;
+    if (prot & PROT_WRITE)
+        return 0x07;
+    return 0x05;
+}
+
+/* Split the huge pages straddling base and top, so that every huge page
+ * left in [base, top) lies entirely inside it */
+/* The pagemap lock must be held. Returns -1 on allocation failure. */
+static int split_range_edges(struct pagemap_t *pagemap, size_t base, size_t top) {
+    size_t edges[2] = {base, top};
+
+    for (int i = 0; i < 2; i++) {
+        if (!(edges[i] & (LARGE_PAGE_SIZE - 1)))
+            continue;
+        pt_entry_t *pde = thp_pde(pagemap, edges[i]);
+        if (pde && split_large_page(pde, LARGE_PAGE_SIZE))
+            return -1;
     }
 
-    /* Unmap entry */
-    pt[pt_entry] = 0;
+    return 0;
+}
 
-    if ((size_t)pagemap->pml4 == read_cr("3")) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+/* Unmap every page in [base, top) and hand their frames to batch */
+/* The pagemap lock must be held. Returns -1, with nothing unmapped, if a
+ * huge page straddling the range could not be split. */
+int vmm_release_range(struct pagemap_t *pagemap, size_t base, size_t top,
+                      struct tlb_batch_t *batch) {
+    if (split_range_edges(pagemap, base, top))
+        return -1;
+
+    for (size_t addr = base; addr < top; ) {
+        size_t skip;
+        pt_entry_t *pte = walk_pte(pagemap, addr, &skip);
+        if (!pte) {
+            pt_entry_t *pde = thp_pde(pagemap, addr);
+            size_t huge_base = addr & ~(LARGE_PAGE_SIZE - 1);
+            if (pde) {
+                /* The whole huge page goes, nobody else maps it */
+                void *frame = (void *)(*pde & 0xfffffffffffff000 & ~(LARGE_PAGE_SIZE - 1));
+                pt_entry_t *pd = (pt_entry_t *)((size_t)pde & ~(PAGE_SIZE - 1));
+                *pde = 0;
+                locked_dec(&thp_count);
+                tlb_batch_add(batch, huge_base);
+                if (!--*table_count(pd))
+                    prune_tables(pagemap, huge_base, batch);
+                tlb_batch_flush(batch);
+                pmm_free(frame, PAGE_TABLE_ENTRIES);
+            }
+            addr = (addr & ~(skip - 1)) + skip;
+            continue;
+        }
+        if (*pte & 0x01) {
+            pt_entry_t entry;
+            tlb_batch_add(batch, addr);
+            unmap_page_locked(pagemap, addr, &entry, batch);
+            tlb_batch_free_page(batch, (void *)(entry & 0xfffffffffffff000));
+        } else if (*pte & VMM_SWAP) {
+            pt_entry_t entry;
+            unmap_page_locked(pagemap, addr, &entry, batch);
+            zswap_drop(swap_handle(entry));
+        }
+        addr += PAGE_SIZE;
     }
 
-    /* Free previous levels if empty */
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pt - MEM_PHYS_OFFSET, 1);
-            break;
+    return 0;
+}
+
+/* Change the flags of every page in [base, top). Copy-on-write pages stay
+ * read-only, vmm_handle_fault() upgrades them on the first write. */
+/* The pagemap lock must be held. Returns -1, with nothing changed, if a
+ * huge page straddling the range could not be split. */
+int vmm_protect_range(struct pagemap_t *pagemap, size_t base, size_t top,
+                      size_t flags, struct tlb_batch_t *batch) {
+    if (split_range_edges(pagemap, base, top))
+        return -1;
+
+    for (size_t addr = base; addr < top; ) {
+        size_t skip;
+        pt_entry_t *pte = walk_pte(pagemap, addr, &skip);
+        if (!pte) {
+            pt_entry_t *pde = thp_pde(pagemap, addr);
+            size_t huge_base = addr & ~(LARGE_PAGE_SIZE - 1);
+            if (pde) {
+                pt_entry_t entry = (*pde & ~(pt_entry_t)0xfff) | VMM_THP | VMM_LARGE | flags;
+                if (entry != *pde) {
+                    *pde = entry;
+                    tlb_batch_add(batch, huge_base);
+                }
+            }
+            addr = (addr & ~(skip - 1)) + skip;
+            continue;
         }
-        if (pt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+        if (*pte & 0x01) {
+            pt_entry_t entry = (*pte & (0xfffffffffffff000 | VMM_COW)) | flags;
+            if (entry & VMM_COW)
+                entry &= ~(pt_entry_t)0x02;
+            if (entry != *pte) {
+                *pte = entry;
+                tlb_batch_add(batch, addr);
+            }
         }
+        addr += PAGE_SIZE;
     }
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
+    return 0;
+}
+
+/* Back every page in [base, top) with a zeroed frame */
+/* The pagemap lock must be held. Returns -1 on allocation failure. */
+int vmm_populate_range(struct pagemap_t *pagemap, size_t base, size_t top, size_t flags) {
+    pt_entry_t *pt = NULL;
+
+    for (size_t addr = base; addr < top; addr += PAGE_SIZE) {
+        if (!pt || !(addr & (LARGE_PAGE_SIZE - 1))) {
+            pt = get_page_table(pagemap, addr, 1);
+            if (!pt)
+                return -1;
         }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+
+        pt_entry_t *entry = &pt[(addr & ((size_t)0x1ff << 12)) >> 12];
+        if (*entry)
+            continue;
+
+        void *page = pmm_allocz_tagged(1, MEM_TAG_USER);
+        if (!page) {
+            prune_tables(pagemap, addr, NULL);
+            return -1;
         }
+        *entry = (pt_entry_t)((size_t)page | flags);
+        (*table_count(pt))++;
     }
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
+    return 0;
+}
+
+/* Swap out up to a batch of cold pages of the private anonymous mappings in
+ * [base, top) to the compressed store, and store in *next the address to
+ * continue from. Pages accessed since the last pass only lose their accessed
+ * bit. Pages are write-protected while they are compressed, a write in the
+ * meantime takes the page back and cancels its swap-out. */
+/* Returns the number of bytes freed */
+size_t vmm_swap_out_range(struct pagemap_t *pagemap, size_t base, size_t top, size_t *next) {
+    size_t addresses[TLB_BATCH_MAX];
+    pt_entry_t entries[TLB_BATCH_MAX];
+    void *handles[TLB_BATCH_MAX];
+    size_t sizes[TLB_BATCH_MAX];
+    size_t count = 0, scanned = 0, freed = 0;
+
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    if (!spinlock_test_and_acquire(&pagemap->lock)) {
+        *next = top;
+        return 0;
+    }
+
+    size_t addr = base;
+    while (addr < top && count < TLB_BATCH_MAX && scanned < SWAP_SCAN_MAX) {
+        struct vma_t *vma = vma_find_next(pagemap, addr);
+        if (!vma || vma->base >= top) {
+            addr = top;
             break;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+        if (addr < vma->base)
+            addr = vma->base;
+        if (vma->file || (vma->flags & MAP_SHARED) || vma->prot == PROT_NONE) {
+            addr = vma->top;
+            continue;
+        }
+
+        size_t vma_top = vma->top < top ? vma->top : top;
+        while (addr < vma_top && count < TLB_BATCH_MAX && scanned < SWAP_SCAN_MAX) {
+            size_t skip;
+            pt_entry_t *pte = walk_pte(pagemap, addr, &skip);
+            scanned++;
+            if (!pte) {
+                addr = (addr & ~(skip - 1)) + skip;
+                continue;
+            }
+            if ((*pte & 0x01) && (*pte & VMM_ACCESSED)) {
+                *pte &= ~VMM_ACCESSED;
+            } else if ((*pte & 0x01)
+                    && !pmm_page_shared((void *)(*pte & 0xfffffffffffff000))) {
+                if (*pte & 0x02)
+                    tlb_batch_add(&batch, addr);
+                *pte &= ~(pt_entry_t)0x02;
+                addresses[count] = addr;
+                entries[count] = *pte;
+                count++;
+            }
+            addr += PAGE_SIZE;
         }
     }
 
-out:
     spinlock_release(&pagemap->lock);
-    return 0;
 
-fail:
+    *next = addr < top ? addr : top;
+    if (!count)
+        return 0;
+
+    /* Nobody can write to the pages any more */
+    tlb_batch_flush(&batch);
+
+    for (size_t i = 0; i < count; i++)
+        handles[i] = zswap_store((void *)(entries[i] & 0xfffffffffffff000), &sizes[i]);
+
+    spinlock_acquire(&pagemap->lock);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!handles[i])
+            continue;
+        /* Reads may have set the accessed bit meanwhile, that is fine */
+        pt_entry_t *pte = virt_to_pte(pagemap, addresses[i]);
+        if (!pte || (*pte & ~VMM_ACCESSED) != entries[i]) {
+            zswap_drop(handles[i]);
+            continue;
+        }
+        *pte = swap_entry(handles[i]);
+        tlb_batch_add(&batch, addresses[i]);
+        tlb_batch_free_page(&batch, (void *)(entries[i] & 0xfffffffffffff000));
+        freed += PAGE_SIZE - sizes[i];
+    }
+
     spinlock_release(&pagemap->lock);
-    return -1;
+
+    tlb_batch_flush(&batch);
+
+    return freed;
 }
 
-/* Update flags for a mapping */
-int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
-    spinlock_acquire(&pagemap->lock);
+/* Swap out cold anonymous pages of every address space, picking up where
+ * the last call left off, until bytes are freed or every address space was
+ * gone through twice */
+/* Returns the number of bytes freed */
+size_t vmm_swap_out(size_t bytes) {
+    size_t freed = 0;
+
+    /* Also keeps swap-out from recursing into itself through reclaim */
+    if (!spinlock_test_and_acquire(&address_spaces_lock))
+        return 0;
+
+    size_t visits = address_space_count * 2 + 1;
+    while (freed < bytes && address_spaces && visits) {
+        if (!swap_cursor) {
+            swap_cursor = address_spaces;
+            swap_cursor_addr = 0;
+        }
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+        size_t next;
+        freed += vmm_swap_out_range(swap_cursor, swap_cursor_addr,
+                                    (size_t)0x800000000000, &next);
 
-    pt_entry_t *pdpt, *pd, *pt;
+        if (next >= (size_t)0x800000000000) {
+            swap_cursor = swap_cursor->swap_next;
+            swap_cursor_addr = 0;
+            visits--;
+        } else {
+            swap_cursor_addr = next;
+        }
+    }
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    spinlock_release(&address_spaces_lock);
+
+    return freed;
+}
+
+/* Get a frame holding the contents of the file page mapped at virt_addr in
+ * vma. The pagemap lock is dropped during the read. If the frame is the one
+ * in the page cache, *shared is set and it must not be written to. */
+/* Returns 0 and the frame in *page on success, 1 if the VMA or the PTE
+ * changed in the meantime so that the fault should be retried, and -1 if
+ * the allocation or the read failed */
+static int vmm_read_file_page(struct pagemap_t *pagemap, struct vma_t *vma,
+                              size_t virt_addr, void **page, int *shared) {
+    struct vm_file_t *file = vma->file;
+    size_t offset = vma->offset + (virt_addr - vma->base);
+    int ret = 0;
+
+    vm_file_ref(file);
+    spinlock_release(&pagemap->lock);
+
+    *page = vm_file_page(file, offset / PAGE_SIZE);
+    *shared = *page != NULL;
+
+    if (!*page) {
+        *page = pmm_allocz_tagged(1, MEM_TAG_USER);
+        if (!*page) {
+            ret = -1;
+        } else if (vm_file_read(file, (void *)((size_t)*page + MEM_PHYS_OFFSET),
+                                offset, PAGE_SIZE)) {
+            pmm_free(*page, 1);
+            ret = -1;
+        }
     }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    spinlock_acquire(&pagemap->lock);
+
+    vma = vma_find(pagemap, virt_addr);
+    pt_entry_t *pte = virt_to_pte(pagemap, virt_addr);
+    if (!vma || vma->file != file
+     || vma->offset + (virt_addr - vma->base) != offset
+     || (pte && (*pte & 0x01))) {
+        if (!ret)
+            pmm_page_unref(*page);
+        ret = 1;
     }
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    vm_file_unref(file);
+    return ret;
+}
+
+/* Back the 2 MiB aligned range around virt_addr with a transparent huge
+ * page, if the range lies within vma and 2 MiB of contiguous memory is free
+ * right away. Nothing may be mapped in the range yet. */
+/* The pagemap lock must be held. Returns 0 on success, -1 on failure. */
+static int vmm_map_thp(struct pagemap_t *pagemap, struct vma_t *vma, size_t virt_addr) {
+    size_t base = virt_addr & ~(LARGE_PAGE_SIZE - 1);
+    if (base < vma->base || base + LARGE_PAGE_SIZE > vma->top)
+        return -1;
+
+    void *frame = pmm_try_alloc(PAGE_TABLE_ENTRIES, MEM_TAG_USER);
+    if (!frame)
+        return -1;
+
+    memset64((void *)((size_t)frame + MEM_PHYS_OFFSET), 0, LARGE_PAGE_SIZE / sizeof(uint64_t));
+
+    pt_entry_t old_entry;
+    if (map_large_page_locked(pagemap, (size_t)frame, base,
+                              vmm_prot_to_flags(vma->prot) | VMM_THP,
+                              LARGE_PAGE_SIZE, &old_entry)) {
+        pmm_free(frame, PAGE_TABLE_ENTRIES);
+        return -1;
     }
 
-    /* Update flags */
-    pt[pt_entry] = (pt[pt_entry] & 0xfffffffffffff000) | flags;
+    locked_inc(&thp_count);
+    return 0;
+}
+
+/* Try to resolve a page fault on a user address */
+/* Returns 0 if the faulting access can be retried, -1 if it is a genuine fault */
+int vmm_handle_fault(struct pagemap_t *pagemap, size_t virt_addr, size_t error_code) {
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    /* With interrupts off, the holder of the lock may be this very CPU,
+     * faulting on a user address with the lock held */
+    if (interrupts_enabled())
+        spinlock_acquire(&pagemap->lock);
+    else if (!spinlock_test_and_acquire(&pagemap->lock))
+        return -1;
+
+    struct vma_t *vma = vma_find(pagemap, virt_addr);
+    if (!vma || vma->prot == PROT_NONE)
+        goto fail;
+    if ((error_code & 0x02) && !(vma->prot & PROT_WRITE))
+        goto fail;
 
-    if ((size_t)pagemap->pml4 == read_cr("3")) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+    pt_entry_t *pte = virt_to_pte(pagemap, virt_addr);
+    pt_entry_t *pde = pte ? NULL : thp_pde(pagemap, virt_addr);
+
+    if (pde) {
+        /* Huge pages always carry the protection of their mapping, this can
+         * only be a stale translation */
+        if (((error_code & 0x02) && !(*pde & 0x02))
+         || ((error_code & 0x04) && !(*pde & 0x04)))
+            goto fail;
+    } else if (!pte && !vma->file && !(vma->flags & MAP_SHARED)
+            && !vmm_map_thp(pagemap, vma, virt_addr)) {
+        /* First touch of a 2 MiB range of a private anonymous mapping,
+         * now backed by a huge page */
+    } else if (pte && (*pte & VMM_SWAP)) {
+        /* Swapped out to the compressed store */
+        void *handle = swap_handle(*pte);
+        void *page = zswap_load(handle);
+        if (!page)
+            goto fail;
+        *pte = (size_t)page | vmm_prot_to_flags(vma->prot);
+        zswap_drop(handle);
+    } else if (!pte || !(*pte & 0x01)) {
+        /* First touch of the page */
+        void *page;
+        int shared = 0;
+        if (vma->file) {
+            int ret = vmm_read_file_page(pagemap, vma, virt_addr, &page, &shared);
+            if (ret == -1)
+                goto fail;
+            if (ret == 1) {
+                /* Let the retried access sort it out */
+                spinlock_release(&pagemap->lock);
+                return 0;
+            }
+            vma = vma_find(pagemap, virt_addr);
+        } else {
+            page = pmm_allocz_tagged(1, MEM_TAG_USER);
+            if (!page)
+                goto fail;
+        }
+        size_t flags = vmm_prot_to_flags(vma->prot);
+        if (shared && !(vma->flags & MAP_SHARED)) {
+            /* Private mappings get their own copy of cached file pages
+             * once they write to them */
+            if (error_code & 0x02) {
+                void *new_page = pmm_alloc_tagged(1, MEM_TAG_USER);
+                if (!new_page) {
+                    pmm_page_unref(page);
+                    goto fail;
+                }
+                memcpy64((char *)((size_t)new_page + MEM_PHYS_OFFSET),
+                         (char *)((size_t)page + MEM_PHYS_OFFSET),
+                         PAGE_SIZE);
+                pmm_page_unref(page);
+                page = new_page;
+            } else {
+                flags = (flags & ~(size_t)0x02) | VMM_COW;
+            }
+        }
+        pt_entry_t old_entry;
+        if (map_page_locked(pagemap, (size_t)page, virt_addr, flags, &old_entry)) {
+            pmm_page_unref(page);
+            goto fail;
+        }
+    } else if ((error_code & 0x02) && !(*pte & 0x02)) {
+        /* Write to a read-only page of a writable mapping: copy-on-write */
+        size_t page = *pte & 0xfffffffffffff000;
+        size_t flags = ((*pte & 0xfff) | 0x02) & ~VMM_COW;
+
+        if ((vma->flags & MAP_SHARED) || !pmm_page_shared((void *)page)) {
+            /* Everybody else already let go of the page, just take it over */
+            *pte = page | flags;
+        } else {
+            void *new_page = pmm_alloc_tagged(1, MEM_TAG_USER);
+            if (!new_page)
+                goto fail;
+            memcpy64((char *)((size_t)new_page + MEM_PHYS_OFFSET),
+                     (char *)(page + MEM_PHYS_OFFSET),
+                     PAGE_SIZE);
+            *pte = (size_t)new_page | flags;
+            /* Other threads may still see the old page */
+            tlb_batch_add(&batch, virt_addr);
+            tlb_batch_free_page(&batch, (void *)page);
+        }
+    } else if ((error_code & 0x04) && !(*pte & 0x04)) {
+        goto fail;
     }
+    /* Otherwise the entry already allows the access: another CPU resolved
+     * the same fault first, and this one faulted on a stale translation */
+
+    invlpg(virt_addr);
 
     spinlock_release(&pagemap->lock);
+    tlb_batch_flush(&batch);
     return 0;
 
 fail:
@@ -362,57 +1196,106 @@ fail:
     return -1;
 }
 
+/* Fault in every page of a user buffer ahead of handing it to code that
+ * cannot take a page fault needing file I/O, like filesystem drivers copying
+ * with their locks held */
+/* Returns 0 on success, -1 if part of the buffer is not accessible */
+int vmm_prefault(struct pagemap_t *pagemap, size_t base, size_t len, int write) {
+    size_t error_code = 0x04 | (write ? 0x02 : 0);
+
+    for (size_t addr = base & ~(PAGE_SIZE - 1); addr < base + len; addr += PAGE_SIZE) {
+        spinlock_acquire(&pagemap->lock);
+        pt_entry_t *pte = virt_to_pte(pagemap, addr);
+        int resident = pte && (*pte & 0x01) && (*pte & 0x04) && (!write || (*pte & 0x02));
+        spinlock_release(&pagemap->lock);
+
+        if (!resident && vmm_handle_fault(pagemap, addr, error_code))
+            return -1;
+    }
+
+    return 0;
+}
+
+void vmm_stats(struct memstats *memstats) {
+    memstats->thp_mapped = locked_read(size_t, &thp_count);
+    memstats->thp_splits = locked_read(size_t, &thp_splits);
+}
+
+/* Map physical memory linearly at virt_addr, using the largest pages
+ * the alignment of each chunk allows */
+static void map_linear_range(size_t phys_addr, size_t virt_addr, size_t length, size_t flags) {
+    size_t top = phys_addr + length;
+
+    while (phys_addr < top) {
+        size_t left = top - phys_addr;
+
+        if (!(phys_addr % HUGE_PAGE_SIZE) && !(virt_addr % HUGE_PAGE_SIZE)
+         && left >= HUGE_PAGE_SIZE
+         && !map_large_page(kernel_pagemap, phys_addr, virt_addr, flags, HUGE_PAGE_SIZE)) {
+            phys_addr += HUGE_PAGE_SIZE;
+            virt_addr += HUGE_PAGE_SIZE;
+        } else if (!(phys_addr % LARGE_PAGE_SIZE) && !(virt_addr % LARGE_PAGE_SIZE)
+         && left >= LARGE_PAGE_SIZE
+         && !map_large_page(kernel_pagemap, phys_addr, virt_addr, flags, LARGE_PAGE_SIZE)) {
+            phys_addr += LARGE_PAGE_SIZE;
+            virt_addr += LARGE_PAGE_SIZE;
+        } else {
+            /* 4 KiB pages up to where a large page may fit again */
+            size_t chunk = LARGE_PAGE_SIZE - virt_addr % LARGE_PAGE_SIZE;
+            if (chunk > left)
+                chunk = left;
+            map_range(kernel_pagemap, phys_addr, virt_addr, chunk, flags);
+            phys_addr += chunk;
+            virt_addr += chunk;
+        }
+    }
+}
+
 /* Map the first 4GiB of memory, this saves issues with MMIO hardware < 4GiB later on */
 /* Then use the e820 to map all the available memory (saves on allocation time and it's easier) */
 /* The physical memory is mapped at the beginning of the higher half (entry 256 of the pml4) onwards */
+/* All of these use 1 GiB or 2 MiB pages where possible to save on page tables and TLB entries */
 void init_vmm(struct stivale_memmap_t *memmap) {
-    kernel_pagemap->pml4 = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
+    kernel_pagemap->pml4 = (pt_entry_t *)((size_t)pmm_allocz_tagged(1, MEM_TAG_PAGE_TABLES) + MEM_PHYS_OFFSET);
     if ((size_t)kernel_pagemap->pml4 == MEM_PHYS_OFFSET)
         panic(NULL, 1, "init_vmm failure");
 
     spinlock_release(&kernel_pagemap->lock);
 
-    kprint(KPRN_INFO, "vmm: Mapping memory");
+    uint32_t a, b, c, d;
+    if (cpuid(0x80000001, 0, &a, &b, &c, &d) && (d & (1 << 26)))
+        huge_pages_supported = 1;
+
+    kprint(KPRN_INFO, "vmm: Mapping memory (1 GiB pages %s)",
+           huge_pages_supported ? "supported" : "not supported");
+
+    /* Forcefully map the first 4 GiB for I/O into the higher half */
+    map_linear_range(0, MEM_PHYS_OFFSET, 0x100000000, 0x03 | VMM_GLOBAL);
 
     /* Identity map the first 32 MiB */
-    /* Map 32 MiB for the phys mem area, and 32 MiB for the kernel in the higher half */
-    for (size_t i = 0; i < (0x2000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-        map_page(kernel_pagemap, addr, addr, 0x03);
-        map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
-        map_page(kernel_pagemap, addr, KERNEL_PHYS_OFFSET + addr, 0x03 | (1 << 8));
-    }
+    /* Map 32 MiB for the kernel in the higher half */
+    map_linear_range(0, 0, 0x2000000, 0x03);
+    map_linear_range(0, KERNEL_PHYS_OFFSET, 0x2000000, 0x03 | VMM_GLOBAL);
 
     /* Reload new pagemap */
     write_cr("3", (size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET);
 
-    /* Forcefully map the first 4 GiB for I/O into the higher half */
-    for (size_t i = 0; i < (0x100000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-
-        map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
-    }
-
     /* Map the rest according to e820 into the higher half */
     for (size_t i = 0; i < memmap->entries; i++) {
         struct stivale_memmap_entry_t *entry = &(memmap->address[i]);
         size_t aligned_base = entry->base - (entry->base % PAGE_SIZE);
-        size_t aligned_length = DIV_ROUNDUP(entry->size, PAGE_SIZE) * PAGE_SIZE;
-
-        if (entry->base % PAGE_SIZE)
-            aligned_length += PAGE_SIZE;
+        size_t aligned_top = DIV_ROUNDUP(entry->base + entry->size, PAGE_SIZE) * PAGE_SIZE;
 
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
+        /* Skip over first 4 GiB */
+        if (aligned_top <= 0x100000000)
+            continue;
+        if (aligned_base < 0x100000000)
+            aligned_base = 0x100000000;
 
-            /* Skip over first 4 GiB */
-            if (addr < 0x100000000)
-                continue;
-
-            map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
-        }
+        map_linear_range(aligned_base, MEM_PHYS_OFFSET + aligned_base,
+                         aligned_top - aligned_base, 0x03 | VMM_GLOBAL);
     }
 
-    /* lol bug fix */
-    pmm_change_allocation_method();
+    /* Everything is mapped now, let the PMM hand out memory above 4 GiB */
+    pmm_add_high_memory();
 }
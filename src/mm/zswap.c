@@ -0,0 +1,414 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/alloc.h>
+#include <lib/cmem.h>
+#include <lib/rand.h>
+#include <lib/cmdline.h>
+#include <sys/panic.h>
+
+/* Compressed in-memory swap for anonymous user pages. When memory runs low,
+ * the reclaim path compresses cold pages of private anonymous mappings into
+ * small heap allocations and replaces their page table entries with swap
+ * entries pointing at the compressed copy. vmm_handle_fault() decompresses
+ * them into a fresh frame on the next access. There is no backing device:
+ * pages that do not compress well enough simply stay resident.
+ *
+ * Pages are compressed in the LZ4 block format, a sequence of literal runs
+ * each followed by a copy of at least 4 bytes from earlier in the page. */
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+/* The last match starts at least 12 bytes before the end of the input, and
+ * the last 5 bytes are always literals */
+#define LZ4_MFLIMIT 12
+#define LZ4_LAST_LITERALS 5
+
+/* Largest heap allocation worth storing a page in, bigger slab objects pack
+ * too few to a page to give much back */
+#define ZSWAP_MAX_ALLOC 1024
+
+struct zswap_entry_t {
+    /* Number of swap entries pointing here, more than one after fork() */
+    int refcount;
+    uint32_t size;
+    uint8_t data[];
+};
+
+#define ZSWAP_MAX_SIZE (ZSWAP_MAX_ALLOC - sizeof(struct zswap_entry_t))
+
+/* Protects the compression scratch space and the statistics */
+static lock_t zswap_lock = new_lock;
+static uint16_t lz4_table[1 << LZ4_HASH_BITS];
+static uint8_t zswap_buf[ZSWAP_MAX_SIZE];
+
+static size_t zswap_pages = 0;
+static size_t zswap_stored = 0;
+static size_t zswap_outs = 0;
+static size_t zswap_ins = 0;
+static size_t zswap_rejects = 0;
+static uint64_t zswap_in_cycles = 0;
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint8_t *lz4_put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* Compress len bytes of src into at most cap bytes of dst */
+/* Returns the compressed size, or 0 if it does not fit */
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *end = src + len;
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    memset(lz4_table, 0, sizeof(lz4_table));
+
+    while (ip < mflimit) {
+        uint32_t seq = lz4_read32(ip);
+        uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        const uint8_t *ref = src + lz4_table[h];
+        lz4_table[h] = ip - src;
+
+        if (ref >= ip || lz4_read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        /* Grow the match in both directions */
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        const uint8_t *mp = ip + LZ4_MIN_MATCH, *rp = ref + LZ4_MIN_MATCH;
+        while (mp < matchlimit && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        size_t lit = ip - anchor;
+        size_t mlen = mp - ip - LZ4_MIN_MATCH;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+            return 0;
+
+        uint8_t *token = op++;
+        if (lit >= 15) {
+            *token = 15 << 4;
+            op = lz4_put_length(op, lit - 15);
+        } else {
+            *token = lit << 4;
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+
+        size_t offset = ip - ref;
+        *op++ = offset;
+        *op++ = offset >> 8;
+
+        if (mlen >= 15) {
+            *token |= 15;
+            op = lz4_put_length(op, mlen - 15);
+        } else {
+            *token |= mlen;
+        }
+
+        ip = anchor = mp;
+    }
+
+    /* Whatever is left goes out as literals */
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+        return 0;
+
+    if (lit >= 15) {
+        *op++ = 15 << 4;
+        op = lz4_put_length(op, lit - 15);
+    } else {
+        *op++ = lit << 4;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+static inline int lz4_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Decompress len bytes of src into exactly cap bytes of dst */
+/* Returns 0 on success, -1 if the input is corrupt */
+static int lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && lz4_get_length(&ip, iend, &lit))
+            return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        /* The last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t)(op - dst))
+            return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz4_get_length(&ip, iend, &mlen))
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+
+        /* Byte by byte, the match may overlap what it produces */
+        const uint8_t *ref = op - offset;
+        while (mlen--)
+            *op++ = *ref++;
+    }
+
+    return op == oend ? 0 : -1;
+}
+
+/* Heap memory actually taken by an entry holding size bytes */
+static size_t zswap_alloc_size(size_t size) {
+    size_t alloc = 8;
+    while (alloc < sizeof(struct zswap_entry_t) + size)
+        alloc <<= 1;
+    return alloc;
+}
+
+/* Compress the page in frame into the store. Sets *size to the amount of
+ * memory the compressed copy takes. */
+/* Returns the entry holding the copy, or NULL if the page does not compress
+ * well enough or no memory is available */
+void *zswap_store(void *frame, size_t *size) {
+    /* Allocating the entry may recurse into reclaim */
+    if (!spinlock_test_and_acquire(&zswap_lock))
+        return NULL;
+
+    size_t len = lz4_compress((uint8_t *)((size_t)frame + MEM_PHYS_OFFSET), PAGE_SIZE,
+                              zswap_buf, ZSWAP_MAX_SIZE);
+    if (!len) {
+        zswap_rejects++;
+        spinlock_release(&zswap_lock);
+        return NULL;
+    }
+
+    struct zswap_entry_t *entry = kalloc_tagged(sizeof(struct zswap_entry_t) + len, MEM_TAG_ZSWAP);
+    if (!entry) {
+        spinlock_release(&zswap_lock);
+        return NULL;
+    }
+    entry->refcount = 1;
+    entry->size = len;
+    memcpy(entry->data, zswap_buf, len);
+
+    *size = zswap_alloc_size(len);
+    zswap_pages++;
+    zswap_stored += *size;
+    zswap_outs++;
+
+    spinlock_release(&zswap_lock);
+    return entry;
+}
+
+/* Decompress an entry into a new frame, the entry keeps its reference */
+/* Returns the frame, or NULL if no memory is available */
+void *zswap_load(void *handle) {
+    struct zswap_entry_t *entry = handle;
+
+    uint64_t start = rdtsc(uint64_t);
+
+    void *frame = pmm_alloc_tagged(1, MEM_TAG_USER);
+    if (!frame)
+        return NULL;
+
+    if (lz4_decompress(entry->data, entry->size,
+                       (uint8_t *)((size_t)frame + MEM_PHYS_OFFSET), PAGE_SIZE))
+        panic(NULL, 0, "zswap: Compressed page %X is corrupt", entry);
+
+    uint64_t cycles = rdtsc(uint64_t) - start;
+
+    spinlock_acquire(&zswap_lock);
+    zswap_ins++;
+    zswap_in_cycles += cycles;
+    spinlock_release(&zswap_lock);
+
+    return frame;
+}
+
+void zswap_ref(void *handle) {
+    struct zswap_entry_t *entry = handle;
+    locked_inc(&entry->refcount);
+}
+
+/* Drop a reference to an entry, freeing it with the last one */
+void zswap_drop(void *handle) {
+    struct zswap_entry_t *entry = handle;
+    if (locked_dec(&entry->refcount))
+        return;
+
+    spinlock_acquire(&zswap_lock);
+    zswap_pages--;
+    zswap_stored -= zswap_alloc_size(entry->size);
+    spinlock_release(&zswap_lock);
+
+    kfree(entry);
+}
+
+void zswap_stats(struct memstats *memstats) {
+    spinlock_acquire(&zswap_lock);
+    memstats->zswap_pages = zswap_pages;
+    memstats->zswap_stored = zswap_stored;
+    memstats->zswap_outs = zswap_outs;
+    memstats->zswap_ins = zswap_ins;
+    memstats->zswap_rejects = zswap_rejects;
+    memstats->zswap_in_cycles = zswap_in_cycles;
+    spinlock_release(&zswap_lock);
+}
+
+static size_t zswap_shrinker_count(void) {
+    return locked_read(size_t, &zswap_stored);
+}
+
+/* Swapping out shoots down translations on other CPUs, which cannot be
+ * waited for with interrupts disabled, so it counts as writeback */
+static size_t zswap_shrinker_scan(size_t bytes, int writeback) {
+    if (!writeback)
+        return 0;
+    return vmm_swap_out(bytes);
+}
+
+static struct shrinker_t zswap_shrinker = {
+    .name = "zswap",
+    .count = zswap_shrinker_count,
+    .scan = zswap_shrinker_scan
+};
+
+/* Registered after the other caches, which are cheaper to shrink */
+void init_zswap(void) {
+    register_shrinker(&zswap_shrinker);
+}
+
+#define BENCH_BASE ((size_t)0x10000000)
+#define BENCH_PAGES 256
+
+/* Fill a page with something about as compressible as typical heap data:
+ * runs of small integers, pointers and text mixed with random bytes */
+static void bench_fill(uint64_t *page, size_t n) {
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        switch (i % 8) {
+            case 0: page[i] = n * 64 + i; break;
+            case 1: page[i] = BENCH_BASE + (rand32() % 64) * 16; break;
+            case 2: page[i] = 0x6f77206f6c6c6568; break;
+            case 3: page[i] = rand32() & 0xff; break;
+            case 7: page[i] = rand64(); break;
+            default: page[i] = 0; break;
+        }
+    }
+}
+
+/* Compressed swap microbenchmark, run at boot if "zswapbench=1" is passed on
+ * the command line. Fills private anonymous pages, swaps them all out and
+ * faults them back in, checking their contents on the way. */
+void zswap_benchmark(void) {
+    char buf[8];
+    if (!cmdline_get_value(buf, sizeof(buf), "zswapbench"))
+        return;
+
+    struct pagemap_t *pagemap = new_address_space();
+    if (!pagemap)
+        return;
+    for (size_t j = PAGE_TABLE_ENTRIES / 2; j < PAGE_TABLE_ENTRIES; j++)
+        pagemap->pml4[j] = kernel_pagemap->pml4[j];
+
+    uint64_t *copy = kalloc(BENCH_PAGES * PAGE_SIZE);
+    if (!copy)
+        goto out;
+    if (vmm_map_region(pagemap, BENCH_BASE, BENCH_PAGES * PAGE_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0))
+        goto out;
+    if (vmm_prefault(pagemap, BENCH_BASE, BENCH_PAGES * PAGE_SIZE, 1))
+        goto out;
+
+    for (size_t i = 0; i < BENCH_PAGES; i++)
+        bench_fill(copy + i * (PAGE_SIZE / sizeof(uint64_t)), i);
+
+    size_t rflags = save_and_cli();
+    write_cr("3", vmm_activate(pagemap));
+    memcpy((void *)BENCH_BASE, copy, BENCH_PAGES * PAGE_SIZE);
+    write_cr("3", vmm_activate(kernel_pagemap));
+    restore_if(rflags);
+
+    struct memstats before, after;
+    getmemstats(&before);
+
+    /* The first pass only clears the accessed bits set while filling */
+    uint64_t start = rdtsc(uint64_t);
+    size_t freed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t addr = BENCH_BASE; addr < BENCH_BASE + BENCH_PAGES * PAGE_SIZE; )
+            freed += vmm_swap_out_range(pagemap, addr, BENCH_BASE + BENCH_PAGES * PAGE_SIZE, &addr);
+    }
+    uint64_t out_cycles = rdtsc(uint64_t) - start;
+
+    getmemstats(&after);
+    size_t pages = after.zswap_outs - before.zswap_outs;
+    size_t stored = after.zswap_stored - before.zswap_stored;
+
+    start = rdtsc(uint64_t);
+    for (size_t i = 0; i < BENCH_PAGES; i++) {
+        if (vmm_handle_fault(pagemap, BENCH_BASE + i * PAGE_SIZE, 0x04))
+            goto out;
+    }
+    uint64_t in_cycles = rdtsc(uint64_t) - start;
+
+    rflags = save_and_cli();
+    write_cr("3", vmm_activate(pagemap));
+    int ok = !memcmp((void *)BENCH_BASE, copy, BENCH_PAGES * PAGE_SIZE);
+    write_cr("3", vmm_activate(kernel_pagemap));
+    restore_if(rflags);
+
+    /* Compression ratio, in hundredths */
+    size_t ratio = stored ? pages * PAGE_SIZE * 100 / stored : 0;
+
+    kprint(KPRN_INFO, "zswap: %U/%u pages swapped out, %U bytes freed, ratio %U.%U%U",
+           pages, BENCH_PAGES, freed, ratio / 100, ratio / 10 % 10, ratio % 10);
+    kprint(KPRN_INFO, "zswap: %U cycles per swap-out, %U cycles per swap-in fault, contents %s",
+           pages ? out_cycles / pages : 0, in_cycles / BENCH_PAGES,
+           ok ? "intact" : "CORRUPTED");
+
+out:
+    kfree(copy);
+    free_address_space(pagemap);
+}
@@ -43,6 +43,13 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
         return -1;
     }
 
+    /* Segments are read in from the file on first access */
+    struct vm_file_t *file = vm_file_open(fd);
+    if (!file) {
+        kfree(phdr);
+        return -1;
+    }
+
     auxval->at_phdr = 0;
     auxval->at_phent = sizeof(struct elf_phdr_t);
     auxval->at_phnum = hdr.ph_num;
@@ -53,72 +60,81 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
                 continue;
 
             ld_path = kalloc(phdr[i].p_filesz + 1);
-            if (!ld_path) {
-                kfree(phdr);
-                return -1;
-            }
+            if (!ld_path)
+                goto fail;
 
             ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
-            if (ret == -1) {
-                kfree(phdr);
-                kfree(ld_path);
-                return -1;
-            }
+            if (ret == -1)
+                goto fail;
 
             ret = read(fd, ld_path, phdr[i].p_filesz);
-            if (ret == -1) {
-                kfree(phdr);
-                kfree(ld_path);
-                return -1;
-            }
+            if (ret == -1)
+                goto fail;
             ld_path[phdr[i].p_filesz] = 0;
+            continue;
         } else if (phdr[i].p_type == PT_PHDR) {
             auxval->at_phdr = base + phdr[i].p_vaddr;
+            continue;
         } else if (phdr[i].p_type != PT_LOAD)
             continue;
 
         size_t misalign = phdr[i].p_vaddr & (PAGE_SIZE - 1);
         size_t page_count = (misalign + phdr[i].p_memsz + (PAGE_SIZE - 1)) / PAGE_SIZE;
 
-        /* Allocate space */
-        void *addr = pmm_allocz(page_count);
-        if (!addr) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
-        }
-
-        size_t pf = 0x05;
-        if(phdr[i].p_flags & PF_W)
-            pf |= 0x02;
-        for (size_t j = 0; j < page_count; j++) {
-            size_t virt = base + phdr[i].p_vaddr + (j * PAGE_SIZE);
-            size_t phys = (size_t)addr + (j * PAGE_SIZE);
-            map_page(pagemap, phys, virt, pf);
-        }
-
-        ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
-        if (ret == -1) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
-        }
-
-        /* Segments need to be cleared to zero; however, pmm_allocz() already returns
-           zeroed pages. Thus we just need to read the file contents. */
-        char *buf = (char *)((size_t)addr + MEM_PHYS_OFFSET);
-        ret = read(fd, buf + misalign, phdr[i].p_filesz);
-        if (ret == -1) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
+        if ((phdr[i].p_offset & (PAGE_SIZE - 1)) != misalign
+         || phdr[i].p_filesz > phdr[i].p_memsz)
+            goto fail;
+
+        int prot = PROT_READ;
+        if (phdr[i].p_flags & PF_W)
+            prot |= PROT_WRITE;
+        if (phdr[i].p_flags & PF_X)
+            prot |= PROT_EXEC;
+
+        /* Whole pages of file data are read in on first access, the rest of
+         * the segment is demand-zero, bar the page straddling the end of the
+         * file data which is filled right away */
+        size_t seg_base = base + phdr[i].p_vaddr - misalign;
+        size_t seg_top = seg_base + page_count * PAGE_SIZE;
+        size_t file_offset = phdr[i].p_offset - misalign;
+        size_t file_top = seg_base + ((misalign + phdr[i].p_filesz) & ~(PAGE_SIZE - 1));
+        size_t tail = (misalign + phdr[i].p_filesz) & (PAGE_SIZE - 1);
+
+        if (file_top > seg_base
+         && vmm_map_region(pagemap, seg_base, file_top - seg_base, prot,
+                           MAP_PRIVATE, file, file_offset))
+            goto fail;
+
+        if (seg_top > file_top) {
+            if (vmm_map_region(pagemap, file_top, seg_top - file_top, prot,
+                               MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0))
+                goto fail;
+
+            if (tail) {
+                void *page = pmm_allocz_tagged(1, MEM_TAG_USER);
+                if (!page)
+                    goto fail;
+                if (vm_file_read(file, (void *)((size_t)page + MEM_PHYS_OFFSET),
+                                 file_offset + (file_top - seg_base), tail)
+                 || map_page(pagemap, (size_t)page, file_top, vmm_prot_to_flags(prot))) {
+                    pmm_free(page, 1);
+                    goto fail;
+                }
+            }
         }
     }
 
     kfree(phdr);
+    vm_file_unref(file);
 
     auxval->at_entry = base + hdr.entry;
     if (out_ld_path)
         *out_ld_path = ld_path;
     return 0;
+
+fail:
+    kfree(phdr);
+    kfree(ld_path);
+    vm_file_unref(file);
+    return -1;
 }
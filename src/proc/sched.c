@@ -0,0 +1,751 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <proc/task.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/time.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/apic.h>
+#include <sys/ipi.h>
+#include <sys/pit.h>
+
+/* Runnable threads sit on the run queue of their CPU, first come first
+ * served, and run there unless another CPU takes them over. Threads waiting for events or for a
+ * deadline are kept off the run queues, linked to their events in a hash
+ * keyed by event address and in a heap of deadlines, both protected by
+ * wait_lock. Whoever triggers an event or notices a deadline passing puts
+ * the thread back on its run queue, so picking the next thread to run never
+ * looks at threads that cannot run.
+ *
+ * A CPU running out of threads steals one from the busiest run queue rather
+ * than going idle, and every SCHED_BALANCE_INTERVAL_MS the timeslice tick
+ * pulls threads over from a much busier CPU. Threads that ran here last are
+ * pulled first, and threads that ran elsewhere in the last
+ * SCHED_CACHE_HOT_MS are left where their cache is.
+ *
+ * wait_lock is taken before any run queue lock, and two run queues are
+ * locked lowest CPU first. Interrupt handlers wake threads too, so all of
+ * them are only ever taken with interrupts disabled. */
+
+#define EVENT_WAIT_HASH_SHIFT 8
+#define EVENT_WAIT_BUCKETS ((size_t)1 << EVENT_WAIT_HASH_SHIFT)
+
+#define SCHED_BALANCE_INTERVAL_MS 20
+#define SCHED_CACHE_HOT_MS 5
+/* How far from the tail of a run queue to look for a thread to move */
+#define SCHED_MIGRATE_SCAN 8
+
+struct run_queue_t {
+    lock_t lock;
+    struct thread_t *head;
+    struct thread_t *tail;
+    size_t count;
+    /* Set while the CPU has nothing to run, so that whoever gives it a
+     * thread knows to kick it with an IPI */
+    int idle;
+    uint64_t last_balance;
+    /* Threads this CPU took from others, by stealing or balancing */
+    size_t steals;
+    size_t migrations;
+};
+
+struct event_wait_bucket_t {
+    struct event_waiter_t *head;
+    struct event_waiter_t *tail;
+};
+
+static struct run_queue_t run_queues[MAX_CPUS];
+
+static lock_t wait_lock = new_lock;
+static struct event_wait_bucket_t event_waits[EVENT_WAIT_BUCKETS];
+/* Pairing heap of sleeping threads, earliest wake_time at the root */
+static struct thread_t *sleep_heap = NULL;
+/* wake_time of the root, read by the tick without taking wait_lock */
+static uint64_t next_wake_time = (uint64_t)-1;
+
+/* Tickless idle. The PIT tick, which expires deadlines, only runs while the
+ * BSP has threads to run. Going idle, the BSP stops it and sets its local
+ * APIC timer for the earliest deadline instead, the other CPUs leave
+ * deadlines to it. tick_deadline is what the timer of the idle BSP is set
+ * for, 0 while the PIT ticks, and is protected by wait_lock. */
+static uint64_t tick_deadline = 0;
+/* Only touched by the BSP */
+static int tick_stopped = 0;
+
+void init_run_queues(void) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        run_queues[i].lock = new_lock;
+        /* CPUs wait in hlt until they are first given something to run */
+        run_queues[i].idle = 1;
+    }
+}
+
+/* Run queues, the queue's lock must be held */
+
+static void rq_push(struct run_queue_t *rq, struct thread_t *thread) {
+    thread->rq_next = NULL;
+    thread->rq_prev = rq->tail;
+    if (rq->tail)
+        rq->tail->rq_next = thread;
+    else
+        rq->head = thread;
+    rq->tail = thread;
+    rq->count++;
+}
+
+static void rq_remove(struct run_queue_t *rq, struct thread_t *thread) {
+    if (thread->rq_prev)
+        thread->rq_prev->rq_next = thread->rq_next;
+    else
+        rq->head = thread->rq_next;
+    if (thread->rq_next)
+        thread->rq_next->rq_prev = thread->rq_prev;
+    else
+        rq->tail = thread->rq_prev;
+    rq->count--;
+}
+
+/* Take the first thread off the queue, leaving paused ones stopped */
+static struct thread_t *rq_pop(struct run_queue_t *rq) {
+    while (rq->head) {
+        struct thread_t *thread = rq->head;
+        rq_remove(rq, thread);
+        if (locked_read(int, &thread->paused)) {
+            thread->state = THREAD_STOPPED;
+            continue;
+        }
+        return thread;
+    }
+    return NULL;
+}
+
+/* Make a thread ready on its CPU's queue, returns non-zero if the CPU
+ * is idle and has to be sent an IPI */
+static int rq_enqueue(struct run_queue_t *rq, struct thread_t *thread) {
+    thread->state = THREAD_READY;
+    rq_push(rq, thread);
+
+    int kick = rq->idle;
+    rq->idle = 0;
+    return kick;
+}
+
+/* Get a thread just queued on cpu going. An idle cpu is sent an IPI, else
+ * an idle CPU, if any, is sent one to come and steal it. The timers of idle
+ * CPUs are off but for deadlines, so IPIs are all that wakes them. */
+static void rq_kick(int cpu, int idle) {
+    if (idle) {
+        lapic_send_ipi(cpu, IPI_RESCHED);
+        return;
+    }
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (i == cpu || !locked_read(int, &run_queues[i].idle))
+            continue;
+        /* Only one waker gets to kick it */
+        if (locked_write(int, &run_queues[i].idle, 0)) {
+            lapic_send_ipi(i, IPI_RESCHED);
+            return;
+        }
+    }
+}
+
+/* Put a thread which is on no run queue back on its CPU's.
+ * Interrupts must be disabled. */
+static void sched_make_ready(struct thread_t *thread) {
+    int cpu = thread->cpu;
+    struct run_queue_t *rq = &run_queues[cpu];
+
+    spinlock_acquire(&rq->lock);
+    int idle = rq_enqueue(rq, thread);
+    spinlock_release(&rq->lock);
+
+    rq_kick(cpu, idle);
+}
+
+/* Lock the run queue of a thread which may be moving between CPUs */
+static struct run_queue_t *rq_lock_thread(struct thread_t *thread) {
+    for (;;) {
+        int cpu = locked_read(int, &thread->cpu);
+        struct run_queue_t *rq = &run_queues[cpu];
+        spinlock_acquire(&rq->lock);
+        if (thread->cpu == cpu)
+            return rq;
+        spinlock_release(&rq->lock);
+    }
+}
+
+static void rq_lock_pair(int a, int b) {
+    if (a > b) {
+        int tmp = a;
+        a = b;
+        b = tmp;
+    }
+    spinlock_acquire(&run_queues[a].lock);
+    spinlock_acquire(&run_queues[b].lock);
+}
+
+static void rq_unlock_pair(int a, int b) {
+    spinlock_release(&run_queues[a].lock);
+    spinlock_release(&run_queues[b].lock);
+}
+
+/* The CPU other than cpu with the most threads queued, -1 if they all
+ * have less than min. Looked up without locking, so only a hint. */
+static int rq_busiest(int cpu, size_t min) {
+    int busiest = -1;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (i == cpu)
+            continue;
+        size_t count = locked_read(size_t, &run_queues[i].count);
+        if (count >= min) {
+            busiest = i;
+            min = count + 1;
+        }
+    }
+
+    return busiest;
+}
+
+static int thread_cache_hot(struct thread_t *thread) {
+    return thread->last_run
+        && uptime_raw - thread->last_run < SCHED_CACHE_HOT_MS * (PIT_FREQUENCY_HZ / 1000);
+}
+
+/* Find a thread near the tail of victim's run queue to move to cpu, one that
+ * last ran on cpu if possible. Threads still on their last CPU's stack or
+ * paused cannot move, cache hot ones only if any is set. Both run queues
+ * must be locked. */
+/* Returns NULL if there is none */
+static struct thread_t *rq_pick_migrant(struct run_queue_t *victim, int cpu, int any) {
+    struct thread_t *candidate = NULL;
+    struct thread_t *thread = victim->tail;
+
+    for (int i = 0; thread && i < SCHED_MIGRATE_SCAN; i++, thread = thread->rq_prev) {
+        if (locked_read(int, &thread->on_cpu) || locked_read(int, &thread->paused))
+            continue;
+        if (thread->last_run && thread->last_cpu == cpu)
+            return thread;
+        if (!candidate && (any || !thread_cache_hot(thread)))
+            candidate = thread;
+    }
+
+    return candidate;
+}
+
+/* Move a thread from victim's run queue to the one of cpu, off any queue
+ * if rq is NULL. Both run queues must be locked. */
+static void rq_migrate(struct run_queue_t *victim, struct run_queue_t *rq,
+                       struct thread_t *thread, int cpu) {
+    rq_remove(victim, thread);
+    thread->cpu = cpu;
+    run_queues[cpu].migrations++;
+    if (rq)
+        rq_push(rq, thread);
+}
+
+/* Heap of deadlines, wait_lock must be held */
+
+static struct thread_t *sleep_meld(struct thread_t *a, struct thread_t *b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (b->wake_time < a->wake_time) {
+        struct thread_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    /* b becomes the first child of a */
+    b->sleep_prev = a;
+    b->sleep_next = a->sleep_child;
+    if (a->sleep_child)
+        a->sleep_child->sleep_prev = b;
+    a->sleep_child = b;
+
+    return a;
+}
+
+/* Meld a list of siblings into one heap, in pairs from left to right and
+ * then the pairs from right to left */
+static struct thread_t *sleep_merge_pairs(struct thread_t *first) {
+    struct thread_t *pairs = NULL;
+
+    while (first) {
+        struct thread_t *a = first;
+        struct thread_t *b = a->sleep_next;
+        first = b ? b->sleep_next : NULL;
+
+        a->sleep_prev = a->sleep_next = NULL;
+        if (b)
+            b->sleep_prev = b->sleep_next = NULL;
+
+        a = sleep_meld(a, b);
+        a->sleep_next = pairs;
+        pairs = a;
+    }
+
+    struct thread_t *root = NULL;
+    while (pairs) {
+        struct thread_t *next = pairs->sleep_next;
+        pairs->sleep_next = NULL;
+        root = sleep_meld(root, pairs);
+        pairs = next;
+    }
+
+    return root;
+}
+
+static void sleep_update_next(void) {
+    locked_write(uint64_t, &next_wake_time,
+                 sleep_heap ? sleep_heap->wake_time : (uint64_t)-1);
+}
+
+static void sleep_insert(struct thread_t *thread, uint64_t wake_time) {
+    thread->wake_time = wake_time;
+    thread->sleep_child = thread->sleep_next = thread->sleep_prev = NULL;
+    thread->sleeping = 1;
+
+    sleep_heap = sleep_meld(sleep_heap, thread);
+    sleep_update_next();
+
+    /* The idle BSP would only notice an earlier deadline once its timer
+     * fires, have it set the timer anew */
+    if (wake_time < tick_deadline) {
+        tick_deadline = wake_time;
+        lapic_send_ipi(0, IPI_RESCHED);
+    }
+}
+
+static void sleep_remove(struct thread_t *thread) {
+    struct thread_t *children = sleep_merge_pairs(thread->sleep_child);
+
+    if (thread == sleep_heap) {
+        sleep_heap = children;
+    } else {
+        /* Cut it out of the children of its parent, sleep_prev is the
+         * parent for the first child and the previous sibling otherwise */
+        if (thread->sleep_prev->sleep_child == thread)
+            thread->sleep_prev->sleep_child = thread->sleep_next;
+        else
+            thread->sleep_prev->sleep_next = thread->sleep_next;
+        if (thread->sleep_next)
+            thread->sleep_next->sleep_prev = thread->sleep_prev;
+        sleep_heap = sleep_meld(sleep_heap, children);
+    }
+
+    thread->sleeping = 0;
+    sleep_update_next();
+}
+
+/* Event waits, wait_lock must be held */
+
+static inline struct event_wait_bucket_t *event_wait_bucket(event_t *event) {
+    return &event_waits[((size_t)event * 0x9e3779b97f4a7c15) >> (64 - EVENT_WAIT_HASH_SHIFT)];
+}
+
+static void event_wait_link(struct event_waiter_t *waiter) {
+    struct event_wait_bucket_t *bucket = event_wait_bucket(waiter->event);
+
+    waiter->next = NULL;
+    waiter->prev = bucket->tail;
+    if (bucket->tail)
+        bucket->tail->next = waiter;
+    else
+        bucket->head = waiter;
+    bucket->tail = waiter;
+}
+
+static void event_wait_unlink(struct event_waiter_t *waiter) {
+    struct event_wait_bucket_t *bucket = event_wait_bucket(waiter->event);
+
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        bucket->head = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    else
+        bucket->tail = waiter->prev;
+}
+
+/* Consume whichever of a thread's events are up, returns non-zero if any */
+static int thread_take_events(struct thread_t *thread) {
+    int taken = 0;
+
+    for (int i = 0; i < thread->event_num; i++) {
+        if (locked_dec_if_positive(thread->event_ptr[i])) {
+            thread->out_event_ptr[i] = 1;
+            taken = 1;
+        }
+    }
+
+    return taken;
+}
+
+/* Unlink a thread from its events and the heap of deadlines */
+static void thread_unwait(struct thread_t *thread) {
+    if (thread->events_linked) {
+        for (int i = 0; i < thread->event_num; i++)
+            event_wait_unlink(&thread->event_waiters[i]);
+        thread->events_linked = 0;
+    }
+    if (thread->sleeping)
+        sleep_remove(thread);
+}
+
+/* Block a thread switching away on its events or its sleep, unless the wait
+ * is already over. wait_lock and the lock of its run queue must be held. */
+/* Returns non-zero if it blocked */
+static int thread_block(struct thread_t *thread) {
+    uint64_t now = uptime_raw;
+
+    if (thread->event_ptr && !locked_read(int, &thread->event_abrt)) {
+        if (thread_take_events(thread)) {
+            thread->event_ptr = NULL;
+            return 0;
+        }
+        /* Only time out if no event came in */
+        if (thread->event_timeout && thread->event_timeout <= now) {
+            thread->event_ptr = NULL;
+            thread->event_timeout = 0;
+            return 0;
+        }
+
+        for (int i = 0; i < thread->event_num; i++) {
+            struct event_waiter_t *waiter = &thread->event_waiters[i];
+            waiter->event = thread->event_ptr[i];
+            waiter->thread = thread;
+            event_wait_link(waiter);
+        }
+        thread->events_linked = 1;
+
+        if (thread->event_timeout)
+            sleep_insert(thread, thread->event_timeout);
+    } else if (thread->yield_target > now) {
+        sleep_insert(thread, thread->yield_target);
+    } else {
+        return 0;
+    }
+
+    thread->state = THREAD_BLOCKED;
+    return 1;
+}
+
+/* Put the thread a CPU switches away from where it belongs, its context
+ * already saved, then take the next thread to run off the CPU's run queue.
+ * Interrupts must be disabled. */
+/* Returns NULL if there is nothing to run, the CPU is then marked idle */
+struct thread_t *sched_switch(struct thread_t *prev) {
+    int cpu = current_cpu;
+    struct run_queue_t *rq = &run_queues[cpu];
+    int waiting = 0;
+
+    if (prev && !prev->kill_pending && !locked_read(int, &prev->paused)
+        && (prev->event_ptr || prev->yield_target > uptime_raw)) {
+        spinlock_acquire(&wait_lock);
+        waiting = 1;
+    }
+
+    spinlock_acquire(&rq->lock);
+
+    if (prev) {
+        prev->last_run = uptime_raw;
+        prev->last_cpu = cpu;
+        if (prev->kill_pending)
+            prev->state = THREAD_DEAD;
+        else if (locked_read(int, &prev->paused))
+            prev->state = THREAD_STOPPED;
+        else if (!waiting || !thread_block(prev))
+            rq_enqueue(rq, prev);
+    }
+
+    if (waiting)
+        spinlock_release(&wait_lock);
+
+    struct thread_t *next = rq_pop(rq);
+
+    if (!next) {
+        /* Rather than idle, take a thread from the busiest CPU */
+        spinlock_release(&rq->lock);
+
+        int victim_cpu = rq_busiest(cpu, 1);
+        if (victim_cpu == -1) {
+            spinlock_acquire(&rq->lock);
+            next = rq_pop(rq);
+        } else {
+            struct run_queue_t *victim = &run_queues[victim_cpu];
+            rq_lock_pair(cpu, victim_cpu);
+            /* Something may have come in while the queue was unlocked */
+            next = rq_pop(rq);
+            if (!next) {
+                next = rq_pick_migrant(victim, cpu, 1);
+                if (next) {
+                    rq_migrate(victim, NULL, next, cpu);
+                    rq->steals++;
+                }
+            }
+            spinlock_release(&victim->lock);
+        }
+    }
+
+    if (next) {
+        next->state = THREAD_RUNNING;
+        next->on_cpu = 1;
+    }
+    rq->idle = !next;
+
+    spinlock_release(&rq->lock);
+
+    return next;
+}
+
+/* Pull threads over from the busiest CPU if it has at least two more queued
+ * than this one, every SCHED_BALANCE_INTERVAL_MS. Called on the timeslice
+ * tick with interrupts disabled. */
+void sched_balance(void) {
+    int cpu = current_cpu;
+    struct run_queue_t *rq = &run_queues[cpu];
+
+    if (uptime_raw - rq->last_balance < SCHED_BALANCE_INTERVAL_MS * (PIT_FREQUENCY_HZ / 1000))
+        return;
+    rq->last_balance = uptime_raw;
+
+    int victim_cpu = rq_busiest(cpu, locked_read(size_t, &rq->count) + 2);
+    if (victim_cpu == -1)
+        return;
+
+    struct run_queue_t *victim = &run_queues[victim_cpu];
+    rq_lock_pair(cpu, victim_cpu);
+
+    /* Even them out */
+    while (victim->count >= rq->count + 2) {
+        struct thread_t *thread = rq_pick_migrant(victim, cpu, 0);
+        if (!thread)
+            break;
+        rq_migrate(victim, rq, thread, cpu);
+    }
+
+    rq_unlock_pair(cpu, victim_cpu);
+}
+
+void getschedstats(struct schedstats *schedstats) {
+    schedstats->cpus = smp_cpu_count;
+    schedstats->steals = 0;
+    schedstats->migrations = 0;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        struct run_queue_t *rq = &run_queues[i];
+
+        size_t rflags = save_and_cli();
+        spinlock_acquire(&rq->lock);
+        schedstats->cpu_queued[i] = rq->count;
+        schedstats->cpu_steals[i] = rq->steals;
+        schedstats->cpu_migrations[i] = rq->migrations;
+        spinlock_release(&rq->lock);
+        restore_if(rflags);
+
+        schedstats->steals += schedstats->cpu_steals[i];
+        schedstats->migrations += schedstats->cpu_migrations[i];
+    }
+}
+
+/* Hand a new thread to the scheduler, on the least loaded CPU */
+void sched_add(struct thread_t *thread) {
+    int cpu = 0;
+    size_t best = (size_t)-1;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        size_t load = locked_read(size_t, &run_queues[i].count)
+                      + !locked_read(int, &run_queues[i].idle);
+        if (load < best) {
+            best = load;
+            cpu = i;
+        }
+    }
+
+    thread->cpu = cpu;
+
+    size_t rflags = save_and_cli();
+    sched_make_ready(thread);
+    restore_if(rflags);
+}
+
+/* Wake the threads waiting on an event, in the order they started waiting,
+ * for as long as its count lasts. Called after incrementing the event, by
+ * event_trigger() and by the interrupt thunks. */
+void event_wake(event_t *event) {
+    size_t rflags = save_and_cli();
+    spinlock_acquire(&wait_lock);
+
+    struct event_wait_bucket_t *bucket = event_wait_bucket(event);
+    struct event_waiter_t *waiter = bucket->head;
+
+    while (waiter && locked_read(event_t, event) > 0) {
+        struct thread_t *thread = waiter->thread;
+
+        if (waiter->event != event || !thread_take_events(thread)) {
+            waiter = waiter->next;
+            continue;
+        }
+
+        /* This unlinks the thread's other waiters too, start over */
+        thread_unwait(thread);
+        thread->event_ptr = NULL;
+        sched_make_ready(thread);
+        waiter = bucket->head;
+    }
+
+    spinlock_release(&wait_lock);
+    restore_if(rflags);
+}
+
+/* Wake the threads whose sleep or event timeout is over, called on every
+ * PIT tick and local APIC timer interrupt with interrupts disabled */
+void sched_wake_sleepers(void) {
+    if (uptime_raw < locked_read(uint64_t, &next_wake_time))
+        return;
+
+    spinlock_acquire(&wait_lock);
+
+    while (sleep_heap && sleep_heap->wake_time <= uptime_raw) {
+        struct thread_t *thread = sleep_heap;
+        int timed_wait = thread->events_linked;
+
+        thread_unwait(thread);
+        if (timed_wait) {
+            if (!thread_take_events(thread))
+                thread->event_timeout = 0;
+            thread->event_ptr = NULL;
+        }
+        sched_make_ready(thread);
+    }
+
+    spinlock_release(&wait_lock);
+}
+
+/* The calling CPU is going idle, turn its timer off, or for the BSP stop
+ * the PIT and set the timer for the earliest deadline. Interrupts must be
+ * disabled. */
+void sched_tick_stop(void) {
+    if (current_cpu != 0 || !time_tickless()) {
+        lapic_timer_stop();
+        return;
+    }
+
+    if (!tick_stopped) {
+        pit_stop();
+        tick_stopped = 1;
+    }
+    time_update();
+
+    spinlock_acquire(&wait_lock);
+    uint64_t deadline = sleep_heap ? sleep_heap->wake_time : (uint64_t)-1;
+    tick_deadline = deadline;
+    spinlock_release(&wait_lock);
+
+    if (deadline == (uint64_t)-1) {
+        lapic_timer_stop();
+        return;
+    }
+
+    /* Ticks are whole, the timer cannot fire before the deadline */
+    uint64_t now = uptime_raw;
+    lapic_timer_oneshot(deadline > now ? (deadline - now) / (PIT_FREQUENCY_HZ / 1000) : 0);
+}
+
+/* The calling CPU has a thread to run again, for the BSP that means the PIT
+ * ticks again. Interrupts must be disabled. */
+void sched_tick_restart(void) {
+    if (current_cpu != 0 || !tick_stopped)
+        return;
+
+    spinlock_acquire(&wait_lock);
+    tick_deadline = 0;
+    spinlock_release(&wait_lock);
+
+    time_update();
+    pit_start();
+    tick_stopped = 0;
+}
+
+/* Wake a thread blocked in events_await() after setting its event_abrt */
+void sched_abort_wait(struct thread_t *thread) {
+    size_t rflags = save_and_cli();
+    spinlock_acquire(&wait_lock);
+
+    if (thread->events_linked) {
+        thread_unwait(thread);
+        thread->event_ptr = NULL;
+        sched_make_ready(thread);
+    }
+
+    spinlock_release(&wait_lock);
+    restore_if(rflags);
+}
+
+/* Put a thread stopped by a pause back on its run queue, after clearing its
+ * paused flag. Threads that did not get to stop yet just keep going. */
+void sched_resume(struct thread_t *thread) {
+    size_t rflags = save_and_cli();
+
+    struct run_queue_t *rq = rq_lock_thread(thread);
+    int cpu = thread->cpu;
+    int stopped = thread->state == THREAD_STOPPED;
+    int idle = 0;
+
+    if (stopped)
+        idle = rq_enqueue(rq, thread);
+    spinlock_release(&rq->lock);
+
+    if (stopped)
+        rq_kick(cpu, idle);
+
+    restore_if(rflags);
+}
+
+/* Take a thread other than the current one off the CPUs for good. A thread
+ * running on another CPU is made to switch away, and this only returns once
+ * no CPU is on its stack anymore. scheduler_lock must be held. */
+void sched_kill(struct thread_t *thread) {
+    size_t rflags = save_and_cli();
+    spinlock_acquire(&wait_lock);
+
+    struct run_queue_t *rq = rq_lock_thread(thread);
+    int cpu = thread->cpu;
+    int running = 0;
+
+    switch (thread->state) {
+        case THREAD_READY:
+            rq_remove(rq, thread);
+            thread->state = THREAD_DEAD;
+            break;
+        case THREAD_BLOCKED:
+            thread_unwait(thread);
+            thread->state = THREAD_DEAD;
+            break;
+        case THREAD_RUNNING:
+            /* The CPU marks it dead as it switches away */
+            thread->kill_pending = 1;
+            running = 1;
+            break;
+        default:
+            thread->state = THREAD_DEAD;
+            break;
+    }
+    spinlock_release(&rq->lock);
+
+    spinlock_release(&wait_lock);
+    restore_if(rflags);
+
+    if (running)
+        lapic_send_ipi(cpu, IPI_RESCHED);
+
+    while (locked_read(int, &thread->state) != THREAD_DEAD
+           || locked_read(int, &thread->on_cpu))
+        asm volatile ("pause" ::: "memory");
+}
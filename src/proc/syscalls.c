@@ -70,11 +70,13 @@ int syscall_poll(struct regs_t *regs) {
     spinlock_release(&scheduler_lock);
 
     struct pollfd *system_fds = kalloc(sizeof(struct pollfd) * nfds);
+    spinlock_acquire(&process->file_handles_lock);
     for (size_t i = 0; i < nfds; i++) {
         system_fds[i].events  = fds[i].events;
         system_fds[i].revents = fds[i].revents;
-        system_fds[i].fd      = process->file_handles[fds[i].fd];
+        system_fds[i].fd      = task_fd_get(process, fds[i].fd);
     }
+    spinlock_release(&process->file_handles_lock);
 
     int ret = poll(fds, system_fds, timeout);
 
@@ -125,6 +127,21 @@ int syscall_getmemstats(struct regs_t *regs) {
     return getmemstats(memstats);
 }
 
+int syscall_getcachestats(struct regs_t *regs) {
+    // rdi: struct cachestats *
+    // rsi: number of entries
+    struct cachestats *stats = (void *)regs->rdi;
+    int count = (int)regs->rsi;
+
+    if (count < 0
+     || privilege_check((size_t)stats, count * sizeof(struct cachestats))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return getcachestats(stats, count);
+}
+
 int syscall_gethostname(struct regs_t *regs) {
     char *buf = (char *)regs->rdi;
     size_t len = (size_t)regs->rsi;
@@ -261,7 +278,7 @@ int syscall_tcgetattr(struct regs_t *regs) {
         return -1;
     }
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -294,7 +311,7 @@ int syscall_tcsetattr(struct regs_t *regs) {
         return -1;
     }
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -321,7 +338,7 @@ int syscall_tcflow(struct regs_t *regs) {
         return -1;
     }
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -346,7 +363,7 @@ int syscall_isatty(struct regs_t *regs) {
         return -1;
     }
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -399,7 +416,7 @@ int syscall_readdir(struct regs_t *regs) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[fd] == -1) {
+    if (task_fd_get(process, fd) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -479,11 +496,10 @@ int syscall_waitpid(struct regs_t *regs) {
                     sizeof(struct child_event_t) * process->child_event_i);
                 spinlock_release(&process->child_event_lock);
                 spinlock_acquire(&scheduler_lock);
-                kfree(child_process);
-                process_table[child_pid] = (void *)(-1);
                 /* the child has been waited for so we need to add the usage */
                 add_usage(&process->child_usage, &child_process->own_usage);
                 add_usage(&process->child_usage, &child_process->child_usage);
+                task_preap(child_pid);
                 spinlock_release(&scheduler_lock);
                 return child_pid;
             }
@@ -575,10 +591,16 @@ int syscall_fork(struct regs_t *regs) {
         return -1;
     spinlock_acquire(&scheduler_lock);
 
-    struct pagemap_t *new_pagemap = fork_address_space(old_process->pagemap);
-
     struct process_t *new_process = process_table[new_pid];
 
+    struct pagemap_t *new_pagemap = fork_address_space(old_process->pagemap);
+    if (!new_pagemap) {
+        task_pdiscard(new_pid);
+        spinlock_release(&scheduler_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
     new_process->ppid = current_process;
     new_process->pgid = old_process->pgid;
     new_process->uid  = old_process->uid;
@@ -594,11 +616,20 @@ int syscall_fork(struct regs_t *regs) {
     new_process->cur_brk = old_process->cur_brk;
 
     /* Duplicate all file handles */
-    for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
+    spinlock_acquire(&old_process->file_handles_lock);
+    if (task_fd_reserve(new_process, old_process->file_handles_cap)) {
+        spinlock_release(&old_process->file_handles_lock);
+        task_pdiscard(new_pid);
+        spinlock_release(&scheduler_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < old_process->file_handles_cap; i++) {
         if (old_process->file_handles[i] == -1)
             continue;
         new_process->file_handles[i] = dup(old_process->file_handles[i]);
     }
+    spinlock_release(&old_process->file_handles_lock);
 
     /* Copy signal handlers */
     for (size_t i = 0; i < SIGNAL_MAX; i++)
@@ -606,36 +637,38 @@ int syscall_fork(struct regs_t *regs) {
             old_process->signal_handlers[i].sa_handler;
     new_process->sigmask = old_process->sigmask;
 
-    new_process->threads[0] = kalloc(sizeof(struct thread_t));
-    struct thread_t *new_thread = new_process->threads[0];
-
-    /* Search for free global task ID */
-    tid_t new_task_id;
-    for (new_task_id = 0; new_task_id < MAX_TASKS; new_task_id++) {
-        if (!task_table[new_task_id] || task_table[new_task_id] == (void *)(-1))
-            goto found_new_task_id;
+    /* The process is brand new, so this is TID 0 */
+    tid_t new_tid = task_tid_alloc(new_process);
+    tid_t new_task_id = task_id_alloc();
+    struct thread_t *new_thread = thread_alloc();
+    if (new_tid == -1 || new_task_id == -1 || !new_thread) {
+        /* The TID goes away with the process */
+        if (new_thread)
+            thread_free(new_thread);
+        if (new_task_id != -1)
+            task_id_release(new_task_id);
+        task_pdiscard(new_pid);
+        spinlock_release(&scheduler_lock);
+        errno = EAGAIN;
+        return -1;
     }
-    //goto err;
 
-found_new_task_id:
+    new_process->threads[new_tid] = new_thread;
     task_table[new_task_id] = new_thread;
 
-    new_thread->tid = 0;
+    new_thread->tid = new_tid;
     new_thread->task_id = new_task_id;
     new_thread->process = new_pid;
-    new_thread->lock = new_lock;
     new_thread->yield_target = 0;
     new_thread->active_on_cpu = -1;
-    /* TODO: fix this */
-    new_thread->kstack = (size_t)kalloc(32768) + 32768;
     new_thread->fs_base = calling_thread->fs_base;
     new_thread->ctx.regs = *regs;
     new_thread->ctx.regs.rax = 0;
-    new_thread->ctx.fxstate = kalloc(cpu_simd_region_size);
 
     cpu_save_simd(new_thread->ctx.fxstate);
 
     task_count++;
+    sched_add(new_thread);
 
     spinlock_release(&scheduler_lock);
 
@@ -681,21 +714,105 @@ void *syscall_alloc_at(struct regs_t *regs) {
         spinlock_release(&process->cur_brk_lock);
     }
 
-    void *ptr = pmm_allocz(regs->rsi);
-    if (!ptr) {
+    /* Pages are zero filled on first access */
+    if (vmm_map_region(process->pagemap, base_address, regs->rsi * PAGE_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0)) {
         errno = ENOMEM;
         return (void *)0;
     }
-    for (size_t i = 0; i < regs->rsi; i++) {
-        if (map_page(process->pagemap, (size_t)ptr + i * PAGE_SIZE,
-            base_address + i * PAGE_SIZE, 0x07)) {
-            pmm_free(ptr, regs->rsi);
-            errno = ENOMEM;
-            return (void *)0;
+
+    return (void *)base_address;
+}
+
+int syscall_free_at(struct regs_t *regs) {
+    // rdi: virtual address
+    // rsi: page count
+    spinlock_acquire(&scheduler_lock);
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+    struct process_t *process = process_table[current_process];
+    spinlock_release(&scheduler_lock);
+
+    if (privilege_check(regs->rdi, regs->rsi * PAGE_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!regs->rsi)
+        return 0;
+
+    return vmm_munmap(process->pagemap, (void *)regs->rdi, regs->rsi * PAGE_SIZE);
+}
+
+void *syscall_mmap(struct regs_t *regs) {
+    // rdi: address hint
+    // rsi: length
+    // rdx: protection
+    // r10: flags
+    // r8: fd
+    // r9: offset
+    spinlock_acquire(&scheduler_lock);
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+    struct process_t *process = process_table[current_process];
+    spinlock_release(&scheduler_lock);
+
+    int flags = (int)regs->r10;
+    int fd = (int)regs->r8;
+
+    if (privilege_check(regs->rdi, regs->rsi)) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    int fd_sys = -1;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (fd < 0 || fd >= MAX_FILE_HANDLES) {
+            errno = EBADF;
+            return MAP_FAILED;
+        }
+        spinlock_acquire(&process->file_handles_lock);
+        fd_sys = task_fd_get(process, fd);
+        spinlock_release(&process->file_handles_lock);
+        if (fd_sys == -1) {
+            errno = EBADF;
+            return MAP_FAILED;
         }
     }
 
-    return (void *)base_address;
+    return vmm_mmap(process->pagemap, (void *)regs->rdi, regs->rsi,
+                    (int)regs->rdx, flags, fd_sys, regs->r9);
+}
+
+int syscall_munmap(struct regs_t *regs) {
+    // rdi: address
+    // rsi: length
+    spinlock_acquire(&scheduler_lock);
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+    struct process_t *process = process_table[current_process];
+    spinlock_release(&scheduler_lock);
+
+    if (privilege_check(regs->rdi, regs->rsi)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return vmm_munmap(process->pagemap, (void *)regs->rdi, regs->rsi);
+}
+
+int syscall_mprotect(struct regs_t *regs) {
+    // rdi: address
+    // rsi: length
+    // rdx: protection
+    spinlock_acquire(&scheduler_lock);
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+    struct process_t *process = process_table[current_process];
+    spinlock_release(&scheduler_lock);
+
+    if (privilege_check(regs->rdi, regs->rsi)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return vmm_mprotect(process->pagemap, (void *)regs->rdi, regs->rsi, (int)regs->rdx);
 }
 
 int syscall_debug_print(struct regs_t *regs) {
@@ -747,27 +864,25 @@ int syscall_pipe(struct regs_t *regs) {
     int sys_pipefd[2];
     pipe(sys_pipefd);
 
-    int local_fd_read;
-    for (local_fd_read = 0; process->file_handles[local_fd_read] != -1; local_fd_read++)
-        if (local_fd_read + 1 == MAX_FILE_HANDLES) {
-            close(sys_pipefd[0]);
-            close(sys_pipefd[1]);
-            spinlock_release(&process->file_handles_lock);
-            errno = EMFILE;
-            return -1;
-        }
+    int local_fd_read = task_fd_alloc(process, 0);
+    if (local_fd_read == -1) {
+        close(sys_pipefd[0]);
+        close(sys_pipefd[1]);
+        spinlock_release(&process->file_handles_lock);
+        errno = EMFILE;
+        return -1;
+    }
     process->file_handles[local_fd_read] = sys_pipefd[0];
 
-    int local_fd_write;
-    for (local_fd_write = 0; process->file_handles[local_fd_write] != -1; local_fd_write++)
-        if (local_fd_write + 1 == MAX_FILE_HANDLES) {
-            close(sys_pipefd[0]);
-            close(sys_pipefd[1]);
-            process->file_handles[local_fd_read] = -1;
-            spinlock_release(&process->file_handles_lock);
-            errno = EMFILE;
-            return -1;
-        }
+    int local_fd_write = task_fd_alloc(process, 0);
+    if (local_fd_write == -1) {
+        close(sys_pipefd[0]);
+        close(sys_pipefd[1]);
+        process->file_handles[local_fd_read] = -1;
+        spinlock_release(&process->file_handles_lock);
+        errno = EMFILE;
+        return -1;
+    }
     process->file_handles[local_fd_write] = sys_pipefd[1];
 
     pipefd[0] = local_fd_read;
@@ -846,13 +961,12 @@ int syscall_open(struct regs_t *regs) {
 
     spinlock_acquire(&process->file_handles_lock);
 
-    int local_fd;
-
-    for (local_fd = 0; process->file_handles[local_fd] != -1; local_fd++)
-        if (local_fd + 1 == MAX_FILE_HANDLES) {
-            spinlock_release(&process->file_handles_lock);
-            return -1;
-        }
+    int local_fd = task_fd_alloc(process, 0);
+    if (local_fd == -1) {
+        spinlock_release(&process->file_handles_lock);
+        errno = EMFILE;
+        return -1;
+    }
 
     char abs_path[2048];
     spinlock_acquire(&process->cwd_lock);
@@ -883,7 +997,7 @@ static int get_fd_sys(int fd) {
         return -1;
 
     spinlock_acquire(&process->file_handles_lock);
-    int fd_sys = process->file_handles[fd];
+    int fd_sys = task_fd_get(process, fd);
     spinlock_release(&process->file_handles_lock);
 
     return fd_sys;
@@ -912,7 +1026,7 @@ static int fcntl_dupfd(int fd, int lowest_fd, int cloexec) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    int old_fd_sys = process->file_handles[fd];
+    int old_fd_sys = task_fd_get(process, fd);
     spinlock_release(&process->file_handles_lock);
 
     if (old_fd_sys == -1) {
@@ -923,17 +1037,14 @@ static int fcntl_dupfd(int fd, int lowest_fd, int cloexec) {
     int new_fd;
 
     spinlock_acquire(&process->file_handles_lock);
-    for (new_fd = lowest_fd; new_fd < MAX_FILE_HANDLES; new_fd++) {
-        if (process->file_handles[new_fd] == -1)
-            goto fnd;
+    new_fd = task_fd_alloc(process, lowest_fd);
+    if (new_fd == -1) {
+        // free handle not found
+        spinlock_release(&process->file_handles_lock);
+        errno = EINVAL;
+        return -1;
     }
 
-    // free handle not found
-    spinlock_release(&process->file_handles_lock);
-    errno = EINVAL;
-    return -1;
-
-fnd:;
     int new_fd_sys = dup(old_fd_sys);
     process->file_handles[new_fd] = new_fd_sys;
     spinlock_release(&process->file_handles_lock);
@@ -947,7 +1058,7 @@ static int fcntl_getfd(int fd) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    int fd_sys = process->file_handles[fd];
+    int fd_sys = task_fd_get(process, fd);
     spinlock_release(&process->file_handles_lock);
 
     if (fd_sys == -1) {
@@ -965,7 +1076,7 @@ static int fcntl_setfd(int fd, int fdflags) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    int fd_sys = process->file_handles[fd];
+    int fd_sys = task_fd_get(process, fd);
     spinlock_release(&process->file_handles_lock);
 
     if (fd_sys == -1) {
@@ -983,7 +1094,7 @@ static int fcntl_getfl(int fd) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    int fd_sys = process->file_handles[fd];
+    int fd_sys = task_fd_get(process, fd);
     spinlock_release(&process->file_handles_lock);
 
     if (fd_sys == -1) {
@@ -1001,7 +1112,7 @@ static int fcntl_setfl(int fd, int flflags) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    int fd_sys = process->file_handles[fd];
+    int fd_sys = task_fd_get(process, fd);
     spinlock_release(&process->file_handles_lock);
 
     if (fd_sys == -1) {
@@ -1095,8 +1206,8 @@ int syscall_dup2(struct regs_t *regs) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    int old_fd_sys = process->file_handles[old_fd];
-    int new_fd_sys = process->file_handles[new_fd];
+    int old_fd_sys = task_fd_get(process, old_fd);
+    int new_fd_sys = task_fd_get(process, new_fd);
     spinlock_release(&process->file_handles_lock);
 
     if (old_fd_sys == -1) {
@@ -1115,6 +1226,12 @@ int syscall_dup2(struct regs_t *regs) {
     new_fd_sys = dup(old_fd_sys);
 
     spinlock_acquire(&process->file_handles_lock);
+    if (new_fd < 0 || task_fd_reserve(process, (size_t)new_fd + 1)) {
+        spinlock_release(&process->file_handles_lock);
+        close(new_fd_sys);
+        errno = EBADF;
+        return -1;
+    }
     process->file_handles[new_fd] = new_fd_sys;
     spinlock_release(&process->file_handles_lock);
 
@@ -1133,7 +1250,7 @@ int syscall_close(struct regs_t *regs) {
         return -1;
     }
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -1165,7 +1282,7 @@ int syscall_lseek(struct regs_t *regs) {
         return -1;
     }
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -1191,7 +1308,7 @@ int syscall_fstat(struct regs_t *regs) {
     spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -1218,8 +1335,14 @@ int syscall_read(struct regs_t *regs) {
         return -1;
     }
 
+    /* Filesystems copy from and to the buffer with their locks held */
+    if (vmm_prefault(process->pagemap, regs->rsi, regs->rdx, 1)) {
+        errno = EFAULT;
+        return -1;
+    }
+
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -1256,8 +1379,14 @@ int syscall_write(struct regs_t *regs) {
         return -1;
     }
 
+    /* Filesystems copy from and to the buffer with their locks held */
+    if (vmm_prefault(process->pagemap, regs->rsi, regs->rdx, 0)) {
+        errno = EFAULT;
+        return -1;
+    }
+
     spinlock_acquire(&process->file_handles_lock);
-    if (process->file_handles[regs->rdi] == -1) {
+    if (task_fd_get(process, regs->rdi) == -1) {
         spinlock_release(&process->file_handles_lock);
         errno = EBADF;
         return -1;
@@ -2,7 +2,6 @@ global task_spinup
 global force_resched
 
 extern scheduler_lock
-extern resched_lock
 
 extern task_resched
 
@@ -31,6 +30,12 @@ task_spinup:
 
     mov rsp, rdi
 
+    ; off the stack of the previous thread, it is free to run elsewhere
+    test rdx, rdx
+    jz .no_prev
+    mov dword [rdx], 0
+  .no_prev:
+
     pop r15
     pop r14
     pop r13
@@ -50,10 +55,6 @@ task_spinup:
     mov ds, ax
     mov es, ax
 
-    ; release relevant locks
-    lock inc qword [scheduler_lock]
-    lock inc qword [resched_lock]
-
     pop rax
 
     iretq
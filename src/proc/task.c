@@ -23,14 +23,27 @@
 
 static int scheduler_ready = 0;
 
-void task_spinup(void *, size_t);
+void task_spinup(void *, size_t, int *);
 
 lock_t scheduler_lock = new_lock_acquired;
-lock_t resched_lock = new_lock;
 
-struct process_t **process_table;
+/* The process and task tables live in a virtual area right below the thread
+ * area, and are backed by zeroed pages as they grow. They never move, so
+ * entries can be read without worrying about the table being resized. */
+#define PROCESS_TABLE_BASE ((size_t)0xfffffffe00000000)
+#define TASK_TABLE_BASE (PROCESS_TABLE_BASE + MAX_PROCESSES * sizeof(struct process_t *))
 
-struct thread_t **task_table;
+/* Initial size of the per-process thread and file handle tables */
+#define PROCESS_THREADS_MIN 4
+#define PROCESS_FILE_HANDLES_MIN 16
+
+struct process_t **process_table = (struct process_t **)PROCESS_TABLE_BASE;
+static size_t process_table_mapped = 0;
+static struct id_pool_t pid_pool = { .limit = MAX_PROCESSES };
+
+struct thread_t **task_table = (struct thread_t **)TASK_TABLE_BASE;
+static size_t task_table_mapped = 0;
+static struct id_pool_t task_id_pool = { .limit = MAX_TASKS };
 int64_t task_count = 0;
 
 /* These represent the default new-thread register contexts for kernel space and
@@ -40,31 +53,255 @@ static struct regs_t default_usr_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x23,0x
 
 static uint8_t* default_fxstate;
 
+/* Returns -1 if the pool is exhausted or out of memory */
+static int64_t id_alloc(struct id_pool_t *pool) {
+    if (pool->free_count) {
+        int64_t id = pool->free[pool->free_head];
+        pool->free_head = (pool->free_head + 1) % pool->free_cap;
+        pool->free_count--;
+        return id;
+    }
+
+    if (pool->top == pool->limit)
+        return -1;
+
+    if (pool->top == pool->free_cap) {
+        /* The FIFO is empty, so there is nothing to carry over */
+        size_t new_cap = pool->free_cap ? pool->free_cap * 2 : 16;
+        int32_t *free = kalloc_tagged(new_cap * sizeof(int32_t), MEM_TAG_PROC);
+        if (!free)
+            return -1;
+        kfree(pool->free);
+        pool->free = free;
+        pool->free_cap = new_cap;
+        pool->free_head = 0;
+    }
+
+    return pool->top++;
+}
+
+static void id_release(struct id_pool_t *pool, int64_t id) {
+    pool->free[(pool->free_head + pool->free_count) % pool->free_cap] = id;
+    pool->free_count++;
+}
+
+/* Back a table of limit pointers in its virtual area up to and including
+ * entry, and the entry after it, which marks the end of the table */
+/* Returns -1 on failure */
+static int table_reserve(void *table, size_t *mapped, size_t entry, size_t limit) {
+    size_t needed = (entry + 2) * sizeof(void *);
+    if (needed > limit * sizeof(void *))
+        needed = limit * sizeof(void *);
+
+    while (*mapped < needed) {
+        void *page = pmm_allocz_tagged(1, MEM_TAG_PROC);
+        if (!page)
+            return -1;
+        if (map_page(kernel_pagemap, (size_t)page, (size_t)table + *mapped, 0x03)) {
+            pmm_free(page, 1);
+            return -1;
+        }
+        *mapped += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/* Get a free PID, with room for it in the process table. scheduler_lock
+ * must be held. */
+/* Returns -1 on failure */
+static pid_t pid_alloc(void) {
+    int64_t pid = id_alloc(&pid_pool);
+    if (pid == -1)
+        return -1;
+
+    if (table_reserve(process_table, &process_table_mapped, pid, MAX_PROCESSES)) {
+        id_release(&pid_pool, pid);
+        return -1;
+    }
+
+    return pid;
+}
+
+/* Get a free global task ID, with room for it in the task table.
+ * scheduler_lock must be held. */
+/* Returns -1 on failure */
+tid_t task_id_alloc(void) {
+    int64_t task_id = id_alloc(&task_id_pool);
+    if (task_id == -1)
+        return -1;
+
+    if (table_reserve(task_table, &task_table_mapped, task_id, MAX_TASKS)) {
+        id_release(&task_id_pool, task_id);
+        return -1;
+    }
+
+    return task_id;
+}
+
+/* Get a free TID in process, growing its thread table if needed.
+ * scheduler_lock must be held. */
+/* Returns -1 on failure */
+tid_t task_tid_alloc(struct process_t *process) {
+    int64_t tid = id_alloc(&process->tids);
+    if (tid == -1)
+        return -1;
+
+    /* New TIDs come in order, so the table only ever has to double */
+    if ((size_t)tid == process->thread_cap) {
+        size_t new_cap = process->thread_cap * 2;
+        struct thread_t **threads = krealloc(process->threads,
+                                             new_cap * sizeof(struct thread_t *));
+        if (!threads) {
+            id_release(&process->tids, tid);
+            return -1;
+        }
+        process->threads = threads;
+        process->thread_cap = new_cap;
+    }
+
+    return tid;
+}
+
+/* Give back the IDs of a thread that failed to be created or was killed.
+ * scheduler_lock must be held. */
+static void task_release_ids(pid_t pid, tid_t tid, tid_t task_id) {
+    struct process_t *process = process_table[pid];
+
+    process->threads[tid] = EMPTY;
+    id_release(&process->tids, tid);
+    task_table[task_id] = EMPTY;
+    id_release(&task_id_pool, task_id);
+}
+
+/* Free a process structure along with its tables, once it is dead and has
+ * been waited for, and release its PID. scheduler_lock must be held. */
+void task_preap(pid_t pid) {
+    struct process_t *process = process_table[pid];
+
+    kfree(process->threads);
+    kfree(process->tids.free);
+    kfree(process);
+
+    process_table[pid] = EMPTY;
+    id_release(&pid_pool, pid);
+}
+
+/* Undo task_pcreate() for a process that never got to run, closing whatever
+ * file handles it was given. scheduler_lock must be held. */
+void task_pdiscard(pid_t pid) {
+    struct process_t *process = process_table[pid];
+
+    for (size_t i = 0; i < process->file_handles_cap; i++) {
+        if (process->file_handles[i] != -1)
+            close(process->file_handles[i]);
+    }
+    kfree(process->file_handles);
+    free_address_space(process->pagemap);
+
+    task_preap(pid);
+}
+
+/* Give back a task ID that never got a thread. scheduler_lock must be held. */
+void task_id_release(tid_t task_id) {
+    id_release(&task_id_pool, task_id);
+}
+
+/* Make room for at least count file handles in process, the new ones being
+ * unused. file_handles_lock must be held. */
+/* Returns -1 on failure */
+int task_fd_reserve(struct process_t *process, size_t count) {
+    if (count <= process->file_handles_cap)
+        return 0;
+    if (count > MAX_FILE_HANDLES)
+        return -1;
+
+    size_t new_cap = process->file_handles_cap ? process->file_handles_cap
+                                               : PROCESS_FILE_HANDLES_MIN;
+    while (new_cap < count)
+        new_cap *= 2;
+    if (new_cap > MAX_FILE_HANDLES)
+        new_cap = MAX_FILE_HANDLES;
+
+    int *file_handles = kalloc_tagged(new_cap * sizeof(int), MEM_TAG_PROC);
+    if (!file_handles)
+        return -1;
+
+    for (size_t i = 0; i < new_cap; i++) {
+        if (i < process->file_handles_cap)
+            file_handles[i] = process->file_handles[i];
+        else
+            file_handles[i] = -1;
+    }
+
+    kfree(process->file_handles);
+    process->file_handles = file_handles;
+    process->file_handles_cap = new_cap;
+
+    return 0;
+}
+
+/* Return the VFS descriptor behind a file handle of process, -1 if it is not
+ * open. file_handles_lock must be held. */
+int task_fd_get(struct process_t *process, int fd) {
+    if (fd < 0 || (size_t)fd >= process->file_handles_cap)
+        return -1;
+    return process->file_handles[fd];
+}
+
+/* Find the lowest unused file handle of process, starting at lowest, growing
+ * the file handle table if needed. file_handles_lock must be held. */
+/* Returns -1 if there is none */
+int task_fd_alloc(struct process_t *process, int lowest) {
+    if (lowest < 0)
+        return -1;
+
+    for (size_t fd = lowest; fd < MAX_FILE_HANDLES; fd++) {
+        if (fd >= process->file_handles_cap && task_fd_reserve(process, fd + 1))
+            return -1;
+        if (process->file_handles[fd] == -1)
+            return fd;
+    }
+
+    return -1;
+}
+
+/* Set up the thread table of a new process */
+/* Returns -1 on failure */
+static int process_init_threads(struct process_t *process) {
+    process->threads = kalloc_tagged(PROCESS_THREADS_MIN * sizeof(struct thread_t *),
+                                     MEM_TAG_PROC);
+    if (!process->threads)
+        return -1;
+
+    process->thread_cap = PROCESS_THREADS_MIN;
+    process->tids.limit = MAX_THREADS;
+    return 0;
+}
+
 void init_sched(void) {
-    default_fxstate = kalloc(cpu_simd_region_size);
+    default_fxstate = kalloc_tagged(cpu_simd_region_size, MEM_TAG_PROC);
 
     cpu_save_simd(default_fxstate);
 
     kprint(KPRN_INFO, "sched: Initialising process table...");
 
-    /* Make room for task table */
-    if ((task_table = kalloc(MAX_TASKS * sizeof(struct thread_t *))) == 0) {
-        panic(NULL, 1, "sched: Unable to allocate task table.");
-    }
-    if ((process_table = kalloc(MAX_PROCESSES * sizeof(struct process_t *))) == 0) {
-        panic(NULL, 1, "sched: Unable to allocate process table.");
-    }
     /* Now make space for PID 0 */
     kprint(KPRN_INFO, "sched: Creating PID 0");
-    if ((process_table[0] = kalloc(sizeof(struct process_t))) == 0) {
+    if (pid_alloc() != 0) {
+        panic(NULL, 1, "sched: Unable to allocate process table.");
+    }
+    if ((process_table[0] = kalloc_tagged(sizeof(struct process_t), MEM_TAG_PROC)) == 0) {
         panic(NULL, 1, "sched: Unable to allocate space for kernel task");
     }
-    if ((process_table[0]->threads = kalloc(MAX_THREADS * sizeof(struct thread_t *))) == 0) {
+    if (process_init_threads(process_table[0])) {
         panic(NULL, 1, "sched: Unable to allocate space for kernel threads.");
     }
     process_table[0]->pagemap = kernel_pagemap;
     process_table[0]->pid = 0;
 
+    init_run_queues();
+
     kprint(KPRN_INFO, "sched: Init done.");
 
     scheduler_ready = 1;
@@ -78,6 +315,7 @@ void yield(void) {
 void relaxed_sleep(uint64_t ms) {
     spinlock_acquire(&scheduler_lock);
 
+    time_update();
     uint64_t yield_target = (uptime_raw + (ms * (PIT_FREQUENCY_HZ / 1000))) + 1;
 
     tid_t current_task = cpu_locals[current_cpu].current_task;
@@ -150,7 +388,7 @@ int kill(pid_t pid, int signal) {
     // We need our new thread to have a valid thread local FS base.
     size_t fs_base;
     spinlock_acquire(&scheduler_lock);
-    for (size_t i = 0; i < MAX_THREADS; i++) {
+    for (size_t i = 0; i < process->thread_cap; i++) {
         if (process->threads[i] == (void *)(-1) || !process->threads[i])
             continue;
         fs_base = process->threads[i]->fs_base;
@@ -166,124 +404,53 @@ int kill(pid_t pid, int signal) {
     return 0;
 }
 
-/* Search for a new task to run */
-static inline tid_t task_get_next(tid_t current_task) {
-    if (current_task != -1) {
-        current_task++;
-    } else {
-        current_task = 0;
-    }
-
-    for (int64_t i = 0; i < task_count; ) {
-        struct thread_t *thread = task_table[current_task];
-        if (!thread) {
-            /* End of task table, rewind */
-            current_task = 0;
-            thread = task_table[current_task];
-        }
-        if (thread == (void *)(-1) || thread == (void *)(-2)) {
-            /* This is an empty thread, skip */
-            goto skip;
-        }
-        if (thread->yield_target > uptime_raw) {
-            goto next;
-        }
-        if (!spinlock_test_and_acquire(&thread->lock)) {
-            /* If unable to acquire the thread's lock, skip */
-            goto next;
-        }
-        if (locked_read(int, &thread->paused)) {
-            spinlock_release(&thread->lock);
-            goto next;
-        }
-        if (thread->event_ptr) {
-            if(!thread->event_abrt) {
-                int wake = 0;
-                for(int i = 0; i < (thread->event_num); i++) {
-                    if(locked_read(event_t, thread->event_ptr[i])) {
-                        wake = 1;
-                        locked_dec(thread->event_ptr[i]);
-                        thread->out_event_ptr[i] = 1;
-                    }
-                }
-
-                //only trigger timeout if no other events happened
-                if(thread->event_timeout <= uptime_raw && (thread->event_timeout != 0) && !wake) {
-                    thread->event_ptr = 0;
-                    thread->event_timeout = 0;
-                    wake = 1;
-                }
-
-                if(wake) {
-                    thread->event_ptr = 0;
-                } else {
-                    spinlock_release(&thread->lock);
-                    goto next;
-                }
-            }
-        }
-        return current_task;
-        next:
-        i++;
-        skip:
-        if (++current_task == MAX_TASKS)
-            current_task = 0;
-    }
-
-    return -1;
-}
-
-__attribute__((noinline)) static void _idle(void) {
+__attribute__((noinline)) static void _idle(struct thread_t *prev) {
     int _current_cpu = current_cpu;
     cpu_locals[_current_cpu].current_task = -1;
     cpu_locals[_current_cpu].current_thread = -1;
     cpu_locals[_current_cpu].current_process = -1;
-    spinlock_release(&scheduler_lock);
-    spinlock_release(&resched_lock);
-    asm volatile (
-        "sti;"
-        "1: "
-        "hlt;"
-        "jmp 1b;"
-    );
+    /* Off the stack of the thread switched away from */
+    if (prev)
+        locked_write(int, &prev->on_cpu, 0);
+    for (;;) {
+        /* Put idle time to use by zeroing pages ahead for pmm_allocz(),
+         * letting interrupts in between pages */
+        if (pmm_zero_pool_fill())
+            asm volatile ("sti; nop; cli;" ::: "memory");
+        else
+            asm volatile ("sti; hlt; cli;" ::: "memory");
+    }
 }
 
-__attribute__((noinline)) static void idle(void) {
+__attribute__((noinline)) static void idle(struct thread_t *prev) {
     /* This idle function swaps cr3 and rsp then calls _idle for technical reasons */
     asm volatile (
-        "mov rbx, cr3;"
-        "cmp rax, rbx;"
-        "je 1f;"
+        "test rax, rax;"
+        "jz 1f;"
         "mov cr3, rax;"
         "1: "
         "mov rsp, qword ptr gs:[8];"
         "jmp _idle;"
         :
-        : "a" ((size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET)
+        : "a" (vmm_activate(kernel_pagemap)), "D" (prev)
     );
     /* Dead call so GCC doesn't garbage collect _idle */
-    _idle();
+    _idle(prev);
 }
 
 void task_resched(struct regs_t *regs) {
-    spinlock_acquire(&resched_lock);
-
-    if (!spinlock_test_and_acquire(&scheduler_lock)) {
-        spinlock_release(&resched_lock);
-        return;
-    }
-
     int _current_cpu = current_cpu;
 
     pid_t current_task = cpu_locals[_current_cpu].current_task;
     pid_t current_process = cpu_locals[_current_cpu].current_process;
-    pid_t last_task = current_task;
+    struct thread_t *prev = NULL;
 
     if (current_task != -1) {
         struct thread_t *current_thread = task_table[current_task];
         /* Bug fix. TODO: find a better solution for this */
         if (current_thread == (void *)-1)
             goto skip_invalid_thread_context_save;
+        prev = current_thread;
         /* Save current context */
         current_thread->active_on_cpu = -1;
         current_thread->ctx.regs = *regs;
@@ -295,23 +462,24 @@ void task_resched(struct regs_t *regs) {
             /* Save errno */
             current_thread->thread_errno = cpu_locals[current_cpu].thread_errno;
         }
-        /* Release lock on this thread */
-        spinlock_release(&current_thread->lock);
     }
 skip_invalid_thread_context_save:
 
+    time_update();
     cpu_locals[_current_cpu].last_schedule_time = uptime_raw;
 
     /* Get to the next task */
-    current_task = task_get_next(current_task);
-    /* If there's nothing to do, idle */
-    if (current_task == -1)
-        idle();
+    struct thread_t *thread = sched_switch(prev);
+    /* If there's nothing to do, idle, with no timer but for the next
+     * deadline */
+    if (!thread) {
+        sched_tick_stop();
+        idle(prev);
+    }
 
     struct cpu_local_t *cpu_local = &cpu_locals[_current_cpu];
-    struct thread_t *thread = task_table[current_task];
 
-    cpu_local->current_task = current_task;
+    cpu_local->current_task = thread->task_id;
     cpu_local->current_thread = thread->tid;
     cpu_local->current_process = thread->process;
 
@@ -327,37 +495,67 @@ skip_invalid_thread_context_save:
 
     thread->active_on_cpu = _current_cpu;
 
+    /* The CPU leaves the stack of prev in task_spinup(), unless it keeps
+     * running the same thread */
+    int *prev_on_cpu = prev && prev != thread ? &prev->on_cpu : NULL;
+
+    /* Preemption is local, the CPU's own timer ends the timeslice */
+    sched_tick_restart();
+    lapic_timer_oneshot(SCHED_TIMESLICE_MS);
+
     /* Swap cr3, if necessary */
-    if (task_table[last_task]->process != thread->process) {
+    size_t cr3 = vmm_activate(process_table[thread->process]->pagemap);
+    if (cr3) {
         /* Switch cr3 and return to the thread */
-        task_spinup(&thread->ctx.regs, (size_t)process_table[thread->process]->pagemap->pml4 - MEM_PHYS_OFFSET);
+        task_spinup(&thread->ctx.regs, cr3, prev_on_cpu);
     } else {
         /* Don't switch cr3 and return to the thread */
-        task_spinup(&thread->ctx.regs, 0);
+        task_spinup(&thread->ctx.regs, 0, prev_on_cpu);
     }
 }
 
-static int pit_ticks = 0;
+/* Reschedule from an interrupt. A thread is not preempted while anyone
+ * holds scheduler_lock, unless it is being killed, but an idle CPU always
+ * picks up new work. */
+static void task_resched_irq(struct regs_t *regs) {
+    tid_t current_task = cpu_locals[current_cpu].current_task;
 
-void task_resched_bsp(struct regs_t *regs) {
-    if (scheduler_ready) {
-        if (++pit_ticks == SCHED_TIMESLICE_MS) {
-            pit_ticks = 0;
-        } else {
+    sched_balance();
+
+    if (current_task != -1 && !locked_read(int, &scheduler_lock.lock)) {
+        struct thread_t *thread = task_table[current_task];
+        if (thread == (void *)-1 || !locked_read(int, &thread->kill_pending))
             return;
-        }
+    }
 
-        for (int i = 1; i < smp_cpu_count; i++)
-            lapic_send_ipi(i, IPI_RESCHED);
+    task_resched(regs);
+}
 
-        /* Call task_scheduler on the BSP */
-        task_resched(regs);
-    }
+/* PIT tick on the BSP, timeslices are up to the local APIC timers. The
+ * PIT is stopped while the BSP idles, see sched_tick_stop() */
+void task_resched_bsp(struct regs_t *regs) {
+    (void)regs;
+
+    if (scheduler_ready)
+        sched_wake_sleepers();
+}
+
+/* End of a timeslice, or a deadline for the idle BSP, from the local APIC
+ * timer of the CPU */
+void task_resched_timer(struct regs_t *regs) {
+    /* With the PIT stopped, this is what keeps time and wakes sleepers */
+    time_update();
+    sched_wake_sleepers();
+
+    task_resched_irq(regs);
+
+    /* Preemption got deferred, try again a timeslice later */
+    lapic_timer_oneshot(SCHED_TIMESLICE_MS);
 }
 
 void task_resched_ap(struct regs_t *regs) {
     locked_write(int, &cpu_locals[current_cpu].ipi_resched_received, 1);
-    task_resched(regs);
+    task_resched_irq(regs);
 }
 
 #define BASE_BRK_LOCATION ((size_t)0x0000780000000000)
@@ -367,49 +565,26 @@ void task_resched_ap(struct regs_t *regs) {
 pid_t task_pcreate(void) {
     spinlock_acquire(&scheduler_lock);
 
-    /* Search for free process ID */
-    pid_t new_pid;
-    for (new_pid = 0; new_pid < MAX_PROCESSES - 1; new_pid++) {
-        if (!process_table[new_pid] || process_table[new_pid] == (void *)(-1))
-            goto found_new_pid;
+    pid_t new_pid = pid_alloc();
+    if (new_pid == -1) {
+        spinlock_release(&scheduler_lock);
+        return -1;
     }
-    spinlock_release(&scheduler_lock);
-    return -1;
 
-found_new_pid:
     process_table[new_pid] = (void *)(-2); // placeholder
     spinlock_release(&scheduler_lock);
 
     /* Try to make space for this new task */
-    struct process_t *new_process = kalloc(sizeof(struct process_t));
-    if (!new_process) {
-        spinlock_acquire(&scheduler_lock);
-        process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
+    struct process_t *new_process = kalloc_tagged(sizeof(struct process_t), MEM_TAG_PROC);
+    if (!new_process)
+        goto fail;
 
-    if ((new_process->threads = kalloc(MAX_THREADS * sizeof(struct thread_t *))) == 0) {
-        kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
-        process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
-
-    if ((new_process->file_handles = kalloc(MAX_FILE_HANDLES * sizeof(int))) == 0) {
-        kfree(new_process->threads);
-        kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
-        process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
+    if (process_init_threads(new_process))
+        goto fail_process;
 
     /* Initially, mark all file handles as unused */
-    for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
-        new_process->file_handles[i] = -1;
-    }
+    if (task_fd_reserve(new_process, PROCESS_FILE_HANDLES_MIN))
+        goto fail_threads;
 
     /* Make all signal handlers SIG_DFL */
     for (size_t i = 0; i < SIGNAL_MAX; i++)
@@ -431,15 +606,8 @@ found_new_pid:
 
     /* Create a new pagemap for the process */
     new_process->pagemap = new_address_space();
-    if (!new_process->pagemap) {
-        kfree(new_process->file_handles);
-        kfree(new_process->threads);
-        kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
-        process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
+    if (!new_process->pagemap)
+        goto fail_file_handles;
 
     new_process->pid = new_pid;
 
@@ -448,10 +616,25 @@ found_new_pid:
     process_table[new_pid] = new_process;
     spinlock_release(&scheduler_lock);
     return new_pid;
+
+fail_file_handles:
+    kfree(new_process->file_handles);
+fail_threads:
+    kfree(new_process->threads);
+fail_process:
+    kfree(new_process);
+fail:
+    spinlock_acquire(&scheduler_lock);
+    process_table[new_pid] = EMPTY;
+    id_release(&pid_pool, new_pid);
+    spinlock_release(&scheduler_lock);
+    return -1;
 }
 
 void abort_thread_exec(size_t scheduler_not_locked) {
-    write_cr("3", (size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET);
+    size_t cr3 = vmm_activate(kernel_pagemap);
+    if (cr3)
+        write_cr("3", cr3);
 
     int _current_cpu = current_cpu;
 
@@ -478,7 +661,8 @@ void abort_thread_exec(size_t scheduler_not_locked) {
 int task_tpause(pid_t pid, tid_t tid) {
     spinlock_acquire(&scheduler_lock);
 
-    if (!process_table[pid]->threads[tid]
+    if ((size_t)tid >= process_table[pid]->thread_cap
+        || !process_table[pid]->threads[tid]
         || process_table[pid]->threads[tid] == (void *)(-1)
         || process_table[pid]->threads[tid] == (void *)(-2)) {
         spinlock_release(&scheduler_lock);
@@ -489,8 +673,10 @@ int task_tpause(pid_t pid, tid_t tid) {
     int active_on_cpu = thread->active_on_cpu;
 
     locked_write(int, &thread->event_abrt, 1);
+    sched_abort_wait(thread);
 
-    while (locked_read(int, &thread->in_syscall)) {
+    while (locked_read(int, &thread->in_syscall)
+        || locked_read(int, &thread->in_fault)) {
         force_resched();
         spinlock_acquire(&scheduler_lock);
     }
@@ -513,15 +699,19 @@ int task_tpause(pid_t pid, tid_t tid) {
 int task_tresume(pid_t pid, tid_t tid) {
     spinlock_acquire(&scheduler_lock);
 
-    if (!process_table[pid]->threads[tid]
+    if ((size_t)tid >= process_table[pid]->thread_cap
+        || !process_table[pid]->threads[tid]
         || process_table[pid]->threads[tid] == (void *)(-1)
         || process_table[pid]->threads[tid] == (void *)(-2)) {
         spinlock_release(&scheduler_lock);
         return -1;
     }
 
-    locked_write(int, &process_table[pid]->threads[tid]->event_abrt, 0);
-    locked_write(int, &process_table[pid]->threads[tid]->paused, 0);
+    struct thread_t *thread = process_table[pid]->threads[tid];
+
+    locked_write(int, &thread->event_abrt, 0);
+    locked_write(int, &thread->paused, 0);
+    sched_resume(thread);
 
     spinlock_release(&scheduler_lock);
 
@@ -533,7 +723,8 @@ int task_tresume(pid_t pid, tid_t tid) {
 int task_tkill(pid_t pid, tid_t tid) {
     spinlock_acquire(&scheduler_lock);
 
-    if (!process_table[pid]->threads[tid]
+    if ((size_t)tid >= process_table[pid]->thread_cap
+        || !process_table[pid]->threads[tid]
         || process_table[pid]->threads[tid] == (void *)(-1)
         || process_table[pid]->threads[tid] == (void *)(-2)) {
         spinlock_release(&scheduler_lock);
@@ -541,44 +732,40 @@ int task_tkill(pid_t pid, tid_t tid) {
     }
 
     struct thread_t *thread = process_table[pid]->threads[tid];
-    int active_on_cpu = thread->active_on_cpu;
 
     locked_write(int, &thread->event_abrt, 1);
+    sched_abort_wait(thread);
 
-    while (locked_read(int, &thread->in_syscall)) {
+    while (locked_read(int, &thread->in_syscall)
+        || locked_read(int, &thread->in_fault)) {
         force_resched();
         spinlock_acquire(&scheduler_lock);
     }
 
-    if (active_on_cpu != -1 && active_on_cpu != current_cpu) {
-        /* Send abort execution IPI */
-        locked_write(int, &cpu_locals[active_on_cpu].ipi_abortexec_received, 0);
-        lapic_send_ipi(active_on_cpu, IPI_ABORTEXEC);
-        while (!locked_read(int, &cpu_locals[active_on_cpu].ipi_abortexec_received));
-    }
-
-    task_table[process_table[pid]->threads[tid]->task_id] = (void *)(-1);
-
-    void *kstack = (void *)(process_table[pid]->threads[tid]->kstack - STACK_SIZE);
+    /* Only the current thread can be running on this CPU */
+    int active_on_cpu = locked_read(int, &thread->active_on_cpu);
 
-    kfree(process_table[pid]->threads[tid]);
+    /* Get it off the run queues and off any other CPU */
+    if (active_on_cpu != current_cpu)
+        sched_kill(thread);
 
-    process_table[pid]->threads[tid] = (void *)(-1);
+    task_release_ids(pid, tid, thread->task_id);
 
     task_count--;
 
     if (active_on_cpu == current_cpu) {
+        /* Get off the thread's stack before giving it back */
         asm volatile (
             "mov rsp, qword ptr gs:[8];"
-            "call kfree;"
+            "call thread_free;"
             "cli;"
             "mov rdi, 0;"
             "call abort_thread_exec;"
             :
-            : "D" (kstack)
+            : "D" (thread)
         );
     } else {
-        kfree(kstack);
+        thread_free(thread);
     }
 
     spinlock_release(&scheduler_lock);
@@ -586,56 +773,57 @@ int task_tkill(pid_t pid, tid_t tid) {
     return 0;
 }
 
+/* Map a thread's user stack, dropping whatever a previous thread with the
+ * same TID left there. The guard page below it stays out of any VMA. */
+/* Returns 0 on success, -1 on failure, in which case nothing is left mapped
+ * and the frames at stack_pm still belong to the caller */
+static int map_user_stack(struct pagemap_t *pagemap, char *stack_pm, size_t stack_bottom) {
+    if (vmm_map_region(pagemap, stack_bottom, STACK_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0))
+        return -1;
+
+    /* A failed map_range() has already unmapped the frames, dropping the
+     * VMA cannot release them */
+    if (map_range(pagemap, (size_t)stack_pm, stack_bottom, STACK_SIZE, 0x07)) {
+        vmm_munmap(pagemap, (void *)stack_bottom, STACK_SIZE);
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Create thread from function pointer */
 /* Returns thread ID, -1 on failure */
 tid_t task_tcreate(pid_t pid, enum tcreate_abi abi, const void *opaque_data) {
     spinlock_acquire(&scheduler_lock);
 
-    /* Search for free thread ID in the process */
-    tid_t new_tid;
-    for (new_tid = 0; new_tid < MAX_THREADS; new_tid++) {
-        if (!process_table[pid]->threads[new_tid] || process_table[pid]->threads[new_tid] == (void *)(-1))
-            goto found_new_tid;
+    tid_t new_tid = task_tid_alloc(process_table[pid]);
+    if (new_tid == -1) {
+        spinlock_release(&scheduler_lock);
+        return -1;
     }
-    spinlock_release(&scheduler_lock);
-    return -1;
-found_new_tid:;
     process_table[pid]->threads[new_tid] = (void *)(-2); // placeholder
 
-    /* Search for free global task ID */
-    tid_t new_task_id;
-    for (new_task_id = 0; new_task_id < MAX_TASKS; new_task_id++) {
-        if (!task_table[new_task_id] || task_table[new_task_id] == (void *)(-1))
-            goto found_new_task_id;
+    tid_t new_task_id = task_id_alloc();
+    if (new_task_id == -1) {
+        process_table[pid]->threads[new_tid] = EMPTY;
+        id_release(&process_table[pid]->tids, new_tid);
+        spinlock_release(&scheduler_lock);
+        return -1;
     }
-    process_table[pid]->threads[new_tid] = EMPTY;
-    spinlock_release(&scheduler_lock);
-    return -1;
-found_new_task_id:;
     task_table[new_task_id] = (void *)(-2); // placeholder
 
     spinlock_release(&scheduler_lock);
 
-    /* Try to make space for this new thread */
+    /* Get a thread, with its kernel stack and SIMD area, from the pool */
     struct thread_t *new_thread;
-    if (!(new_thread = kalloc(sizeof(struct thread_t)))) {
+    if (!(new_thread = thread_alloc())) {
         spinlock_acquire(&scheduler_lock);
-        process_table[pid]->threads[new_tid] = EMPTY;
-        task_table[new_task_id] = EMPTY;
+        task_release_ids(pid, new_tid, new_task_id);
         spinlock_release(&scheduler_lock);
         return -1;
     }
 
-    /* Set up a kernel stack for the thread */
-    new_thread->kstack = (size_t)kalloc(STACK_SIZE) + STACK_SIZE;
-    if (new_thread->kstack == STACK_SIZE) {
-        kfree(new_thread);
-        spinlock_acquire(&scheduler_lock);
-        process_table[pid]->threads[new_tid] = EMPTY;
-        task_table[new_task_id] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
     new_thread->kstack -= sizeof(uint64_t);
     *((size_t *)new_thread->kstack) = 0;
 
@@ -647,8 +835,6 @@ found_new_task_id:;
     else
         new_thread->ctx.regs = default_krnl_regs;
 
-    new_thread->ctx.fxstate = kalloc(cpu_simd_region_size);
-
     /* Set up a user stack for the thread */
     if (pid) {
         /* Virtual addresses of the stack. */
@@ -657,13 +843,11 @@ found_new_task_id:;
         size_t stack_bottom = stack_guardpage + PAGE_SIZE;
 
         /* Allocate physical memory for the stack and initialize it. */
-        char *stack_pm = pmm_allocz(STACK_SIZE / PAGE_SIZE);
+        char *stack_pm = pmm_allocz_tagged(STACK_SIZE / PAGE_SIZE, MEM_TAG_USER);
         if (!stack_pm) {
-            kfree((void *)(new_thread->kstack - STACK_SIZE));
-            kfree(new_thread);
+            thread_free(new_thread);
             spinlock_acquire(&scheduler_lock);
-            process_table[pid]->threads[new_tid] = EMPTY;
-            task_table[new_task_id] = EMPTY;
+            task_release_ids(pid, new_tid, new_task_id);
             spinlock_release(&scheduler_lock);
             return -1;
         }
@@ -731,15 +915,14 @@ found_new_task_id:;
         }
         panic_unless(!((size_t)sp & 0xF) && "Stack must be 16-byte aligned on x86_64");
 
-        /* Map the stack */
-        for (size_t i = 0; i < STACK_SIZE / PAGE_SIZE; i++) {
-            map_page(process_table[pid]->pagemap,
-                     (size_t)(stack_pm + (i * PAGE_SIZE)),
-                     (size_t)(stack_bottom + (i * PAGE_SIZE)),
-                     pid ? 0x07 : 0x03);
+        if (map_user_stack(process_table[pid]->pagemap, stack_pm, stack_bottom)) {
+            pmm_free(stack_pm, STACK_SIZE / PAGE_SIZE);
+            thread_free(new_thread);
+            spinlock_acquire(&scheduler_lock);
+            task_release_ids(pid, new_tid, new_task_id);
+            spinlock_release(&scheduler_lock);
+            return -1;
         }
-        /* Add a guard page */
-        unmap_page(process_table[pid]->pagemap, stack_guardpage);
         new_thread->ctx.regs.rsp = stack_bottom + STACK_SIZE - ((sbase - sp) * sizeof(size_t));
     } else {
         /* If it's a kernel thread, kstack is the main stack */
@@ -763,13 +946,13 @@ found_new_task_id:;
     new_thread->tid = new_tid;
     new_thread->task_id = new_task_id;
     new_thread->process = pid;
-    spinlock_release(&new_thread->lock);
 
     /* Actually "enable" the new thread */
     spinlock_acquire(&scheduler_lock);
     process_table[pid]->threads[new_tid] = new_thread;
     task_table[new_task_id] = new_thread;
     task_count++;
+    sched_add(new_thread);
     spinlock_release(&scheduler_lock);
     return new_tid;
 }
@@ -8,12 +8,17 @@
 #include <lib/time.h>
 #include <lib/types.h>
 #include <lib/signal.h>
+#include <sys/cpu.h>
 
+/* Limits of the process, task, per-process thread and file handle tables,
+ * which all start small and grow as they fill */
 #define MAX_PROCESSES 65536
 #define MAX_THREADS 1024
 #define MAX_TASKS (MAX_PROCESSES*16)
 #define MAX_FILE_HANDLES 256
 
+#define KSTACK_SIZE ((size_t)32768)
+
 #define CURRENT_PROCESS cpu_locals[current_cpu].current_process
 #define CURRENT_THREAD cpu_locals[current_cpu].current_thread
 #define CURRENT_TASK cpu_locals[current_cpu].current_task
@@ -46,12 +51,38 @@ struct ctx_t {
     uint8_t *fxstate;
 };
 
+/* Scheduling states of a thread */
+enum thread_state {
+    /* Not handed to the scheduler yet */
+    THREAD_NEW,
+    /* On the run queue of its CPU */
+    THREAD_READY,
+    THREAD_RUNNING,
+    /* Waiting for events or a deadline, off the run queues */
+    THREAD_BLOCKED,
+    /* Paused, off the run queues until resumed */
+    THREAD_STOPPED,
+    /* Killed, never runs again */
+    THREAD_DEAD
+};
+
+struct thread_t;
+
+/* Link of a thread waiting in events_await() to one of its events */
+struct event_waiter_t {
+    event_t *event;
+    struct thread_t *thread;
+    struct event_waiter_t *next;
+    struct event_waiter_t *prev;
+};
+
 struct thread_t {
     tid_t tid;
     tid_t task_id;
     pid_t process;
-    lock_t lock;
     int in_syscall;
+    /* Set while a page fault on a user address is being handled */
+    int in_fault;
     int last_syscall;
     int event_abrt;
     uint64_t yield_target;
@@ -66,6 +97,31 @@ struct thread_t {
     int *out_event_ptr;
     size_t event_timeout;
     int event_num;
+    /* One per event, on the stack of events_await() */
+    struct event_waiter_t *event_waiters;
+    /* Scheduling state, protected by the lock of the run queue of cpu */
+    int state;
+    /* CPU whose run queue the thread goes on */
+    int cpu;
+    /* Set while a CPU is still on the thread's stack, up to the point it
+     * has switched away from it */
+    int on_cpu;
+    int kill_pending;
+    /* When and where the thread last ran, for cache affinity */
+    uint64_t last_run;
+    int last_cpu;
+    struct thread_t *rq_next;
+    struct thread_t *rq_prev;
+    /* Protected by the wait lock: whether the thread is linked to its
+     * events, and its place in the heap of deadlines */
+    int events_linked;
+    int sleeping;
+    uint64_t wake_time;
+    struct thread_t *sleep_child;
+    struct thread_t *sleep_next;
+    struct thread_t *sleep_prev;
+    /* Link in the free list of threads, once killed */
+    struct thread_t *pool_next;
 };
 
 #define AT_ENTRY 10
@@ -85,16 +141,47 @@ struct child_event_t {
     int status;
 };
 
+/* Allocator of the IDs of a table. Released IDs wait in a FIFO and are
+ * reused oldest first, past that the next never used ID is taken. The FIFO
+ * always has room for every ID handed out, so releasing one cannot fail. */
+struct id_pool_t {
+    int32_t *free;
+    size_t free_cap;
+    size_t free_head;
+    size_t free_count;
+    /* IDs below top have been handed out at some point */
+    size_t top;
+    size_t limit;
+};
+
+/* Scheduler counters, see getschedstats() */
+struct schedstats {
+    size_t cpus;
+    /* Threads idle CPUs took from the run queues of others */
+    size_t steals;
+    /* Threads moved between CPUs, steals included */
+    size_t migrations;
+    size_t cpu_queued[MAX_CPUS];
+    size_t cpu_steals[MAX_CPUS];
+    size_t cpu_migrations[MAX_CPUS];
+};
+
 struct process_t {
     pid_t pid;
     pid_t ppid;
     pid_t pgid;
     uid_t uid;
     struct pagemap_t *pagemap;
+    /* Indexed by TID, thread_cap entries, protected by scheduler_lock */
     struct thread_t **threads;
+    size_t thread_cap;
+    struct id_pool_t tids;
     char cwd[2048];
     lock_t cwd_lock;
+    /* VFS descriptors indexed by file handle, -1 if unused, protected by
+     * file_handles_lock */
     int *file_handles;
+    size_t file_handles_cap;
     lock_t file_handles_lock;
     size_t cur_brk;
     lock_t cur_brk_lock;
@@ -119,6 +206,20 @@ extern struct process_t **process_table;
 extern struct thread_t **task_table;
 
 void init_sched(void);
+void init_run_queues(void);
+void sched_add(struct thread_t *);
+struct thread_t *sched_switch(struct thread_t *);
+void sched_balance(void);
+void getschedstats(struct schedstats *);
+void sched_wake_sleepers(void);
+void sched_tick_stop(void);
+void sched_tick_restart(void);
+void sched_abort_wait(struct thread_t *);
+void sched_resume(struct thread_t *);
+void sched_kill(struct thread_t *);
+void event_wake(event_t *);
+struct thread_t *thread_alloc(void);
+void thread_free(struct thread_t *);
 void yield(void);
 void relaxed_sleep(uint64_t);
 
@@ -147,6 +248,14 @@ struct tcreate_elf_exec_data {
 
 tid_t task_tcreate(pid_t, enum tcreate_abi, const void *);
 pid_t task_pcreate(void);
+void task_preap(pid_t);
+void task_pdiscard(pid_t);
+tid_t task_id_alloc(void);
+void task_id_release(tid_t);
+tid_t task_tid_alloc(struct process_t *);
+int task_fd_reserve(struct process_t *, size_t);
+int task_fd_get(struct process_t *, int);
+int task_fd_alloc(struct process_t *, int);
 int task_tkill(pid_t, tid_t);
 int task_tpause(pid_t, tid_t);
 int task_tresume(pid_t, tid_t);
@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <proc/task.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/cmem.h>
+#include <sys/cpu.h>
+
+/* Threads live in fixed slots of a virtual area right below the kernel
+ * image: the thread structure followed by its SIMD save area, an unmapped
+ * guard page, then the kernel stack. A slot is never unmapped once built.
+ * Freed threads go to a pool on the CPU that freed them and are handed out
+ * again whole, so creating and killing threads rarely reaches the PMM.
+ * Pools are refilled from and drained to a shared free list THREAD_POOL_BATCH
+ * threads at a time. */
+#define THREAD_AREA_BASE ((size_t)0xffffffff00000000)
+#define THREAD_AREA_SIZE ((size_t)0x40000000)
+#define THREAD_POOL_SIZE 16
+#define THREAD_POOL_BATCH 8
+
+/* xsave wants its save area 64-byte aligned */
+#define THREAD_SIMD_OFFSET ((sizeof(struct thread_t) + 63) & ~(size_t)63)
+
+struct thread_pool_t {
+    lock_t lock;
+    size_t count;
+    struct thread_t *threads[THREAD_POOL_SIZE];
+};
+
+static struct thread_pool_t thread_pools[MAX_CPUS];
+
+static lock_t thread_slots_lock = new_lock;
+static struct thread_t *free_threads = NULL;
+static size_t thread_slots_built = 0;
+
+/* Pages in front of the guard page, holding the thread and its SIMD area */
+static inline size_t thread_header_pages(void) {
+    return DIV_ROUNDUP(THREAD_SIMD_OFFSET + cpu_simd_region_size, PAGE_SIZE);
+}
+
+static inline size_t thread_slot_size(void) {
+    return (thread_header_pages() + 1) * PAGE_SIZE + KSTACK_SIZE;
+}
+
+/* Map a new slot and return the thread in it, thread_slots_lock must not be
+ * held. Returns NULL if out of memory or address space. */
+static struct thread_t *thread_slot_build(void) {
+    size_t slot_size = thread_slot_size();
+
+    spinlock_acquire(&thread_slots_lock);
+    if ((thread_slots_built + 1) * slot_size > THREAD_AREA_SIZE) {
+        spinlock_release(&thread_slots_lock);
+        return NULL;
+    }
+    size_t base = THREAD_AREA_BASE + thread_slots_built++ * slot_size;
+    spinlock_release(&thread_slots_lock);
+
+    size_t header_pages = thread_header_pages();
+    size_t stack_pages = KSTACK_SIZE / PAGE_SIZE;
+    size_t stack = base + (header_pages + 1) * PAGE_SIZE;
+
+    char *header_pm = pmm_alloc_tagged(header_pages, MEM_TAG_PROC);
+    if (!header_pm)
+        return NULL;
+    char *stack_pm = pmm_alloc_tagged(stack_pages, MEM_TAG_PROC);
+    if (!stack_pm) {
+        pmm_free(header_pm, header_pages);
+        return NULL;
+    }
+
+    if (map_range(kernel_pagemap, (size_t)header_pm, base, header_pages * PAGE_SIZE, 0x03))
+        goto fail;
+    if (map_range(kernel_pagemap, (size_t)stack_pm, stack, KSTACK_SIZE, 0x03)) {
+        unmap_range(kernel_pagemap, base, header_pages * PAGE_SIZE);
+        goto fail;
+    }
+
+    return (struct thread_t *)base;
+
+fail:
+    /* The slot itself is lost, its memory is not */
+    pmm_free(header_pm, header_pages);
+    pmm_free(stack_pm, stack_pages);
+    return NULL;
+}
+
+/* Move up to a batch of threads from the shared free list into pool, building
+ * a new slot if there are none */
+static void thread_pool_refill(struct thread_pool_t *pool) {
+    spinlock_acquire(&thread_slots_lock);
+    while (free_threads && pool->count < THREAD_POOL_BATCH) {
+        pool->threads[pool->count++] = free_threads;
+        free_threads = free_threads->pool_next;
+    }
+    spinlock_release(&thread_slots_lock);
+
+    if (!pool->count) {
+        struct thread_t *thread = thread_slot_build();
+        if (thread)
+            pool->threads[pool->count++] = thread;
+    }
+}
+
+/* Move a batch of threads from a full pool to the shared free list */
+static void thread_pool_drain(struct thread_pool_t *pool) {
+    spinlock_acquire(&thread_slots_lock);
+    while (pool->count > THREAD_POOL_SIZE - THREAD_POOL_BATCH) {
+        struct thread_t *thread = pool->threads[--pool->count];
+        thread->pool_next = free_threads;
+        free_threads = thread;
+    }
+    spinlock_release(&thread_slots_lock);
+}
+
+/* Get a zeroed thread with its SIMD save area and kernel stack set up, kstack
+ * is the top of the stack */
+/* Returns NULL on failure */
+struct thread_t *thread_alloc(void) {
+    struct thread_pool_t *pool = &thread_pools[current_cpu];
+
+    spinlock_acquire(&pool->lock);
+
+    if (!pool->count)
+        thread_pool_refill(pool);
+
+    struct thread_t *thread = NULL;
+    if (pool->count)
+        thread = pool->threads[--pool->count];
+
+    spinlock_release(&pool->lock);
+
+    if (!thread)
+        return NULL;
+
+    memset(thread, 0, sizeof(struct thread_t));
+    thread->ctx.fxstate = (uint8_t *)thread + THREAD_SIMD_OFFSET;
+    thread->kstack = (size_t)thread + thread_slot_size();
+
+    return thread;
+}
+
+/* Return a thread, along with its kernel stack, to the pool of the calling CPU */
+void thread_free(struct thread_t *thread) {
+    struct thread_pool_t *pool = &thread_pools[current_cpu];
+
+    spinlock_acquire(&pool->lock);
+
+    if (pool->count == THREAD_POOL_SIZE)
+        thread_pool_drain(pool);
+
+    pool->threads[pool->count++] = thread;
+
+    spinlock_release(&pool->lock);
+}
@@ -133,18 +133,20 @@ int exec(pid_t pid, const char *filename, const char *argv[], const char *envp[]
     }
 
     /* Destroy all previous threads */
-    for (size_t i = 0; i < MAX_THREADS; i++)
+    for (size_t i = 0; i < process->thread_cap; i++)
         task_tkill(pid, i);
 
     // Map the sig ret trampoline into process
-    void *trampoline_ptr = pmm_allocz(1);
+    void *trampoline_ptr = pmm_allocz_tagged(1, MEM_TAG_USER);
     memcpy(trampoline_ptr + MEM_PHYS_OFFSET,
             signal_trampoline,
             (size_t)signal_trampoline_size);
+    vmm_map_region(new_pagemap, SIGNAL_TRAMPOLINE_VADDR, PAGE_SIZE,
+                   PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0);
     map_page(new_pagemap,
              (size_t)trampoline_ptr,
              (size_t)(SIGNAL_TRAMPOLINE_VADDR),
-             0x05);
+             vmm_prot_to_flags(PROT_READ | PROT_EXEC));
 
     /* Free previous address space */
     free_address_space(old_pagemap);
@@ -5,9 +5,14 @@
 #include <acpi/madt.h>
 #include <mm/mm.h>
 #include <sys/cpu.h>
+#include <sys/pit.h>
+#include <lib/time.h>
 
 #define APIC_CPUID_BIT (1 << 9)
 
+/* How long the local APIC timer is measured against the PIT */
+#define LAPIC_TIMER_CALIBRATE_MS 10
+
 int apic_supported(void) {
     unsigned int eax, ebx, ecx, edx = 0;
 
@@ -66,8 +71,51 @@ void lapic_eoi(void) {
 }
 
 void lapic_send_ipi(int cpu, uint8_t vector) {
+    /* Interrupt handlers send IPIs too, keep them from getting in between
+     * the two writes */
+    size_t rflags = save_and_cli();
     lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[cpu].lapic_id) << 24);
     lapic_write(APICREG_ICR0, vector);
+    restore_if(rflags);
+}
+
+/* Measure the local APIC timer of the calling CPU against the PIT, which
+ * must be ticking on the BSP */
+void lapic_timer_calibrate(void) {
+    /* Divide by 16, masked until armed */
+    lapic_write(APICREG_TIMER_DIV, 0x3);
+    lapic_write(APICREG_LVT_TIMER, (1 << 16) | APIC_TIMER_VECTOR);
+
+    /* Start right on a tick */
+    uint64_t start = uptime_raw;
+    while (uptime_raw == start);
+
+    lapic_write(APICREG_TIMER_INIT, 0xffffffff);
+    start = uptime_raw;
+    while (uptime_raw - start < LAPIC_TIMER_CALIBRATE_MS * (PIT_FREQUENCY_HZ / 1000));
+    uint32_t elapsed = 0xffffffff - lapic_read(APICREG_TIMER_CUR);
+    lapic_write(APICREG_TIMER_INIT, 0);
+
+    uint32_t freq = elapsed / LAPIC_TIMER_CALIBRATE_MS;
+    cpu_locals[current_cpu].lapic_timer_freq = freq ? freq : 1;
+
+    kprint(KPRN_INFO, "apic: CPU #%u timer at %u ticks per ms", current_cpu, freq);
+}
+
+/* Have the local APIC timer interrupt the calling CPU once, ms from now */
+void lapic_timer_oneshot(uint64_t ms) {
+    uint64_t count = ms * cpu_locals[current_cpu].lapic_timer_freq;
+    if (count > 0xffffffff)
+        count = 0xffffffff;
+    if (!count)
+        count = 1;
+
+    lapic_write(APICREG_LVT_TIMER, APIC_TIMER_VECTOR);
+    lapic_write(APICREG_TIMER_INIT, (uint32_t)count);
+}
+
+void lapic_timer_stop(void) {
+    lapic_write(APICREG_TIMER_INIT, 0);
 }
 
 /* Read from the `io_apic_num`'th I/O APIC as described by the MADT */
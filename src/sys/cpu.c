@@ -3,6 +3,7 @@
 #include <sys/panic.h>
 
 unsigned int cpu_simd_region_size;
+int cpu_pcid_enabled = 0;
 
 void (*cpu_save_simd)(void *);
 void (*cpu_restore_simd)(void *);
@@ -10,6 +11,7 @@ void (*cpu_restore_simd)(void *);
 #define XSAVE_BIT (1 << 26)
 #define AVX_BIT (1 << 28)
 #define AVX512_BIT (1 << 16)
+#define PCID_BIT (1 << 17)
 
 void syscall_entry(void);
 
@@ -19,6 +21,8 @@ void init_cpu_features(void) {
     cr0 = read_cr("0");
     cr0 &= ~(1 << 2);
     cr0 |=  (1 << 1);
+    // Make ring 0 honour read-only pages, needed for copy-on-write
+    cr0 |=  (1 << 16);
     write_cr("0", cr0);
 
     uint64_t cr4 = 0;
@@ -48,6 +52,16 @@ void init_cpu_features(void) {
     uint32_t a, b, c, d;
     cpuid(1, 0, &a, &b, &c, &d);
 
+    // Enable global pages, used for the kernel's higher half
+    cr4 = read_cr("4");
+    cr4 |= (1 << 7);
+    // Enable PCIDs, this requires the PCID field of CR3 to be 0 at this point
+    if ((c & PCID_BIT) && !(read_cr("3") & 0xfff)) {
+        cr4 |= (1 << 17);
+        cpu_pcid_enabled = 1;
+    }
+    write_cr("4", cr4);
+
     if ((c & XSAVE_BIT)) {
         cr4 = read_cr("4");
         cr4 |= (1 << 18); // Enable XSAVE and x{get, set}bv
@@ -18,6 +18,8 @@
 
 #define load_fs_base(base) wrmsr(0xc0000100, base)
 
+struct pagemap_t;
+
 struct cpu_local_t {
     /* DO NOT MOVE THESE MEMBERS FROM THESE LOCATIONS */
     /* DO NOT CHANGE THEIR TYPES */
@@ -35,11 +37,19 @@ struct cpu_local_t {
     uint8_t lapic_id;
     int ipi_abortexec_received;
     int ipi_resched_received;
+    struct pagemap_t *active_pagemap;
+    uint64_t pcid_generation;
+    uint16_t pcid_next;
+    /* NUMA node of the CPU, where its page allocations come from */
+    int numa_node;
+    /* Local APIC timer ticks per millisecond */
+    uint32_t lapic_timer_freq;
 };
 
 extern struct cpu_local_t cpu_locals[MAX_CPUS];
 
 extern unsigned int cpu_simd_region_size;
+extern int cpu_pcid_enabled;
 
 extern void (*cpu_save_simd)(void *);
 extern void (*cpu_restore_simd)(void *);
@@ -56,6 +66,35 @@ void init_cpu_features();
     cr; \
 })
 
+/* Disable interrupts, returning the previous RFLAGS for restore_if() */
+static inline size_t save_and_cli(void) {
+    size_t rflags;
+    asm volatile (
+        "pushfq;"
+        "pop %0;"
+        "cli;"
+        : "=r" (rflags)
+        :
+        : "memory"
+    );
+    return rflags;
+}
+
+static inline void restore_if(size_t rflags) {
+    if (rflags & 0x200)
+        asm volatile ("sti" ::: "memory");
+}
+
+static inline int interrupts_enabled(void) {
+    size_t rflags;
+    asm volatile (
+        "pushfq;"
+        "pop %0;"
+        : "=r" (rflags)
+    );
+    return !!(rflags & 0x200);
+}
+
 #define invlpg(addr) ({ \
     asm volatile ( \
         "invlpg [%0];" \
@@ -64,6 +64,26 @@ static const char *exception_names[] = {
 };
 
 void exception_handler(int exception, struct regs_t *regs, size_t error_code) {
+    if (exception == EXC_PAGEFAULT) {
+        /* Faults on user addresses, from userspace or from the kernel touching
+         * user buffers, may just be copy-on-write or not yet populated pages */
+        size_t cr2 = read_cr("2");
+        pid_t current_process = cpu_locals[current_cpu].current_process;
+        if (current_process > 0 && cr2 < (size_t)0x800000000000) {
+            /* Like a syscall, the fault takes locks and may wait on I/O, a
+             * kill has to wait for it to be over */
+            struct thread_t *thread = task_table[cpu_locals[current_cpu].current_task];
+            int in_fault = locked_write(int, &thread->in_fault, 1);
+            if (regs->rflags & 0x200)
+                asm volatile ("sti");
+            int ret = vmm_handle_fault(process_table[current_process]->pagemap, cr2, error_code);
+            asm volatile ("cli");
+            locked_write(int, &thread->in_fault, in_fault);
+            if (!ret)
+                return;
+        }
+    }
+
     if (regs->cs == 0x23) {
         // userspace
         switch (exception) {
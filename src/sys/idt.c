@@ -81,11 +81,13 @@ void init_idt(void) {
     register_interrupt_handler(0x1e, exc_security_handler, 0, 0x8e);
 
     register_interrupt_handler(0x20, irq0_handler, 0, 0x8e);
+    register_interrupt_handler(APIC_TIMER_VECTOR, lapic_timer_handler, 0, 0x8e);
 
     /* Inter-processor interrupts */
     register_interrupt_handler(IPI_ABORT, ipi_abort, 1, 0x8e);
     register_interrupt_handler(IPI_RESCHED, ipi_resched, 1, 0x8e);
     register_interrupt_handler(IPI_ABORTEXEC, ipi_abortexec, 1, 0x8e);
+    register_interrupt_handler(IPI_SHOOTDOWN, ipi_shootdown, 1, 0x8e);
 
     /* Register dummy legacy PIC handlers */
     for (size_t i = 0; i < 8; i++)
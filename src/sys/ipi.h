@@ -5,9 +5,11 @@
 #define IPI_ABORT (IPI_BASE + 0)
 #define IPI_RESCHED (IPI_BASE + 1)
 #define IPI_ABORTEXEC (IPI_BASE + 2)
+#define IPI_SHOOTDOWN (IPI_BASE + 3)
 
 void ipi_abort(void);
 void ipi_resched(void);
 void ipi_abortexec(void);
+void ipi_shootdown(void);
 
 #endif
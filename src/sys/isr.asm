@@ -58,6 +58,7 @@
 global ipi_abort
 global ipi_resched
 global ipi_abortexec
+global ipi_shootdown
 
 ; Misc.
 extern task_resched_bsp
@@ -88,15 +89,25 @@ int_event: resq 256
 align 16
 raise_int_%1:
     lock inc dword [int_event+%1*4]
-    push rax
-    mov rax, qword [lapic_eoi_ptr]
-    mov dword [rax], 0
-    pop rax
-    iretq
+    pusham
+    mov rdi, int_event+%1*4
+    jmp raise_int_common
 %endmacro
 
 section .text
 
+; Wake whoever waits on the event in rdi, then EOI
+extern event_wake
+raise_int_common:
+    xor rbp, rbp
+    call event_wake
+
+    mov rax, qword [lapic_eoi_ptr]
+    mov dword [rax], 0
+
+    popam
+    iretq
+
 %assign i 0
 %rep 256
 raise_int i
@@ -255,6 +266,20 @@ ipi_resched:
     popam
     iretq
 
+align 16
+ipi_shootdown:
+    pusham
+
+    extern tlb_shootdown_poll
+    xor rbp, rbp
+    call tlb_shootdown_poll
+
+    mov rax, qword [lapic_eoi_ptr]
+    mov dword [rax], 0
+
+    popam
+    iretq
+
 align 16
 ipi_abort:
     lock inc qword [gs:0040]
@@ -359,6 +384,16 @@ syscall_table:
     dq syscall_umount ;42
     extern syscall_poll
     dq syscall_poll ;43
+    extern syscall_free_at
+    dq syscall_free_at ;44
+    extern syscall_mmap
+    dq syscall_mmap ;45
+    extern syscall_munmap
+    dq syscall_munmap ;46
+    extern syscall_mprotect
+    dq syscall_mprotect ;47
+    extern syscall_getcachestats
+    dq syscall_getcachestats ;48
   .end:
 
 section .text
@@ -436,3 +471,22 @@ irq0_handler:
 
     popam
     iretq
+
+; Local APIC timer thunk
+
+align 16
+global lapic_timer_handler
+lapic_timer_handler:
+    pusham
+
+    mov rax, qword [lapic_eoi_ptr]
+    mov dword [rax], 0
+
+    mov rdi, rsp
+
+    extern task_resched_timer
+    xor rbp, rbp
+    call task_resched_timer
+
+    popam
+    iretq
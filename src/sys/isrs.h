@@ -8,6 +8,7 @@
 #include <lib/klib.h>
 
 extern void irq0_handler(void);
+extern void lapic_timer_handler(void);
 
 __attribute__((interrupt)) static void pic0_generic_handler(void *p) {
     (void)p;
@@ -4,9 +4,7 @@
 #include <sys/pit.h>
 #include <sys/apic.h>
 
-int init_pit(void) {
-    kprint(KPRN_INFO, "pit: Setting frequency to %uHz", PIT_FREQUENCY_HZ);
-
+static void pit_set_divisor(void) {
     uint16_t x = 1193182 / PIT_FREQUENCY_HZ;
     if ((1193182 % PIT_FREQUENCY_HZ) > (PIT_FREQUENCY_HZ / 2))
         x++;
@@ -15,6 +13,12 @@ int init_pit(void) {
     io_wait();
     port_out_b(0x40, (uint8_t)((x & 0xff00) >> 8));
     io_wait();
+}
+
+int init_pit(void) {
+    kprint(KPRN_INFO, "pit: Setting frequency to %uHz", PIT_FREQUENCY_HZ);
+
+    pit_set_divisor();
 
     kprint(KPRN_INFO, "pit: Frequency updated");
 
@@ -23,3 +27,17 @@ int init_pit(void) {
 
     return 0;
 }
+
+/* Stop channel 0 from ticking, in mode 0 it waits for a count that never
+ * comes */
+void pit_stop(void) {
+    port_out_b(0x43, 0x30);
+    io_wait();
+}
+
+/* Get channel 0 ticking again, as a rate generator */
+void pit_start(void) {
+    port_out_b(0x43, 0x34);
+    io_wait();
+    pit_set_divisor();
+}
@@ -4,5 +4,7 @@
 #define PIT_FREQUENCY_HZ 1000
 
 int init_pit(void);
+void pit_stop(void);
+void pit_start(void);
 
 #endif
@@ -4,6 +4,7 @@
 #include <sys/apic.h>
 #include <acpi/acpi.h>
 #include <acpi/madt.h>
+#include <acpi/srat.h>
 #include <sys/panic.h>
 #include <sys/smp.h>
 #include <sys/cpu.h>
@@ -49,6 +50,10 @@ struct stack_t {
 
 static struct stack_t cpu_stacks[MAX_CPUS] __attribute__((aligned(PAGE_SIZE)));
 
+/* APs done calibrating their timer against the PIT, which only ticks as
+ * long as the BSP has interrupts enabled */
+static int aps_calibrated = 0;
+
 static void ap_kernel_entry(void) {
     /* APs jump here after initialisation */
 
@@ -58,6 +63,10 @@ static void ap_kernel_entry(void) {
     init_cpu_features();
     lapic_enable();
 
+    /* Its timer drives the timeslices of the AP */
+    lapic_timer_calibrate();
+    locked_inc(&aps_calibrated);
+
     /* Enable interrupts */
     asm volatile ("sti");
 
@@ -76,6 +85,7 @@ static inline void setup_cpu_local(int cpu_number, uint8_t lapic_id) {
     cpu_locals[cpu_number].current_thread = -1;
     cpu_locals[cpu_number].current_task = -1;
     cpu_locals[cpu_number].lapic_id = lapic_id;
+    cpu_locals[cpu_number].numa_node = srat_apic_node(lapic_id);
 
     /* Prepare TSS */
     cpu_tss[cpu_number].rsp0 = (uint64_t)&cpu_stacks[cpu_number].stack[CPU_STACK_SIZE];
@@ -114,12 +124,16 @@ static int start_ap(uint8_t target_apic_id, int cpu_number) {
 }
 
 static void init_cpu0(void) {
-    setup_cpu_local(0, 0);
+    /* The BSP is not necessarily APIC ID 0, and its node depends on it */
+    setup_cpu_local(0, lapic_read(APICREG_ID) >> 24);
 
     struct cpu_local_t *cpu_local = &cpu_locals[0];
     struct tss_t *tss = &cpu_tss[0];
 
     smp_init_cpu0_local(cpu_local, tss);
+
+    lapic_timer_calibrate();
+    time_calibrate_tsc();
 }
 
 void init_smp(void) {
@@ -143,8 +157,8 @@ void init_smp(void) {
         }
 
         smp_cpu_count++;
-        /* wait a bit */
-        ksleep(10);
+        /* Keep the PIT ticking until the AP has its timer calibrated */
+        while (locked_read(int, &aps_calibrated) < smp_cpu_count - 1);
     }
 
     kprint(KPRN_INFO, "smp: Total CPU count: %u", smp_cpu_count);
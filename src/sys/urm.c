@@ -164,11 +164,11 @@ static void exit_receive_request(struct exit_request_t *exit_request) {
         panic(NULL, 0, "Going nowhere without my init!");
 
     /* Kill all associated threads */
-    for (size_t i = 0; i < MAX_THREADS; i++)
+    for (size_t i = 0; i < process->thread_cap; i++)
         task_tkill(exit_request->pid, i);
 
     /* Close all file handles */
-    for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
+    for (size_t i = 0; i < process->file_handles_cap; i++) {
         if (process->file_handles[i] == -1)
             continue;
         close(process->file_handles[i]);
@@ -22,7 +22,7 @@ static uint32_t xhci_get_epno(int epno, int dir) {
 }
 
 static int xhci_setup_seg(struct xhci_seg *seg, uint32_t size, uint32_t type) {
-    void *addr = kalloc(size);
+    void *addr = kalloc_tagged(size, MEM_TAG_DEVICES);
     seg->trbs = addr;
     seg->trbs_dma = (size_t)seg->trbs - MEM_PHYS_OFFSET;
     struct xhci_link_trb *link;
@@ -40,7 +40,7 @@ static int xhci_setup_seg(struct xhci_seg *seg, uint32_t size, uint32_t type) {
         link->addr = seg->trbs_dma;
         link->field2 = 0;
         link->field3 = (0x1 | TRB_CMD_TYPE(TRB_LINK));
-        seg->seg_events = kalloc(sizeof(struct xhci_event) * 4096);
+        seg->seg_events = kalloc_tagged(sizeof(struct xhci_event) * 4096, MEM_TAG_DEVICES);
     }
     seg->lock = new_lock;
     return 1;
@@ -171,7 +171,7 @@ static int xhci_configure_ep(struct xhci_hcd *xhcd, uint32_t slot_id,
  */
 
 void xhci_setup_context(struct xhci_ctx *ctx, uint32_t size, uint32_t type) {
-    void *addr = kalloc(size);
+    void *addr = kalloc_tagged(size, MEM_TAG_DEVICES);
     ctx->addr = (uint8_t *)addr;
     ctx->dma_addr = (size_t)ctx->addr - MEM_PHYS_OFFSET;
     ctx->type = type;
@@ -275,7 +275,7 @@ int xhci_init_device(struct xhci_hcd *controller, uint32_t port,
            controller->slot_id, port);
     uint32_t slot_id = controller->slot_id;
 
-    struct xhci_dev *xhci_dev = kalloc(sizeof(xhci_dev));
+    struct xhci_dev *xhci_dev = kalloc_tagged(sizeof(struct xhci_dev), MEM_TAG_DEVICES);
     struct xhci_slot_ctx *slot;
     struct xhci_control_ctx *ctrl;
     struct xhci_ep_ctx *ep0;
@@ -356,7 +356,7 @@ static struct xhci_ep_ctx *xhci_get_ep_ctx(volatile struct xhci_ctx *ctx,
 }
 
 int xhci_setup_endpoint(struct usb_dev_t *dev, int address, int max_packet) {
-    struct xhci_endpoint *ep = kalloc(sizeof(struct xhci_endpoint));
+    struct xhci_endpoint *ep = kalloc_tagged(sizeof(struct xhci_endpoint), MEM_TAG_DEVICES);
     ep->lock = new_lock;
     struct xhci_hcd *controller = dev->internal_controller;
     struct xhci_dev *xdev = controller->xdevs[dev->hcd_devno];
@@ -785,7 +785,7 @@ void xhci_controller_init(struct pci_device_t *pci_dev) {
 
     panic_unless((pci_read_device_dword(pci_dev, 0x10) & 0b111) == 0b100);
 
-    struct xhci_hcd *controller = kalloc(sizeof(struct xhci_hcd));
+    struct xhci_hcd *controller = kalloc_tagged(sizeof(struct xhci_hcd), MEM_TAG_DEVICES);
     size_t base = bar.base + MEM_PHYS_OFFSET;
     controller->cap_regs = (struct xhci_cap_regs *)(base);
     controller->op_regs =
@@ -796,8 +796,9 @@ void xhci_controller_init(struct pci_device_t *pci_dev) {
         (struct xhci_db_regs *)(base + (controller->cap_regs->dboff));
 
     // Allocate as many devices as there are slots available.
-    controller->xdevs = kalloc(sizeof(struct xhci_dev) *
-                               (controller->cap_regs->hcsparams1 & 0xFF));
+    controller->xdevs = kalloc_tagged(sizeof(struct xhci_dev) *
+                                      (controller->cap_regs->hcsparams1 & 0xFF),
+                                      MEM_TAG_DEVICES);
 
     xhci_take_controller(controller);
 
@@ -830,7 +831,7 @@ void xhci_controller_init(struct pci_device_t *pci_dev) {
         controller->context_size = 32;
     }
 
-    controller->dcbaap = kalloc(2048);
+    controller->dcbaap = kalloc_tagged(2048, MEM_TAG_DEVICES);
     controller->dcbaap_dma = (size_t)controller->dcbaap - MEM_PHYS_OFFSET;
     controller->op_regs->dcbaap = controller->dcbaap_dma;
 
@@ -838,10 +839,13 @@ void xhci_controller_init(struct pci_device_t *pci_dev) {
     uint32_t hcs2 = controller->cap_regs->hcsparams2;
     int spb = ((((hcs2) >> 16) & 0x3e0) | (((hcs2) >> 27) & 0x1f));
     if (spb) {
-        controller->scratchpad_buffer_array = kalloc(sizeof(uint64_t) * spb);
+        /* Has to be 64 byte aligned, which small kalloc() objects need
+         * not be */
+        controller->scratchpad_buffer_array = (uint64_t *)((size_t)pmm_allocz_tagged(
+            DIV_ROUNDUP(sizeof(uint64_t) * spb, PAGE_SIZE), MEM_TAG_DEVICES) + MEM_PHYS_OFFSET);
         kprint(KPRN_INFO, "usb/xhci: allocating %x scratchpad_buffers", spb);
         for (int i = 0; i < spb; i++) {
-            size_t scratchpad_buffer = (size_t)kalloc(PAGE_SIZE);
+            size_t scratchpad_buffer = (size_t)kalloc_tagged(PAGE_SIZE, MEM_TAG_DEVICES);
             controller->scratchpad_buffer_array[i] =
                 scratchpad_buffer - MEM_PHYS_OFFSET;
         }
@@ -855,7 +859,7 @@ void xhci_controller_init(struct pci_device_t *pci_dev) {
     xhci_setup_seg(&controller->ering, 4096, TYPE_EVENT);
 
     // Set up event ring segment table.
-    controller->erst.entries = kalloc(4096);
+    controller->erst.entries = kalloc_tagged(4096, MEM_TAG_DEVICES);
     controller->erst.dma = (size_t)controller->erst.entries - MEM_PHYS_OFFSET;
     controller->erst.num_segs = 1;
     controller->erst.entries->addr = controller->ering.trbs_dma;
@@ -902,7 +906,7 @@ void xhci_controller_init(struct pci_device_t *pci_dev) {
 }
 
 struct usb_hc_t *usb_init_xhci(void) {
-    xhci_controller = kalloc(sizeof(struct usb_hc_t));
+    xhci_controller = kalloc_tagged(sizeof(struct usb_hc_t), MEM_TAG_DEVICES);
     xhci_controller->send_control = xhci_send_control;
     xhci_controller->send_bulk = xhci_send_bulk;
     xhci_controller->setup_endpoint = xhci_setup_endpoint;
@@ -22,7 +22,7 @@ void *get_configuration_space(struct usb_dev_t *device, uint8_t num) {
     struct usb_config_t config = {0};
     ;
     usb_get_descriptor(device, 2, 0, &config, sizeof(struct usb_config_t));
-    void *res = kalloc(config.total_length);
+    void *res = kalloc_tagged(config.total_length, MEM_TAG_DEVICES);
     usb_get_descriptor(device, 2, num, res, config.total_length);
     return res;
 }